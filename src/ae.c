@@ -41,35 +41,83 @@
 #include <errno.h>
 
 #include "ae.h"
+#include "trace.h"
+
+/* Monotonic clock for the loop statistics, in microseconds */
+static long long aeUstime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+static int aeHistBucket(long long us) {
+    int b = us > 0 ? 64 - __builtin_clzll((unsigned long long)us) : 0;
+
+    return b < AE_HIST_BUCKETS ? b : AE_HIST_BUCKETS-1;
+}
+
+/* Account for a callback of a file event, or of a time event if fd is -1 */
+static void aeAccountCallback(aeEventLoop *eventLoop, int fd, long long us) {
+    aeLoopStats *st = &eventLoop->stats;
+
+    if (fd >= 0)
+        st->file_us += us;
+    else
+        st->time_us += us;
+    st->callbacks++;
+    st->callback_hist[aeHistBucket(us)]++;
+    if (us > st->callback_max_us) st->callback_max_us = us;
+
+    if (eventLoop->slow_us && us >= eventLoop->slow_us) {
+        st->slow_callbacks++;
+        if (eventLoop->slowproc) eventLoop->slowproc(eventLoop, fd, us);
+    }
+}
+
+/* Call the handlers of a fired event, the read handler first. Either one
+ * may delete the event, the mask is checked again before each call. Both
+ * count as one callback, timed from start, and are charged to the account
+ * the event had when it fired. Returns the time they ended, the start of
+ * the next one. */
+static long long aeDispatch(aeEventLoop *eventLoop, aeFileEvent *fe, int mask,
+        long long start) {
+    aeAccountProc *accountProc = fe->accountProc;
+    void *accountData = fe->accountData;
+    long long end;
+
+    if (fe->mask & mask & AE_READABLE)
+        fe->rfileProc(eventLoop,fe->fd,fe->clientData,mask);
+    mask &= ~AE_READABLE;
+    if (fe->mask & mask & AE_WRITABLE)
+        fe->wfileProc(eventLoop,fe->fd,fe->clientData,mask);
+
+    end = aeUstime();
+    aeAccountCallback(eventLoop, fe->fd, end - start);
+    if (accountProc) accountProc(eventLoop, accountData, end - start);
+    return end;
+}
 
 #include "ae_epoll.c"
 
 aeEventLoop *aeCreateEventLoop(int setsize) {
     aeEventLoop *eventLoop;
-    int i;
 
-    if ((eventLoop = malloc(sizeof(*eventLoop))) == NULL) goto err;
-    eventLoop->events = malloc(sizeof(aeFileEvent)*setsize);
-    eventLoop->fired = malloc(sizeof(aeFiredEvent)*setsize);
-    if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
+    if ((eventLoop = calloc(1, sizeof(*eventLoop))) == NULL) goto err;
+    eventLoop->events = calloc(setsize, sizeof(aeFileEvent*));
+    if (eventLoop->events == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
     eventLoop->timeEventHead = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
     if (aeApiCreate(eventLoop) == -1) goto err;
-    /* Events with mask == AE_NONE are not set. So let's initialize the
-     * vector with it. */
-    for (i = 0; i < setsize; i++)
-        eventLoop->events[i].mask = AE_NONE;
     return eventLoop;
 
 err:
     if (eventLoop) {
         free(eventLoop->events);
-        free(eventLoop->fired);
         free(eventLoop);
     }
     return NULL;
@@ -86,29 +134,50 @@ int aeGetSetSize(aeEventLoop *eventLoop) {
  * set size minus one, AE_ERR is returned and the operation is not
  * performed at all.
  *
- * Otherwise AE_OK is returned and the operation is successful. */
+ * Otherwise AE_OK is returned and the operation is successful. Tables
+ * grow by themselves as descriptors are registered, this is only needed
+ * to shrink them, which must not happen from a file event handler. */
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
+    aeFileEvent **events;
     int i;
 
     if (setsize == eventLoop->setsize) return AE_OK;
     if (eventLoop->maxfd >= setsize) return AE_ERR;
-    if (aeApiResize(eventLoop,setsize) == -1) return AE_ERR;
 
-    eventLoop->events = realloc(eventLoop->events,sizeof(aeFileEvent)*setsize);
-    eventLoop->fired = realloc(eventLoop->fired,sizeof(aeFiredEvent)*setsize);
-    eventLoop->setsize = setsize;
+    /* Slots past the new size are unused but may still be allocated */
+    for (i = setsize; i < eventLoop->setsize; i++) {
+        free(eventLoop->events[i]);
+        eventLoop->events[i] = NULL;
+    }
 
-    /* Make sure that if we created new slots, they are initialized with
-     * an AE_NONE mask. */
-    for (i = eventLoop->maxfd+1; i < setsize; i++)
-        eventLoop->events[i].mask = AE_NONE;
+    events = realloc(eventLoop->events,sizeof(aeFileEvent*)*setsize);
+    if (events == NULL) return AE_ERR;
+    eventLoop->events = events;
+
+    /* Make sure that if we created new slots, they are empty. */
+    for (i = eventLoop->setsize; i < setsize; i++)
+        eventLoop->events[i] = NULL;
+    eventLoop->setsize = setsize;
     return AE_OK;
 }
 
+/* Grow the fd table to hold fd, doubling so that resizes stay rare while
+ * thousands of clients connect. */
+static int aeGrowSetSize(aeEventLoop *eventLoop, int fd) {
+    int setsize = eventLoop->setsize;
+
+    while (setsize <= fd)
+        setsize *= 2;
+    return aeResizeSetSize(eventLoop, setsize);
+}
+
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    int i;
+
     aeApiFree(eventLoop);
+    for (i = 0; i < eventLoop->setsize; i++)
+        free(eventLoop->events[i]);
     free(eventLoop->events);
-    free(eventLoop->fired);
     free(eventLoop);
 }
 
@@ -119,13 +188,30 @@ void aeStop(aeEventLoop *eventLoop) {
 int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData)
 {
-    if (fd >= eventLoop->setsize) {
-        errno = ERANGE;
+    aeFileEvent *fe;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return AE_ERR;
+    }
+    if (fd >= eventLoop->setsize &&
+        aeGrowSetSize(eventLoop, fd) == AE_ERR) {
+        errno = ENOMEM;
         return AE_ERR;
     }
-    aeFileEvent *fe = &eventLoop->events[fd];
 
-    if (aeApiAddEvent(eventLoop, fd, mask) == -1)
+    fe = eventLoop->events[fd];
+    if (fe == NULL) {
+        fe = calloc(1, sizeof(*fe));
+        if (fe == NULL) {
+            errno = ENOMEM;
+            return AE_ERR;
+        }
+        fe->fd = fd;
+        eventLoop->events[fd] = fe;
+    }
+
+    if (aeApiAddEvent(eventLoop, fe, mask) == -1)
         return AE_ERR;
     fe->mask |= mask;
     if (mask & AE_READABLE) fe->rfileProc = proc;
@@ -138,36 +224,56 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
 
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
 {
-    if (fd >= eventLoop->setsize) return;
-    aeFileEvent *fe = &eventLoop->events[fd];
-    if (fe->mask == AE_NONE) return;
+    if (fd < 0 || fd >= eventLoop->setsize) return;
+    aeFileEvent *fe = eventLoop->events[fd];
+    if (fe == NULL || fe->mask == AE_NONE) return;
 
-    aeApiDelEvent(eventLoop, fd, mask);
+    aeApiDelEvent(eventLoop, fe, mask);
     fe->mask = fe->mask & (~mask);
+    if (fe->mask == AE_NONE) {
+        fe->accountProc = NULL;
+        fe->accountData = NULL;
+    }
     if (fd == eventLoop->maxfd && fe->mask == AE_NONE) {
         /* Update the max fd */
         int j;
 
         for (j = eventLoop->maxfd-1; j >= 0; j--)
-            if (eventLoop->events[j].mask != AE_NONE) break;
+            if (eventLoop->events[j] &&
+                eventLoop->events[j]->mask != AE_NONE) break;
         eventLoop->maxfd = j;
     }
 }
 
+/* Have the time spent in the callbacks of a registered event passed to proc
+ * with accountData, until the event is deleted. */
+int aeSetFileEventAccount(aeEventLoop *eventLoop, int fd,
+        aeAccountProc *proc, void *accountData) {
+    if (fd < 0 || fd >= eventLoop->setsize) return AE_ERR;
+    aeFileEvent *fe = eventLoop->events[fd];
+    if (fe == NULL || fe->mask == AE_NONE) return AE_ERR;
+
+    fe->accountProc = proc;
+    fe->accountData = accountData;
+    return AE_OK;
+}
+
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
-    if (fd >= eventLoop->setsize) return 0;
-    aeFileEvent *fe = &eventLoop->events[fd];
+    if (fd < 0 || fd >= eventLoop->setsize) return 0;
+    aeFileEvent *fe = eventLoop->events[fd];
 
-    return fe->mask;
+    return fe ? fe->mask : AE_NONE;
 }
 
+/* Time events are scheduled against the monotonic clock so that deadlines
+ * are not affected by wall clock adjustments. */
 static void aeGetTime(long *seconds, long *milliseconds)
 {
-    struct timeval tv;
+    struct timespec ts;
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    *seconds = ts.tv_sec;
+    *milliseconds = ts.tv_nsec/1000000;
 }
 
 static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
@@ -203,6 +309,21 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
     return id;
 }
 
+/* Move the deadline of an existing time event to 'milliseconds' from now. */
+int aeRescheduleTimeEvent(aeEventLoop *eventLoop, long long id,
+        long long milliseconds)
+{
+    aeTimeEvent *te = eventLoop->timeEventHead;
+    while(te) {
+        if (te->id == id) {
+            aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+            return AE_OK;
+        }
+        te = te->next;
+    }
+    return AE_ERR; /* NO event with the specified ID found */
+}
+
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
     aeTimeEvent *te = eventLoop->timeEventHead;
@@ -247,24 +368,6 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
     aeTimeEvent *te, *prev;
     long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
-    }
-    eventLoop->lastTime = now;
 
     prev = NULL;
     te = eventLoop->timeEventHead;
@@ -300,10 +403,12 @@ static int processTimeEvents(aeEventLoop *eventLoop) {
         if (now_sec > te->when_sec ||
             (now_sec == te->when_sec && now_ms >= te->when_ms))
         {
+            long long start = aeUstime();
             int retval;
 
             id = te->id;
             retval = te->timeProc(eventLoop, id, te->clientData);
+            aeAccountCallback(eventLoop, -1, aeUstime() - start);
             processed++;
             if (retval != AE_NOMORE) {
                 aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
@@ -343,7 +448,6 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
      * to fire. */
     if (eventLoop->maxfd != -1 ||
         ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
-        int j;
         aeTimeEvent *shortest = NULL;
         struct timeval tv, *tvp;
 
@@ -381,27 +485,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
         }
 
+        /* Fired events are dispatched by the poller as it walks them */
         numevents = aeApiPoll(eventLoop, tvp);
-        for (j = 0; j < numevents; j++) {
-            aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
-            int mask = eventLoop->fired[j].mask;
-            int fd = eventLoop->fired[j].fd;
-
-            if (fe->mask & mask & AE_READABLE) {
-                fe->rfileProc(eventLoop,fd,fe->clientData,mask);
-                eventLoop->fired[j].mask &= ~AE_READABLE;
-            }
-        }
-        for (j = 0; j < numevents; j++) {
-            aeFileEvent *fe = &eventLoop->events[eventLoop->fired[j].fd];
-            int mask = eventLoop->fired[j].mask;
-            int fd = eventLoop->fired[j].fd;
-
-            if (fe->mask & mask & AE_WRITABLE) {
-                fe->wfileProc(eventLoop,fd,fe->clientData,mask);
-                eventLoop->fired[j].mask &= ~AE_WRITABLE;
-            }
-        }
         processed += numevents;
     }
     /* Check time events */
@@ -434,11 +519,26 @@ int aeWait(int fd, int mask, long long milliseconds) {
 }
 
 void aeMain(aeEventLoop *eventLoop) {
+    aeLoopStats *st = &eventLoop->stats;
+    long long start, poll_us, us;
+
     eventLoop->stop = 0;
     while (!eventLoop->stop) {
-        if (eventLoop->beforesleep != NULL)
+        start = aeUstime();
+        poll_us = st->poll_us;
+        if (eventLoop->beforesleep != NULL) {
             eventLoop->beforesleep(eventLoop);
+            st->beforesleep_us += aeUstime() - start;
+        }
         aeProcessEvents(eventLoop, AE_ALL_EVENTS);
+
+        /* What is not spent blocked delays whatever fires meanwhile */
+        us = aeUstime() - start;
+        st->loops++;
+        st->loop_us += us;
+        us -= st->poll_us - poll_us;
+        st->busy_hist[aeHistBucket(us)]++;
+        if (us > st->busy_max_us) st->busy_max_us = us;
     }
 }
 
@@ -449,3 +549,10 @@ char *aeGetApiName(void) {
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
+
+/* Have callbacks taking us microseconds or more reported to slowproc, with
+ * their fd (-1 for time events). 0 turns it off. */
+void aeSetSlowProc(aeEventLoop *eventLoop, long long us, aeSlowProc *slowproc) {
+    eventLoop->slow_us = us;
+    eventLoop->slowproc = slowproc;
+}
@@ -47,6 +47,10 @@
 #define AE_ALL_EVENTS (AE_FILE_EVENTS|AE_TIME_EVENTS)
 #define AE_DONT_WAIT 4
 
+/* Bucket n of the loop histograms counts durations of 2^(n-1) to 2^n - 1
+ * microseconds, bucket 0 those under one, the last one everything longer */
+#define AE_HIST_BUCKETS 16
+
 #define AE_NOMORE -1
 #define AE_DELETED_EVENT_ID -1
 
@@ -60,13 +64,19 @@ typedef void aeFileProc(struct aeEventLoop *eventLoop, int fd, void *clientData,
 typedef int aeTimeProc(struct aeEventLoop *eventLoop, long long id, void *clientData);
 typedef void aeEventFinalizerProc(struct aeEventLoop *eventLoop, void *clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop *eventLoop);
+typedef void aeSlowProc(struct aeEventLoop *eventLoop, int fd, long long us);
+typedef void aeAccountProc(struct aeEventLoop *eventLoop, void *accountData, long long us);
 
-/* File event structure */
+/* File event structure. Allocated once per fd slot and never moved, the
+ * poller hands it back as is. */
 typedef struct aeFileEvent {
+    int fd;
     int mask; /* one of AE_(READABLE|WRITABLE) */
     aeFileProc *rfileProc;
     aeFileProc *wfileProc;
     void *clientData;
+    aeAccountProc *accountProc; /* charged the time of each callback */
+    void *accountData;
 } aeFileEvent;
 
 /* Time event structure */
@@ -80,24 +90,36 @@ typedef struct aeTimeEvent {
     struct aeTimeEvent *next;
 } aeTimeEvent;
 
-/* A fired event */
-typedef struct aeFiredEvent {
-    int fd;
-    int mask;
-} aeFiredEvent;
+/* Where the loop spends its time, in microseconds. Always kept, it costs a
+ * clock read per callback and a few per iteration. */
+typedef struct aeLoopStats {
+    unsigned long long loops; /* iterations of aeMain */
+    long long loop_us; /* whole iterations */
+    long long busy_max_us; /* longest iteration not counting the poll */
+    long long beforesleep_us; /* in the before sleep hook */
+    long long poll_us; /* blocked in the poller */
+    long long file_us; /* in file event callbacks */
+    long long time_us; /* in time event callbacks */
+    unsigned long long callbacks; /* file and time event callbacks */
+    long long callback_max_us; /* slowest callback */
+    unsigned long long slow_callbacks; /* callbacks over slow_us */
+    unsigned long long busy_hist[AE_HIST_BUCKETS]; /* iterations, poll excluded */
+    unsigned long long callback_hist[AE_HIST_BUCKETS];
+} aeLoopStats;
 
 /* State of an event based program */
 typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
-    int setsize; /* max number of file descriptors tracked */
+    int setsize; /* size of the fd table, grown on demand */
     long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
-    aeFileEvent *events; /* Registered events */
-    aeFiredEvent *fired; /* Fired events */
+    aeFileEvent **events; /* Registered events by fd, NULL if never used */
     aeTimeEvent *timeEventHead;
     int stop;
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
+    aeLoopStats stats;
+    long long slow_us; /* callbacks this long are passed to slowproc, 0: off */
+    aeSlowProc *slowproc;
 } aeEventLoop;
 
 /* Prototypes */
@@ -108,15 +130,20 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData);
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd);
+int aeSetFileEventAccount(aeEventLoop *eventLoop, int fd,
+        aeAccountProc *proc, void *accountData);
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
+int aeRescheduleTimeEvent(aeEventLoop *eventLoop, long long id,
+        long long milliseconds);
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id);
 int aeProcessEvents(aeEventLoop *eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
+void aeSetSlowProc(aeEventLoop *eventLoop, long long us, aeSlowProc *slowproc);
 int aeGetSetSize(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 
@@ -34,18 +34,20 @@
 typedef struct aeApiState {
     int epfd;
     struct epoll_event *events;
+    int size; /* slots in events */
 } aeApiState;
 
 static int aeApiCreate(aeEventLoop *eventLoop) {
     aeApiState *state = malloc(sizeof(aeApiState));
 
     if (!state) return -1;
-    state->events = malloc(sizeof(struct epoll_event)*eventLoop->setsize);
+    state->size = eventLoop->setsize;
+    state->events = malloc(sizeof(struct epoll_event)*state->size);
     if (!state->events) {
         free(state);
         return -1;
     }
-    state->epfd = epoll_create(1024); /* 1024 is just a hint for the kernel */
+    state->epfd = epoll_create1(EPOLL_CLOEXEC);
     if (state->epfd == -1) {
         free(state->events);
         free(state);
@@ -55,11 +57,18 @@ static int aeApiCreate(aeEventLoop *eventLoop) {
     return 0;
 }
 
-static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+/* Follow the fd table, between polls only: handlers add events while the
+ * fired ones are walked. */
+static void aeApiResize(aeEventLoop *eventLoop) {
     aeApiState *state = eventLoop->apidata;
+    struct epoll_event *events;
 
-    state->events = realloc(state->events, sizeof(struct epoll_event)*setsize);
-    return 0;
+    if (state->size == eventLoop->setsize) return;
+    events = realloc(state->events,
+                     sizeof(struct epoll_event)*eventLoop->setsize);
+    if (!events) return; /* Keep polling with the old size */
+    state->events = events;
+    state->size = eventLoop->setsize;
 }
 
 static void aeApiFree(aeEventLoop *eventLoop) {
@@ -70,47 +79,58 @@ static void aeApiFree(aeEventLoop *eventLoop) {
     free(state);
 }
 
-static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+static int aeApiAddEvent(aeEventLoop *eventLoop, aeFileEvent *fe, int mask) {
     aeApiState *state = eventLoop->apidata;
     struct epoll_event ee = {0}; /* avoid valgrind warning */
     /* If the fd was already monitored for some event, we need a MOD
      * operation. Otherwise we need an ADD operation. */
-    int op = eventLoop->events[fd].mask == AE_NONE ?
-            EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    int op = fe->mask == AE_NONE ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
 
     ee.events = 0;
-    mask |= eventLoop->events[fd].mask; /* Merge old events */
+    mask |= fe->mask; /* Merge old events */
     if (mask & AE_READABLE) ee.events |= EPOLLIN;
     if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
-    ee.data.fd = fd;
-    if (epoll_ctl(state->epfd,op,fd,&ee) == -1) return -1;
+    ee.data.ptr = fe;
+    if (epoll_ctl(state->epfd,op,fe->fd,&ee) == -1) return -1;
     return 0;
 }
 
-static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+static void aeApiDelEvent(aeEventLoop *eventLoop, aeFileEvent *fe, int delmask) {
     aeApiState *state = eventLoop->apidata;
     struct epoll_event ee = {0}; /* avoid valgrind warning */
-    int mask = eventLoop->events[fd].mask & (~delmask);
+    int mask = fe->mask & (~delmask);
 
     ee.events = 0;
     if (mask & AE_READABLE) ee.events |= EPOLLIN;
     if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
-    ee.data.fd = fd;
+    ee.data.ptr = fe;
     if (mask != AE_NONE) {
-        epoll_ctl(state->epfd,EPOLL_CTL_MOD,fd,&ee);
+        epoll_ctl(state->epfd,EPOLL_CTL_MOD,fe->fd,&ee);
     } else {
         /* Note, Kernel < 2.6.9 requires a non null event pointer even for
          * EPOLL_CTL_DEL. */
-        epoll_ctl(state->epfd,EPOLL_CTL_DEL,fd,&ee);
+        epoll_ctl(state->epfd,EPOLL_CTL_DEL,fe->fd,&ee);
     }
 }
 
+/* Wait for events and dispatch them. The file event comes straight from
+ * the epoll data, slots are never freed while the loop runs so it stays
+ * valid even if an earlier handler of the batch deleted it. */
 static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
     aeApiState *state = eventLoop->apidata;
     int retval, numevents = 0;
-
-    retval = epoll_wait(state->epfd,state->events,eventLoop->setsize,
-            tvp ? (tvp->tv_sec*1000 + tvp->tv_usec/1000) : -1);
+    int timeout = tvp ? (tvp->tv_sec*1000 + tvp->tv_usec/1000) : -1;
+    long long start, now;
+
+    aeApiResize(eventLoop);
+
+    /* Time between the two is time asleep, the rest is time working */
+    TRACE1(loop_sleep, timeout);
+    start = aeUstime();
+    retval = epoll_wait(state->epfd,state->events,state->size,timeout);
+    now = aeUstime();
+    TRACE2(loop_wake, retval, errno);
+    eventLoop->stats.poll_us += now - start;
     if (retval > 0) {
         int j;
 
@@ -123,8 +143,7 @@ static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
             if (e->events & EPOLLOUT) mask |= AE_WRITABLE;
             if (e->events & EPOLLERR) mask |= AE_WRITABLE;
             if (e->events & EPOLLHUP) mask |= AE_WRITABLE;
-            eventLoop->fired[j].fd = e->data.fd;
-            eventLoop->fired[j].mask = mask;
+            now = aeDispatch(eventLoop, e->data.ptr, mask, now);
         }
     }
     return numevents;
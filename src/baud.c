@@ -0,0 +1,32 @@
+#include "baud.h"
+
+#include <sys/ioctl.h>
+#include <asm/termbits.h>
+
+int baudSet(int fd, int rate)
+{
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) == -1) {
+        return -1;
+    }
+
+    /* Input follows output when its rate bits are clear */
+    tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+    tio.c_cflag |= BOTHER;
+    tio.c_ospeed = rate;
+    tio.c_ispeed = rate;
+
+    return ioctl(fd, TCSETS2, &tio);
+}
+
+int baudGet(int fd)
+{
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) == -1) {
+        return -1;
+    }
+
+    return tio.c_ospeed;
+}
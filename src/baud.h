@@ -0,0 +1,32 @@
+#ifndef BAUD_H
+#define BAUD_H
+
+/* Arbitrary line rates through the termios2 interface (TCSETS2 with
+ * BOTHER), which takes the rate in bits per second and leaves the divisor
+ * to the driver. It lives apart from serial.c: <asm/termbits.h> can't be
+ * included along with <termios.h>. */
+
+#define BAUD_TOLERANCE_PERMILLE (10)  /* Warn when the rate is off by more */
+
+/**
+ * @brief Set an exact input and output rate on an open, configured tty.
+ *        Other termios settings are kept.
+ *
+ * @param[in] fd - tty
+ * @param[in] rate - Bits per second
+ *
+ * @return 0 if successful, -1 with errno set otherwise
+ */
+int baudSet(int fd, int rate);
+
+/**
+ * @brief Return the output rate a tty runs at, as reported by its driver
+ *        after rounding to what the hardware can do.
+ *
+ * @param[in] fd - tty
+ *
+ * @return Bits per second, -1 with errno set on error
+ */
+int baudGet(int fd);
+
+#endif
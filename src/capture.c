@@ -0,0 +1,332 @@
+#include "server.h"
+#include "capture.h"
+
+#include <glob.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/**
+ * @brief Build the file name of a segment.
+ */
+static void _captureSegmentPath(const capture *c, uint32_t seq,
+                                char *buf, size_t len);
+
+/**
+ * @brief Create, pre-allocate and map a new segment.
+ *
+ * @param[in] c - Capture
+ * @param[out] seg - Segment to open
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _captureOpenSegment(capture *c, captureSegment *seg);
+
+/**
+ * @brief Unmap and close a segment, truncated to what was written.
+ *
+ * @param[in] c - Capture
+ * @param[in] seg - Segment to close
+ */
+static void _captureCloseSegment(capture *c, captureSegment *seg);
+
+/**
+ * @brief Close a full segment and delete the one that falls out of the
+ *        retained set with it.
+ *
+ * @param[in] c - Capture
+ * @param[in] seg - Full segment
+ */
+static void _captureRetire(capture *c, captureSegment *seg);
+
+/**
+ * @brief Switch to the next segment, allocating it now if maintenance did
+ *        not get to it yet.
+ *
+ * @param[in] c - Capture
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _captureRotate(capture *c);
+
+/**
+ * @brief Find the sequence number following the existing segments.
+ *
+ * @param[in] c - Capture
+ */
+static uint32_t _captureNextSeq(const capture *c);
+
+static void _captureSegmentPath(const capture *c, uint32_t seq,
+                                char *buf, size_t len)
+{
+    snprintf(buf, len, "%s.%06u", c->path, seq);
+}
+
+static int _captureOpenSegment(capture *c, captureSegment *seg)
+{
+    char path[PATH_MAX + 16];
+    captureFileHeader *hdr;
+    struct timespec rt;
+    struct timespec mt;
+    int ret;
+
+    seg->seq = c->seq;
+    c->seq = c->seq == CAPTURE_MAX_SEQ ? 0 : c->seq + 1;
+    seg->used = CAPTURE_HEADER_SIZE;
+    seg->synced = 0;
+
+    _captureSegmentPath(c, seg->seq, path, sizeof(path));
+
+    seg->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (seg->fd == -1) {
+        serverLogErrno(LL_ERROR, "Can't create capture %s", path);
+        return C_ERR;
+    }
+
+    /* Blocks are reserved now so that writes never allocate */
+    ret = posix_fallocate(seg->fd, 0, c->size);
+    if (ret != 0) {
+        errno = ret;
+        serverLogErrno(LL_ERROR, "Can't allocate capture %s", path);
+        goto err;
+    }
+
+    seg->map = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    seg->fd, 0);
+    if (seg->map == MAP_FAILED) {
+        seg->map = NULL;
+        serverLogErrno(LL_ERROR, "Can't map capture %s", path);
+        goto err;
+    }
+
+    madvise(seg->map, c->size, MADV_SEQUENTIAL);
+
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mt);
+
+    hdr = (captureFileHeader*)seg->map;
+    memcpy(hdr->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+    hdr->version = CAPTURE_VERSION;
+    hdr->header_size = CAPTURE_HEADER_SIZE;
+    hdr->realtime_ns = rt.tv_sec*1000000000ULL + rt.tv_nsec;
+    hdr->monotonic_ns = mt.tv_sec*1000000000ULL + mt.tv_nsec;
+    hdr->seq = seg->seq;
+    hdr->baudrate = c->baudrate;
+    strlcpy(hdr->device, c->device, sizeof(hdr->device));
+
+    serverLog(LL_DEBUG, "Capture segment %s ready", path);
+
+    return C_OK;
+
+err:
+    close(seg->fd);
+    seg->fd = -1;
+    unlink(path);
+    return C_ERR;
+}
+
+static void _captureCloseSegment(capture *c, captureSegment *seg)
+{
+    if (seg->fd == -1) {
+        return;
+    }
+
+    if (seg->map) {
+        munmap(seg->map, c->size);
+        seg->map = NULL;
+
+        /* Readers stop at the end of file rather than at a zero record */
+        if (ftruncate(seg->fd, seg->used) == -1) {
+            serverLogErrno(LL_WARN, "Can't truncate capture segment");
+        }
+    }
+
+    close(seg->fd);
+    seg->fd = -1;
+}
+
+static void _captureRetire(capture *c, captureSegment *seg)
+{
+    char path[PATH_MAX + 16];
+    uint32_t gone;
+
+    if (seg->fd == -1) {
+        return;
+    }
+
+    _captureCloseSegment(c, seg);
+
+    gone = (seg->seq + CAPTURE_MAX_SEQ + 2 - c->files) % (CAPTURE_MAX_SEQ + 1);
+    _captureSegmentPath(c, gone, path, sizeof(path));
+    if (unlink(path) == 0) {
+        serverLog(LL_DEBUG, "Capture segment %s deleted", path);
+    }
+}
+
+static int _captureRotate(capture *c)
+{
+    if (c->next.fd == -1) {
+        c->stalls++;
+        if (_captureOpenSegment(c, &c->next) == C_ERR) {
+            return C_ERR;
+        }
+    }
+
+    /* Closing is left to maintenance unless it fell behind twice */
+    _captureRetire(c, &c->old);
+
+    c->old = c->cur;
+    c->cur = c->next;
+    c->next.fd = -1;
+    c->next.map = NULL;
+
+    serverScheduleJob(CRON_CAPTURE, 0);
+
+    return C_OK;
+}
+
+static uint32_t _captureNextSeq(const capture *c)
+{
+    char pattern[PATH_MAX + 16];
+    glob_t g;
+    uint32_t next = 0;
+    unsigned long seq;
+    size_t len = strlen(c->path);
+    size_t j;
+    char *end;
+
+    snprintf(pattern, sizeof(pattern), "%s.[0-9]*", c->path);
+
+    if (glob(pattern, 0, NULL, &g) != 0) {
+        return 0;
+    }
+
+    for (j = 0; j < g.gl_pathc; j++) {
+        seq = strtoul(g.gl_pathv[j] + len + 1, &end, 10);
+        if (*end == '\0' && seq < CAPTURE_MAX_SEQ && seq + 1 > next) {
+            next = seq + 1;
+        }
+    }
+
+    globfree(&g);
+
+    return next;
+}
+
+capture *captureCreate(const char *path, const char *device, int baudrate,
+                       size_t size, int files)
+{
+    capture *c;
+
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+
+    strlcpy(c->path, path, sizeof(c->path));
+    strlcpy(c->device, device, sizeof(c->device));
+    c->baudrate = baudrate;
+    c->size = size;
+    c->files = files;
+    c->cur.fd = -1;
+    c->next.fd = -1;
+    c->old.fd = -1;
+    c->seq = _captureNextSeq(c);
+
+    if (_captureOpenSegment(c, &c->cur) == C_ERR) {
+        free(c);
+        return NULL;
+    }
+
+    serverScheduleJob(CRON_CAPTURE, 0);
+
+    return c;
+}
+
+void captureFree(capture *c)
+{
+    if (!c) {
+        return;
+    }
+
+    _captureRetire(c, &c->old);
+    _captureCloseSegment(c, &c->cur);
+
+    /* Never written to, do not leave an empty segment behind */
+    if (c->next.fd != -1) {
+        char path[PATH_MAX + 16];
+
+        _captureSegmentPath(c, c->next.seq, path, sizeof(path));
+        _captureCloseSegment(c, &c->next);
+        unlink(path);
+    }
+
+    free(c);
+}
+
+void captureWrite(capture *c, int dir, const struct iovec *iov, int iovcnt)
+{
+    captureRecord *rec;
+    struct timespec ts;
+    uint64_t now;
+    size_t recsize;
+    int j;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec*1000000000ULL + ts.tv_nsec;
+
+    for (j = 0; j < iovcnt; j++) {
+        recsize = CAPTURE_RECORD_SIZE(iov[j].iov_len);
+
+        if (recsize > c->size - CAPTURE_HEADER_SIZE) {
+            c->drops++;
+            continue;
+        }
+
+        if (c->cur.fd == -1 ||
+            c->cur.used + recsize > c->size) {
+            if (_captureRotate(c) == C_ERR) {
+                c->drops++;
+                continue;
+            }
+        }
+
+        rec = (captureRecord*)(c->cur.map + c->cur.used);
+        memcpy(rec + 1, iov[j].iov_base, iov[j].iov_len);
+        rec->len = iov[j].iov_len;
+        rec->flags = 0;
+        rec->reserved = 0;
+        rec->timestamp = now;
+        rec->dir = dir;
+
+        c->cur.used += recsize;
+        c->records++;
+        c->bytes += iov[j].iov_len;
+    }
+}
+
+void captureMaintain(capture *c)
+{
+    size_t pagemask = sysconf(_SC_PAGESIZE) - 1;
+    size_t end;
+
+    /* Start write back of the pages completed since the last run. The page
+     * still being appended to is left alone: writing to a page under write
+     * back waits for the disk */
+    end = c->cur.used & ~pagemask;
+    if (c->cur.fd != -1 && end > c->cur.synced) {
+        if (msync(c->cur.map + c->cur.synced, end - c->cur.synced,
+                  MS_ASYNC) == -1) {
+            serverLogErrno(LL_WARN, "msync");
+        }
+        c->cur.synced = end;
+    }
+
+    _captureRetire(c, &c->old);
+
+    if (c->next.fd == -1) {
+        _captureOpenSegment(c, &c->next);
+    }
+}
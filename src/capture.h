@@ -0,0 +1,122 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <linux/limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* A capture is a series of pre-allocated segment files <path>.<seq>, seq
+ * increasing, only the newest capture-files are kept. Each segment starts
+ * with a captureFileHeader (CAPTURE_HEADER_SIZE bytes) followed by records:
+ * a captureRecord and its payload, padded to CAPTURE_ALIGN. A record with
+ * a zero length and direction (the pre-allocated zeroes) ends the segment.
+ * All integers are in host byte order. */
+
+#define CAPTURE_MAGIC          "SPCAP1"
+#define CAPTURE_VERSION        (1)
+#define CAPTURE_HEADER_SIZE    (512)
+#define CAPTURE_ALIGN          (8)
+#define CAPTURE_DEFAULT_SIZE   (64*1024*1024)
+#define CAPTURE_MIN_SIZE       (1024*1024)
+#define CAPTURE_DEFAULT_FILES  (4)
+#define CAPTURE_MAX_SEQ        (999999)
+
+/* Record directions */
+enum {
+    CAPTURE_RX = 1,                    /* Read from the master device */
+    CAPTURE_TX = 2,                    /* Written to the master device */
+};
+
+typedef struct captureFileHeader {
+    char magic[8];                     /* CAPTURE_MAGIC */
+    uint32_t version;                  /* CAPTURE_VERSION */
+    uint32_t header_size;              /* Offset of the first record */
+    uint64_t realtime_ns;              /* CLOCK_REALTIME at creation */
+    uint64_t monotonic_ns;             /* CLOCK_MONOTONIC at the same time */
+    uint32_t seq;                      /* Segment sequence number */
+    uint32_t baudrate;                 /* Baudrate of the master */
+    char device[256];                  /* Master device path */
+} captureFileHeader;
+
+typedef struct captureRecord {
+    uint64_t timestamp;                /* CLOCK_MONOTONIC nanoseconds */
+    uint32_t len;                      /* Payload length */
+    uint8_t dir;                       /* CAPTURE_RX or CAPTURE_TX */
+    uint8_t flags;                     /* Reserved */
+    uint16_t reserved;
+} captureRecord;
+
+#define CAPTURE_RECORD_SIZE(len) \
+    ((sizeof(captureRecord) + (len) + CAPTURE_ALIGN - 1) & \
+     ~(size_t)(CAPTURE_ALIGN - 1))
+
+typedef struct captureSegment {
+    int fd;                            /* Segment file, -1 if unused */
+    unsigned char *map;                /* Whole segment mapping */
+    size_t used;                       /* Bytes written */
+    size_t synced;                     /* Bytes handed to msync() */
+    uint32_t seq;                      /* Sequence number */
+} captureSegment;
+
+typedef struct capture {
+    char path[PATH_MAX];               /* Segment path prefix */
+    char device[256];                  /* Master device path */
+    int baudrate;                      /* Master baudrate */
+    size_t size;                       /* Segment size */
+    int files;                         /* Segments to keep */
+    captureSegment cur;                /* Segment being written */
+    captureSegment next;               /* Pre-allocated next segment */
+    captureSegment old;                /* Full segment waiting to be closed */
+    uint32_t seq;                      /* Sequence of the next new segment */
+    unsigned long long records;        /* Records written */
+    unsigned long long bytes;          /* Payload bytes written */
+    unsigned long long drops;          /* Records that could not be written */
+    unsigned long long stalls;         /* Segments allocated in the data path */
+} capture;
+
+/**
+ * @brief Start a capture. Sequence numbers continue after the segments
+ *        already present.
+ *
+ * @param[in] path - Segment path prefix
+ * @param[in] device - Master device path
+ * @param[in] baudrate - Master baudrate (informative)
+ * @param[in] size - Segment size in bytes
+ * @param[in] files - Number of segments to keep
+ *
+ * @return Pointer to a newly allocated capture, or NULL on error
+ */
+capture *captureCreate(const char *path, const char *device, int baudrate,
+                       size_t size, int files);
+
+/**
+ * @brief Close the segments, truncated to their used size, and free the
+ *        capture.
+ *
+ * @param[in] c - Capture
+ */
+void captureFree(capture *c);
+
+/**
+ * @brief Record buffers, one record each, all with the same timestamp. This
+ *        is a copy into the mapped segment, files are only switched, never
+ *        created here unless maintenance fell behind.
+ *
+ * @param[in] c - Capture
+ * @param[in] dir - CAPTURE_RX or CAPTURE_TX
+ * @param[in] iov - Buffers
+ * @param[in] iovcnt - Number of buffers
+ */
+void captureWrite(capture *c, int dir, const struct iovec *iov, int iovcnt);
+
+/**
+ * @brief Background work: start write back of new records, close the
+ *        previous segment, delete old segments and pre-allocate the next
+ *        one.
+ *
+ * @param[in] c - Capture
+ */
+void captureMaintain(capture *c);
+
+#endif
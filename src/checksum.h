@@ -0,0 +1,54 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Checksum kinds */
+enum {
+    CHECKSUM_NONE = 0,               /* No validation */
+    CHECKSUM_NMEA,                   /* XOR between $ and *hh */
+    CHECKSUM_UBX,                    /* 8-bit Fletcher over class..payload */
+    CHECKSUM_MODBUS,                 /* CRC-16/MODBUS in the last two bytes */
+    CHECKSUM_AUTO,                   /* NMEA or UBX, by frame start */
+};
+
+/**
+ * @brief Parse a checksum kind name.
+ *
+ * @param[in] name - none, nmea, ubx, modbus or auto
+ *
+ * @return CHECKSUM_* or -1 if the name is unknown
+ */
+int checksumFromName(const char *name);
+
+/**
+ * @brief Return the name of a checksum kind.
+ *
+ * @param[in] kind - CHECKSUM_*
+ */
+const char *checksumName(int kind);
+
+/**
+ * @brief Validate a complete frame.
+ *
+ * @param[in] kind - CHECKSUM_*
+ * @param[in] frame - Complete frame
+ * @param[in] len - Length of frame
+ *
+ * @return 1 if the frame is valid (or carries no checksum of that kind),
+ *         0 if it is corrupt
+ */
+int checksumValidate(int kind, const char *frame, size_t len);
+
+/**
+ * @brief Compute the CRC-16/MODBUS of a buffer.
+ *
+ * @param[in] buf - Buffer
+ * @param[in] len - Length of buffer
+ *
+ * @return CRC, transmitted low byte first
+ */
+uint16_t checksumCrc16Modbus(const unsigned char *buf, size_t len);
+
+#endif
@@ -42,6 +42,20 @@ static int _serverConfigHandler(void* user,
                                 const char* name,
                                 const char* value);
 
+/**
+ * @brief Configuration of a virtual, given in a section named after the
+ *        virtual (ie. [/dev/ttyS5.a]) after its master section.
+ *
+ * @param[in] vnode - Virtual serial node
+ * @param[in] name - configuration key
+ * @param[in] value - configuration value
+ *
+ * @return 1 if configuration is valid, 0 if not
+ */
+static int _virtualConfigHandler(serialNode *vnode,
+                                 const char* name,
+                                 const char* value);
+
 /**
  * @brief Serial device configuration file callback.
  *
@@ -105,9 +119,14 @@ static int _serverConfigHandler(void* user,
     } else if (MATCH("logging", "loglevel")) {
         server->verbosity = _getLogLevel(value);
     } else if (MATCH("system", "hz")) {
-        server->hz = atoi(value);
-        if (server->hz < CONFIG_MIN_HZ) server->hz = CONFIG_MIN_HZ;
-        if (server->hz > CONFIG_MAX_HZ) server->hz = CONFIG_MAX_HZ;
+        /* Deprecated, the cron is driven by deadlines. Still accepted so
+         * that existing configuration files keep loading. */
+    } else if (MATCH("system", "timer-slack")) {
+        server->timer_slack = atoi(value);
+        if (server->timer_slack < 0) server->timer_slack = 0;
+        if (server->timer_slack > CONFIG_MAX_TIMER_SLACK_US) {
+            server->timer_slack = CONFIG_MAX_TIMER_SLACK_US;
+        }
     } else if (MATCH("system", "reconnect-interval")) {
         server->reconnect_interval = atoi(value);
         if (server->reconnect_interval < CONFIG_MIN_RECONNECT_INTERVAL_MS) {
@@ -116,6 +135,49 @@ static int _serverConfigHandler(void* user,
         if (server->reconnect_interval > CONFIG_MAX_RECONNECT_INTERVAL_MS) {
             server->reconnect_interval = CONFIG_MAX_RECONNECT_INTERVAL_MS;
         }
+    } else if (MATCH("system", "hotplug")) {
+        server->hotplug = _yesnotoi(value) == 1;
+    } else if (MATCH("system", "stats-file")) {
+        server->stats_file = strdup(value);
+        if (!server->stats_file) {
+            fprintf(stderr, "Can't set stats file: %s\n", value);
+            exit(1);
+        }
+    } else if (MATCH("system", "stats-interval")) {
+        server->stats_interval = atoi(value);
+        if (server->stats_interval < CONFIG_MIN_STATS_INTERVAL_MS) {
+            server->stats_interval = CONFIG_MIN_STATS_INTERVAL_MS;
+        }
+    } else if (MATCH("system", "output-backlog")) {
+        server->output_backlog = atoi(value);
+        if (server->output_backlog < CONFIG_MIN_OUTPUT_BACKLOG) {
+            server->output_backlog = CONFIG_MIN_OUTPUT_BACKLOG;
+        }
+    } else if (MATCH("system", "capture-sync")) {
+        server->capture_sync = atoi(value);
+        if (server->capture_sync < CONFIG_MIN_CAPTURE_SYNC_MS) {
+            server->capture_sync = CONFIG_MIN_CAPTURE_SYNC_MS;
+        }
+    } else if (MATCH("system", "fanout-budget-us")) {
+        server->fanout_budget = atoi(value);
+        if (server->fanout_budget < 0) {
+            server->fanout_budget = 0;
+        }
+    } else if (MATCH("system", "open-threads")) {
+        server->open_threads = atoi(value);
+        if (server->open_threads < 0) {
+            server->open_threads = 0;
+        }
+    } else if (MATCH("system", "max-buffer-memory")) {
+        server->max_buffer_memory = atoll(value);
+        if (server->max_buffer_memory < 0) {
+            server->max_buffer_memory = 0;
+        }
+    } else if (MATCH("system", "slow-callback-us")) {
+        server->slow_callback_us = atoi(value);
+        if (server->slow_callback_us < 0) {
+            server->slow_callback_us = 0;
+        }
     } else if (MATCH("system", "pidfile")) {
         server->pidfile = strdup(value);
         if (!server->pidfile) {
@@ -147,6 +209,85 @@ void serverLoadConfig(const char *filename)
     }
 }
 
+static int _virtualConfigHandler(serialNode *vnode,
+                                 const char* name,
+                                 const char* value)
+{
+    if (N_MATCH("subscribe")) {
+        free(vnode->subscribe);
+        vnode->subscribe = strdup(value);
+        if (!vnode->subscribe) {
+            fprintf(stderr, "Can't set subscriptions: %s\n", value);
+            exit(1);
+        }
+    } else if (N_MATCH("weight")) {
+        vnode->weight = atoi(value);
+        if (vnode->weight < 1) vnode->weight = 1;
+    } else if (N_MATCH("prime")) {
+        vnode->prime = _yesnotoi(value) == 1;
+    } else if (N_MATCH("priority")) {
+        vnode->priority = serialPriorityFromName(value);
+        if (vnode->priority == -1) {
+            fprintf(stderr, "Invalid priority for %s: %s\n",
+                    vnode->name, value);
+            exit(1);
+        }
+    } else if (N_MATCH("spill")) {
+        free(vnode->spill_dir);
+        vnode->spill_dir = strdup(value);
+        if (!vnode->spill_dir) {
+            fprintf(stderr, "Can't set spill: %s\n", value);
+            exit(1);
+        }
+    } else if (N_MATCH("transform")) {
+        transformChain *chain = transformCreate(value);
+
+        if (!chain) {
+            fprintf(stderr, "Invalid transform for %s: %s\n",
+                    vnode->name, value);
+            exit(1);
+        }
+        transformFree(chain);
+
+        free(vnode->transform);
+        vnode->transform = strdup(value);
+        if (!vnode->transform) {
+            fprintf(stderr, "Can't set transform: %s\n", value);
+            exit(1);
+        }
+    } else if (N_MATCH("spill-size")) {
+        long long size = atoll(value);
+
+        if (size < SPILL_MIN_SIZE) size = SPILL_MIN_SIZE;
+        vnode->spill_size = size;
+    } else if (N_MATCH("validate")) {
+        if (!strcasecmp(value, "drop")) {
+            vnode->validate = SERIAL_VALIDATE_DROP;
+        } else if (!strcasecmp(value, "tag")) {
+            vnode->validate = SERIAL_VALIDATE_TAG;
+        } else if (!strcasecmp(value, "pass")) {
+            vnode->validate = SERIAL_VALIDATE_PASS;
+        } else {
+            fprintf(stderr, "Invalid validate for %s: %s\n",
+                    vnode->name, value);
+            exit(1);
+        }
+    } else if (N_MATCH("output")) {
+        if (!strcasecmp(value, "raw")) {
+            vnode->output = SERIAL_OUTPUT_RAW;
+        } else if (!strcasecmp(value, "framed")) {
+            vnode->output = SERIAL_OUTPUT_FRAMED;
+        } else {
+            fprintf(stderr, "Invalid output for %s: %s\n",
+                    vnode->name, value);
+            exit(1);
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
 static int _serialConfigHandler(void* user,
                                 const char* section,
                                 const char* name,
@@ -155,6 +296,11 @@ static int _serialConfigHandler(void* user,
     struct sproxyServer *server = (struct sproxyServer*)user;
     serialNode *node;
 
+    node = serialFindVirtualNode(section);
+    if (node) {
+        return _virtualConfigHandler(node, name, value);
+    }
+
     /* Check if serial port has been added, if not, create */
     node = serialGetNode(section);
     if (!node) {
@@ -164,6 +310,160 @@ static int _serialConfigHandler(void* user,
 
     if (N_MATCH("baudrate")) {
         node->baudrate = atoi(value);
+    } else if (N_MATCH("profile")) {
+        node->profile = serialProfileFromName(value);
+        if (node->profile == -1) {
+            fprintf(stderr, "Unknown profile for %s: %s\n", section, value);
+            exit(1);
+        }
+    } else if (N_MATCH("framing")) {
+        framerFree(node->framer);
+        node->framer = NULL;
+
+        /* Raw needs no reassembly */
+        if (strcasecmp(value, "raw")) {
+            node->framer = framerCreate(value);
+            if (!node->framer) {
+                fprintf(stderr, "Invalid framing for %s: %s\n", section, value);
+                exit(1);
+            }
+        }
+    } else if (N_MATCH("checksum")) {
+        node->checksum = checksumFromName(value);
+        if (node->checksum == -1) {
+            fprintf(stderr, "Unknown checksum for %s: %s\n", section, value);
+            exit(1);
+        }
+    } else if (N_MATCH("flow-control")) {
+        node->flow_control = serialFlowFromName(value);
+        if (node->flow_control == -1) {
+            fprintf(stderr, "Unknown flow-control for %s: %s\n", section,
+                    value);
+            exit(1);
+        }
+    } else if (N_MATCH("flow-policy")) {
+        node->flow_policy = serialFlowPolicyFromName(value);
+        if (node->flow_policy == -1) {
+            fprintf(stderr, "Unknown flow-policy for %s: %s\n", section,
+                    value);
+            exit(1);
+        }
+    } else if (N_MATCH("flow-high")) {
+        long long size = atoll(value);
+
+        node->flow_high = size > 0 ? size : 0;
+    } else if (N_MATCH("flow-low")) {
+        long long size = atoll(value);
+
+        node->flow_low = size > 0 ? size : 0;
+    } else if (N_MATCH("tcp-listen")) {
+        free(node->tcp_listen);
+        node->tcp_listen = strdup(value);
+        if (!node->tcp_listen) {
+            fprintf(stderr, "Can't set tcp-listen: %s\n", value);
+            exit(1);
+        }
+    } else if (N_MATCH("unix-listen")) {
+        free(node->unix_listen);
+        node->unix_listen = strdup(value);
+        if (!node->unix_listen) {
+            fprintf(stderr, "Can't set unix-listen: %s\n", value);
+            exit(1);
+        }
+    } else if (N_MATCH("multicast")) {
+        free(node->multicast);
+        node->multicast = strdup(value);
+        if (!node->multicast) {
+            fprintf(stderr, "Can't set multicast: %s\n", value);
+            exit(1);
+        }
+    } else if (N_MATCH("multicast-ttl")) {
+        node->multicast_ttl = atoi(value);
+        if (node->multicast_ttl < 0) node->multicast_ttl = 0;
+        if (node->multicast_ttl > 255) node->multicast_ttl = 255;
+    } else if (N_MATCH("shm-listen")) {
+        free(node->shm_listen);
+        node->shm_listen = strdup(value);
+        if (!node->shm_listen) {
+            fprintf(stderr, "Can't set shm-listen: %s\n", value);
+            exit(1);
+        }
+    } else if (N_MATCH("shm-listen-mode")) {
+        node->shm_listen_mode = strtol(value, NULL, 8) & 0777;
+    } else if (N_MATCH("shm-size")) {
+        long long size = atoll(value);
+
+        if (size < RING_MIN_SIZE) size = RING_MIN_SIZE;
+        if (size > RING_MAX_SIZE) size = RING_MAX_SIZE;
+        node->shm_size = size;
+    } else if (N_MATCH("capture")) {
+        free(node->capture_path);
+        node->capture_path = strdup(value);
+        if (!node->capture_path) {
+            fprintf(stderr, "Can't set capture: %s\n", value);
+            exit(1);
+        }
+    } else if (N_MATCH("capture-size")) {
+        long long size = atoll(value);
+
+        if (size < CAPTURE_MIN_SIZE) size = CAPTURE_MIN_SIZE;
+        node->capture_size = size;
+    } else if (N_MATCH("capture-files")) {
+        node->capture_files = atoi(value);
+        if (node->capture_files < 1) node->capture_files = 1;
+    } else if (N_MATCH("history-bytes")) {
+        long long size = atoll(value);
+
+        if (size < 0) size = 0;
+        if (size > HISTORY_MAX_SIZE) size = HISTORY_MAX_SIZE;
+        node->history_size = size;
+    } else if (N_MATCH("history-seconds")) {
+        node->history_ms = atof(value) * 1000;
+        if (node->history_ms < 0) node->history_ms = 0;
+    } else if (N_MATCH("client-prime")) {
+        node->prime = _yesnotoi(value) == 1;
+    } else if (N_MATCH("client-priority")) {
+        node->priority = serialPriorityFromName(value);
+        if (node->priority == -1) {
+            fprintf(stderr, "Invalid client-priority for %s: %s\n",
+                    section, value);
+            exit(1);
+        }
+    } else if (N_MATCH("replay")) {
+        free(node->replay_path);
+        node->replay_path = strdup(value);
+        if (!node->replay_path) {
+            fprintf(stderr, "Can't set replay: %s\n", value);
+            exit(1);
+        }
+        node->flags |= SERIAL_FLAG_REPLAY;
+    } else if (N_MATCH("replay-speed")) {
+        if (!strcasecmp(value, "max")) {
+            node->replay_speed = 0;
+        } else {
+            node->replay_speed = atof(value);
+            if (node->replay_speed <= 0) {
+                fprintf(stderr, "Invalid replay-speed for %s: %s\n",
+                        section, value);
+                exit(1);
+            }
+        }
+    } else if (N_MATCH("replay-loop")) {
+        node->replay_loop = _yesnotoi(value) == 1;
+    } else if (N_MATCH("vmin")) {
+        node->tuning.vmin = atoi(value);
+        if (node->tuning.vmin < 0) node->tuning.vmin = 0;
+        if (node->tuning.vmin > 255) node->tuning.vmin = 255;
+    } else if (N_MATCH("vtime")) {
+        node->tuning.vtime = atoi(value);
+        if (node->tuning.vtime < 0) node->tuning.vtime = 0;
+        if (node->tuning.vtime > 255) node->tuning.vtime = 255;
+    } else if (N_MATCH("low-latency")) {
+        node->tuning.low_latency = _yesnotoi(value) == 1;
+    } else if (N_MATCH("latency-timer")) {
+        node->tuning.latency_timer = atoi(value);
+        if (node->tuning.latency_timer < 1) node->tuning.latency_timer = 1;
+        if (node->tuning.latency_timer > 255) node->tuning.latency_timer = 255;
     } else if (N_MATCH("virtuals")) {
         char virtual_name[PATH_MAX];
         serialNode *vnode;
@@ -199,17 +499,34 @@ static int _serialConfigHandler(void* user,
     } else if (N_MATCH("writer")) {
         char virtual_name[PATH_MAX];
         serialNode *vnode;
+        char *str;
+        char *token;
 
-        if (serialVirtualName(section, value,
-                              virtual_name, sizeof(virtual_name)) != 0) {
-            fprintf(stderr, "Can't create virtual name: %s\n", value);
+        str = strdup(value);
+        if (!str) {
+            fprintf(stderr, "Can't set writers: %s\n", value);
             exit(1);
         }
 
-        vnode = serialGetVirtualNode(node, virtual_name);
-        if (vnode) {
-            vnode->flags |= SERIAL_FLAG_WRITER;
+        token = strtok(str, " ");
+
+        while (token) {
+            if (serialVirtualName(section, token,
+                                  virtual_name, sizeof(virtual_name)) != 0) {
+                fprintf(stderr, "Can't create virtual name: %s\n", token);
+                exit(1);
+            }
+
+            vnode = serialGetVirtualNode(node, virtual_name);
+            if (vnode) {
+                vnode->flags |= SERIAL_FLAG_WRITER;
+            }
+
+            token = strtok(NULL, " ");
         }
+
+        free(str);
+        str = NULL;
     } else {
         return 0;
     }
@@ -0,0 +1,441 @@
+#include "server.h"
+#include "framing.h"
+
+#include <stdint.h>
+
+/**
+ * @brief Parse a delimiter with C style escapes (\r, \n, \t, \\, \xHH).
+ *
+ * @param[in] f - Framer to store the delimiter in
+ * @param[in] s - Escaped delimiter
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _framerParseDelimiter(framer *f, const char *s);
+
+/**
+ * @brief Parse a sync+length specification:
+ *        <hex>:<length offset>:<le|be><8|16|32>:<trailer bytes>.
+ *
+ * @param[in] f - Framer to configure
+ * @param[in] s - Specification
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _framerParseSync(framer *f, const char *s);
+
+/**
+ * @brief Parse the length of the silence ending a frame, in characters
+ *        (3.5 for Modbus RTU).
+ *
+ * @param[in] f - Framer to configure
+ * @param[in] s - Number of characters
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _framerParseSilence(framer *f, const char *s);
+
+/**
+ * @brief Return the next complete delimiter terminated frame.
+ */
+static int _framerNextDelimited(framer *f, const char **frame, size_t *len);
+
+/**
+ * @brief Return the next complete sync+length frame.
+ */
+static int _framerNextSync(framer *f, const char **frame, size_t *len);
+
+static int _hexval(int c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static int _framerParseDelimiter(framer *f, const char *s)
+{
+    int c;
+
+    f->delimlen = 0;
+
+    while (*s) {
+        if (f->delimlen == FRAMING_MAX_DELIM) {
+            return C_ERR;
+        }
+
+        c = (unsigned char)*s++;
+        if (c == '\\') {
+            switch (*s++) {
+                case 'r': c = '\r'; break;
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case '0': c = '\0'; break;
+                case '\\': c = '\\'; break;
+                case 'x':
+                    if (_hexval(s[0]) < 0 || _hexval(s[1]) < 0) {
+                        return C_ERR;
+                    }
+                    c = _hexval(s[0]) << 4 | _hexval(s[1]);
+                    s += 2;
+                    break;
+                default:
+                    return C_ERR;
+            }
+        }
+
+        f->delim[f->delimlen++] = c;
+    }
+
+    return f->delimlen > 0 ? C_OK : C_ERR;
+}
+
+static int _framerParseSync(framer *f, const char *s)
+{
+    char order[3] = {0};
+    char hex[2*FRAMING_MAX_SYNC + 1];
+    int bits;
+    int j;
+
+    if (sscanf(s, "%16[0-9a-fA-F]:%d:%2[lbe]%d:%d",
+               hex, &f->lenoff, order, &bits, &f->trailer) != 5) {
+        return C_ERR;
+    }
+
+    if (strlen(hex) % 2) {
+        return C_ERR;
+    }
+
+    f->synclen = strlen(hex)/2;
+    for (j = 0; j < f->synclen; j++) {
+        f->sync[j] = _hexval(hex[2*j]) << 4 | _hexval(hex[2*j+1]);
+    }
+
+    if (!strcmp(order, "le")) {
+        f->lenbig = 0;
+    } else if (!strcmp(order, "be")) {
+        f->lenbig = 1;
+    } else {
+        return C_ERR;
+    }
+
+    if (bits != 8 && bits != 16 && bits != 32) {
+        return C_ERR;
+    }
+    f->lensize = bits/8;
+
+    if (f->lenoff < f->synclen || f->trailer < 0 ||
+        f->lenoff + f->lensize + f->trailer > FRAMING_BUF_SIZE) {
+        return C_ERR;
+    }
+
+    return C_OK;
+}
+
+static int _framerParseSilence(framer *f, const char *s)
+{
+    char *end;
+
+    f->silence = strtod(s, &end);
+    if (end == s || *end || !(f->silence > 0) ||
+        f->silence > FRAMING_MAX_SILENCE) {
+        return C_ERR;
+    }
+
+    return C_OK;
+}
+
+framer *framerCreate(const char *spec)
+{
+    framer *f;
+    int ret = C_ERR;
+
+    f = calloc(1, sizeof(*f));
+    if (!f) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+
+    if (!strcasecmp(spec, "raw")) {
+        f->type = FRAMING_RAW;
+        ret = C_OK;
+    } else if (!strcasecmp(spec, "nmea")) {
+        f->type = FRAMING_DELIMITER;
+        ret = _framerParseDelimiter(f, "\\r\\n");
+    } else if (!strcasecmp(spec, "ubx")) {
+        f->type = FRAMING_SYNC;
+        ret = _framerParseSync(f, "B562:4:le16:2");
+    } else if (!strncasecmp(spec, "delimiter:", 10)) {
+        f->type = FRAMING_DELIMITER;
+        ret = _framerParseDelimiter(f, spec + 10);
+    } else if (!strncasecmp(spec, "sync:", 5)) {
+        f->type = FRAMING_SYNC;
+        ret = _framerParseSync(f, spec + 5);
+    } else if (!strncasecmp(spec, "silence:", 8)) {
+        f->type = FRAMING_SILENCE;
+        ret = _framerParseSilence(f, spec + 8);
+    }
+
+    if (ret != C_OK) {
+        free(f);
+        return NULL;
+    }
+
+    f->buf = malloc(FRAMING_BUF_SIZE);
+    if (!f->buf) {
+        serverLog(LL_ERROR, "malloc failed");
+        exit(1);
+    }
+
+    return f;
+}
+
+framer *framerClone(const framer *f)
+{
+    framer *clone;
+
+    clone = malloc(sizeof(*clone));
+    if (!clone) {
+        serverLog(LL_ERROR, "malloc failed");
+        exit(1);
+    }
+
+    *clone = *f;
+    clone->len = 0;
+    clone->pos = 0;
+    clone->scan = 0;
+    clone->end = 0;
+    clone->frames = 0;
+    clone->discarded = 0;
+    clone->oversized = 0;
+
+    clone->buf = malloc(FRAMING_BUF_SIZE);
+    if (!clone->buf) {
+        serverLog(LL_ERROR, "malloc failed");
+        exit(1);
+    }
+
+    return clone;
+}
+
+void framerFree(framer *f)
+{
+    if (!f) {
+        return;
+    }
+
+    free(f->buf);
+    free(f);
+}
+
+void framerReset(framer *f)
+{
+    f->len = 0;
+    f->pos = 0;
+    f->scan = 0;
+    f->end = 0;
+}
+
+size_t framerFeed(framer *f, const char *data, size_t len)
+{
+    /* Keep the pending partial frame at the start of the buffer */
+    if (f->pos) {
+        memmove(f->buf, f->buf + f->pos, f->len - f->pos);
+        f->len -= f->pos;
+        f->scan = f->scan > f->pos ? f->scan - f->pos : 0;
+        f->end = f->end > f->pos ? f->end - f->pos : 0;
+        f->pos = 0;
+    }
+
+    if (len > FRAMING_BUF_SIZE - f->len) {
+        len = FRAMING_BUF_SIZE - f->len;
+    }
+
+    memcpy(f->buf + f->len, data, len);
+    f->len += len;
+
+    return len;
+}
+
+const char *framingFindDelimiter(const char *buf, size_t len,
+                                 const unsigned char *delim, size_t delimlen)
+{
+    const char *end = buf + len;
+    const char *p = buf;
+
+    /* memchr() is the vectorized kernel picked by libc for this CPU, only
+     * candidates for the lead byte are compared in full */
+    while ((p = memchr(p, delim[0], end - p))) {
+        if ((size_t)(end - p) < delimlen) {
+            break;
+        }
+        if (delimlen == 1 || !memcmp(p + 1, delim + 1, delimlen - 1)) {
+            return p;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+static int _framerNextDelimited(framer *f, const char **frame, size_t *len)
+{
+    const char *end;
+    size_t from = f->scan > f->pos ? f->scan : f->pos;
+
+    end = framingFindDelimiter(f->buf + from, f->len - from,
+                               f->delim, f->delimlen);
+    if (!end) {
+        /* The tail may hold the start of a delimiter */
+        f->scan = f->len >= (size_t)f->delimlen - 1 ?
+                  f->len - (f->delimlen - 1) : 0;
+        return 0;
+    }
+
+    *frame = f->buf + f->pos;
+    *len = end + f->delimlen - *frame;
+    f->pos += *len;
+    f->scan = f->pos;
+    return 1;
+}
+
+static int _framerNextSync(framer *f, const char **frame, size_t *len)
+{
+    const unsigned char *p;
+    size_t avail;
+    size_t total;
+    uint32_t paylen = 0;
+    int j;
+
+    for (;;) {
+        avail = f->len - f->pos;
+        p = (const unsigned char*)f->buf + f->pos;
+
+        /* Skip to the next sync word */
+        if (avail < (size_t)f->synclen) {
+            return 0;
+        }
+
+        if (memcmp(p, f->sync, f->synclen)) {
+            const char *next = memchr(p + 1, f->sync[0], avail - 1);
+            size_t skip = next ? (size_t)(next - (const char*)p) : avail;
+
+            f->discarded += skip;
+            f->pos += skip;
+            continue;
+        }
+
+        if (avail < (size_t)f->lenoff + f->lensize) {
+            return 0;
+        }
+
+        for (j = 0; j < f->lensize; j++) {
+            int shift = f->lenbig ? 8*(f->lensize - 1 - j) : 8*j;
+            paylen |= (uint32_t)p[f->lenoff + j] << shift;
+        }
+
+        total = (size_t)f->lenoff + f->lensize + paylen + f->trailer;
+        if (total > FRAMING_BUF_SIZE) {
+            /* Can't be a real frame, resynchronize after this sync byte */
+            f->discarded++;
+            f->pos++;
+            paylen = 0;
+            continue;
+        }
+
+        if (avail < total) {
+            return 0;
+        }
+
+        *frame = (const char*)p;
+        *len = total;
+        f->pos += total;
+        return 1;
+    }
+}
+
+void framerEnd(framer *f)
+{
+    f->end = f->len;
+}
+
+int framerNext(framer *f, const char **frame, size_t *len)
+{
+    int ret = 0;
+
+    switch (f->type) {
+        case FRAMING_RAW:
+            if (f->pos < f->len) {
+                *frame = f->buf + f->pos;
+                *len = f->len - f->pos;
+                f->pos = f->len;
+                ret = 1;
+            }
+            break;
+        case FRAMING_DELIMITER:
+            ret = _framerNextDelimited(f, frame, len);
+            break;
+        case FRAMING_SYNC:
+            ret = _framerNextSync(f, frame, len);
+            break;
+        case FRAMING_SILENCE:
+            if (f->pos < f->end) {
+                *frame = f->buf + f->pos;
+                *len = f->end - f->pos;
+                f->pos = f->end;
+                ret = 1;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if (!ret && f->pos == 0 && f->len == FRAMING_BUF_SIZE) {
+        /* No frame boundary in a full buffer, flush it as one frame so the
+         * stream does not stall. Consumers see the split. */
+        *frame = f->buf;
+        *len = f->len;
+        f->pos = f->len;
+        f->oversized++;
+        ret = 1;
+    }
+
+    if (ret) {
+        f->frames++;
+    }
+
+    return ret;
+}
+
+int framingClassify(const char *frame, size_t len, char *type)
+{
+    const unsigned char *p = (const unsigned char*)frame;
+    size_t j;
+
+    if (len >= 6 && p[0] == 0xB5 && p[1] == 0x62) {
+        return snprintf(type, FRAMING_MAX_TYPE, "UBX-%02X-%02X", p[2], p[3]);
+    }
+
+    if (len && (p[0] == '$' || p[0] == '!')) {
+        for (j = 1; j < len && j < FRAMING_MAX_TYPE; j++) {
+            if (p[j] == ',' || p[j] == '*') {
+                break;
+            }
+            type[j-1] = p[j];
+        }
+
+        if (j < len && j < FRAMING_MAX_TYPE && j > 1) {
+            type[j-1] = '\0';
+            return j - 1;
+        }
+    }
+
+    return 0;
+}
+
+const char *framerTypeName(const framer *f)
+{
+    static const char *names[] = { "raw", "delimiter", "sync", "silence" };
+
+    return f ? names[f->type] : names[FRAMING_RAW];
+}
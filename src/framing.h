@@ -0,0 +1,145 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+
+/* Framing types */
+enum {
+    FRAMING_RAW = 0,                 /* Forward read() chunks as they are */
+    FRAMING_DELIMITER,               /* Frames end with a delimiter */
+    FRAMING_SYNC,                    /* Sync word followed by a length field */
+    FRAMING_SILENCE,                 /* Frames end with a silence on the line */
+};
+
+#define FRAMING_MAX_DELIM (8)
+#define FRAMING_MAX_SYNC  (8)
+#define FRAMING_BUF_SIZE  (65536)    /* Largest frame that can be assembled */
+#define FRAMING_MAX_TYPE  (16)       /* Longest message type name */
+#define FRAMING_MAX_SILENCE (1000)   /* Longest silence, in characters */
+#define FRAMING_CHAR_BITS (10)       /* Bits per character on the line (8N1) */
+
+typedef struct framer {
+    int type;                        /* FRAMING_* */
+    unsigned char delim[FRAMING_MAX_DELIM]; /* Frame delimiter */
+    int delimlen;
+    unsigned char sync[FRAMING_MAX_SYNC];   /* Sync word */
+    int synclen;
+    int lenoff;                      /* Offset of the length field */
+    int lensize;                     /* Width of the length field (1, 2, 4) */
+    int lenbig;                      /* Length field is big endian */
+    int trailer;                     /* Bytes following the payload */
+    double silence;                  /* Characters of silence ending a frame */
+    char *buf;                       /* Pending bytes */
+    size_t len;                      /* Number of pending bytes */
+    size_t pos;                      /* Start of the next frame in buf */
+    size_t scan;                     /* Delimiter search resume offset */
+    size_t end;                      /* End of the bytes a silence completed */
+    unsigned long long frames;       /* Complete frames emitted */
+    unsigned long long discarded;    /* Bytes dropped while resynchronizing */
+    unsigned long long oversized;    /* Frames flushed because buf was full */
+} framer;
+
+/**
+ * @brief Allocate a framer from a framing specification:
+ *        raw, nmea, ubx, delimiter:<escaped bytes>,
+ *        sync:<hex>:<length offset>:<le|be><8|16|32>:<trailer bytes> or
+ *        silence:<characters>.
+ *
+ * @param[in] spec - Framing specification
+ *
+ * @return Pointer to a newly allocated framer, or NULL if spec is invalid
+ */
+framer *framerCreate(const char *spec);
+
+/**
+ * @brief Allocate a framer with the same framing as another one, without its
+ *        pending bytes and counters.
+ *
+ * @param[in] f - Framer to copy the framing from
+ *
+ * @return Pointer to a newly allocated framer
+ */
+framer *framerClone(const framer *f);
+
+/**
+ * @brief Release a framer.
+ *
+ * @param[in] f - Framer
+ */
+void framerFree(framer *f);
+
+/**
+ * @brief Drop any pending partial frame, ie. after a disconnect.
+ *
+ * @param[in] f - Framer
+ */
+void framerReset(framer *f);
+
+/**
+ * @brief Append received bytes. Complete frames must be consumed with
+ *        framerNext() before the next call.
+ *
+ * @param[in] f - Framer
+ * @param[in] data - Received bytes
+ * @param[in] len - Number of received bytes
+ *
+ * @return Number of bytes accepted, the rest must be fed again once the
+ *         pending frames are consumed
+ */
+size_t framerFeed(framer *f, const char *data, size_t len);
+
+/**
+ * @brief End the pending bytes as a frame, once the line has been silent
+ *        long enough (silence framing).
+ *
+ * @param[in] f - Framer
+ */
+void framerEnd(framer *f);
+
+/**
+ * @brief Return the next complete frame. Frames stay valid until the next
+ *        framerFeed() call.
+ *
+ * @param[in] f - Framer
+ * @param[out] frame - Start of frame
+ * @param[out] len - Length of frame
+ *
+ * @return 1 if a frame was returned, 0 if no complete frame is pending
+ */
+int framerNext(framer *f, const char **frame, size_t *len);
+
+/**
+ * @brief Find the first occurrence of a delimiter.
+ *
+ * @param[in] buf - Buffer to search
+ * @param[in] len - Length of buffer
+ * @param[in] delim - Delimiter
+ * @param[in] delimlen - Length of delimiter
+ *
+ * @return Pointer to the delimiter in buf or NULL if not found
+ */
+const char *framingFindDelimiter(const char *buf, size_t len,
+                                 const unsigned char *delim, size_t delimlen);
+
+/**
+ * @brief Classify a frame by message type: the NMEA address field (GPGGA,
+ *        PUBX) or UBX-<class>-<id> in hex (UBX-01-07).
+ *
+ * @param[in] frame - Complete frame
+ * @param[in] len - Length of frame
+ * @param[out] type - Buffer of FRAMING_MAX_TYPE bytes for the type name
+ *
+ * @return Length of the type name, 0 if the frame is not recognized
+ */
+int framingClassify(const char *frame, size_t len, char *type);
+
+/**
+ * @brief Describe the framing of a framer (for logs and statistics).
+ *
+ * @param[in] f - Framer or NULL for raw
+ *
+ * @return Framing type name
+ */
+const char *framerTypeName(const framer *f);
+
+#endif
@@ -0,0 +1,181 @@
+#include "server.h"
+#include "history.h"
+
+#define HISTORY_WRAP (UINT32_MAX)
+#define HISTORY_ALIGN (8)
+#define HISTORY_RECORD_SIZE(len) \
+    ((sizeof(historyRecord) + (len) + HISTORY_ALIGN - 1) & \
+     ~(uint64_t)(HISTORY_ALIGN - 1))
+
+/**
+ * @brief Return the record at a position, or NULL if the data area ends
+ *        there and the next record is at the start.
+ *
+ * @param[in] h - History
+ * @param[in] pos - Position
+ * @param[out] skip - Bytes to the start of the data area, if NULL
+ */
+static const historyRecord *_historyAt(const history *h, uint64_t pos,
+                                       uint64_t *skip);
+
+/**
+ * @brief Drop the oldest record.
+ *
+ * @param[in] h - History
+ */
+static void _historyDrop(history *h);
+
+static const historyRecord *_historyAt(const history *h, uint64_t pos,
+                                       uint64_t *skip)
+{
+    uint64_t off = pos % h->size;
+    const historyRecord *rec;
+
+    /* Too little room left for even a record header */
+    if (h->size - off < sizeof(historyRecord)) {
+        *skip = h->size - off;
+        return NULL;
+    }
+
+    rec = (const historyRecord*)(h->buf + off);
+    if (rec->len == HISTORY_WRAP) {
+        *skip = h->size - off;
+        return NULL;
+    }
+
+    return rec;
+}
+
+static void _historyDrop(history *h)
+{
+    const historyRecord *rec;
+    uint64_t skip;
+
+    rec = _historyAt(h, h->tail, &skip);
+    if (!rec) {
+        h->tail += skip;
+        rec = _historyAt(h, h->tail, &skip);
+    }
+
+    h->tail += HISTORY_RECORD_SIZE(rec->len);
+    h->records--;
+    h->bytes -= rec->len;
+}
+
+history *historyCreate(size_t size, int max_ms)
+{
+    history *h;
+
+    h = calloc(1, sizeof(*h));
+    if (!h) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+
+    h->size = (size + HISTORY_ALIGN - 1) & ~(size_t)(HISTORY_ALIGN - 1);
+    h->max_ms = max_ms;
+
+    h->buf = malloc(h->size);
+    if (!h->buf) {
+        serverLog(LL_ERROR, "malloc failed");
+        exit(1);
+    }
+
+    return h;
+}
+
+void historyFree(history *h)
+{
+    if (!h) {
+        return;
+    }
+
+    free(h->buf);
+    free(h);
+}
+
+void historyAppend(history *h, const void *data, size_t len,
+                   uint64_t subscribers, int corrupt, long long now)
+{
+    uint64_t recsize = HISTORY_RECORD_SIZE(len);
+    uint64_t off = h->head % h->size;
+    uint64_t skip = off + recsize > h->size ? h->size - off : 0;
+    historyRecord *rec;
+
+    if (recsize > h->size) {
+        return;
+    }
+
+    while (h->records && h->head + skip + recsize - h->tail > h->size) {
+        _historyDrop(h);
+    }
+
+    /* Nothing left to read, start over at the beginning of the buffer */
+    if (!h->records) {
+        h->head += skip;
+        h->tail = h->head;
+        off = h->head % h->size;
+        skip = 0;
+    }
+
+    if (skip) {
+        if (skip >= sizeof(historyRecord)) {
+            rec = (historyRecord*)(h->buf + off);
+            rec->len = HISTORY_WRAP;
+        }
+        h->head += skip;
+        off = 0;
+    }
+
+    rec = (historyRecord*)(h->buf + off);
+    rec->ms = now;
+    rec->subscribers = subscribers;
+    rec->len = len;
+    rec->corrupt = corrupt;
+    memcpy(rec + 1, data, len);
+
+    h->head += recsize;
+    h->records++;
+    h->bytes += len;
+}
+
+uint64_t historyFirst(history *h, long long now)
+{
+    const historyRecord *rec;
+    uint64_t skip;
+
+    while (h->max_ms && h->records) {
+        rec = _historyAt(h, h->tail, &skip);
+        if (!rec) {
+            rec = _historyAt(h, h->tail + skip, &skip);
+        }
+        if (now - rec->ms <= h->max_ms) {
+            break;
+        }
+        _historyDrop(h);
+    }
+
+    return h->tail;
+}
+
+const historyRecord *historyNext(const history *h, uint64_t *pos,
+                                 const void **data)
+{
+    const historyRecord *rec;
+    uint64_t skip;
+
+    if (*pos == h->head) {
+        return NULL;
+    }
+
+    rec = _historyAt(h, *pos, &skip);
+    if (!rec) {
+        *pos += skip;
+        rec = _historyAt(h, *pos, &skip);
+    }
+
+    *data = rec + 1;
+    *pos += HISTORY_RECORD_SIZE(rec->len);
+
+    return rec;
+}
@@ -0,0 +1,83 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The last frames (or read chunks on raw masters) of a master, bounded by
+ * size and optionally by age. Frames are kept whole, the oldest ones are
+ * dropped to make room. */
+
+#define HISTORY_DEFAULT_SIZE   (65536)  /* When only an age is configured */
+#define HISTORY_MAX_SIZE       (64*1024*1024)
+
+typedef struct historyRecord {
+    long long ms;                      /* Monotonic time it was received */
+    uint64_t subscribers;              /* serialFrameInfo of the frame */
+    uint32_t len;                      /* Length, HISTORY_WRAP at the end */
+    uint32_t corrupt;
+} historyRecord;
+
+typedef struct history {
+    unsigned char *buf;                /* size bytes */
+    size_t size;
+    uint64_t head;                     /* Position of the next record */
+    uint64_t tail;                     /* Position of the oldest record */
+    int max_ms;                        /* Age limit, 0 if none */
+    unsigned long long records;        /* Records kept */
+    unsigned long long bytes;          /* Payload bytes kept */
+} history;
+
+/**
+ * @brief Create a history.
+ *
+ * @param[in] size - Bytes to keep, including per frame overhead
+ * @param[in] max_ms - Drop frames older than this, 0 to keep them
+ *
+ * @return Pointer to a newly allocated history
+ */
+history *historyCreate(size_t size, int max_ms);
+
+/**
+ * @brief Free a history.
+ *
+ * @param[in] h - History
+ */
+void historyFree(history *h);
+
+/**
+ * @brief Append a frame, dropping the oldest ones to make room. Frames
+ *        larger than the history are not kept.
+ *
+ * @param[in] h - History
+ * @param[in] data - Frame
+ * @param[in] len - Length of frame
+ * @param[in] subscribers - Subscribed virtuals
+ * @param[in] corrupt - Failed checksum validation
+ * @param[in] now - Monotonic time in milliseconds
+ */
+void historyAppend(history *h, const void *data, size_t len,
+                   uint64_t subscribers, int corrupt, long long now);
+
+/**
+ * @brief Drop frames that are too old and return the position of the
+ *        oldest frame left, to iterate with historyNext().
+ *
+ * @param[in] h - History
+ * @param[in] now - Monotonic time in milliseconds
+ */
+uint64_t historyFirst(history *h, long long now);
+
+/**
+ * @brief Return the frame at a position and advance it.
+ *
+ * @param[in] h - History
+ * @param[in,out] pos - Position
+ * @param[out] data - Frame, valid until the next historyAppend()
+ *
+ * @return Frame record, or NULL past the newest frame
+ */
+const historyRecord *historyNext(const history *h, uint64_t *pos,
+                                 const void **data);
+
+#endif
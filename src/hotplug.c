@@ -0,0 +1,184 @@
+#include "server.h"
+#include "serial.h"
+
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+
+#define HOTPLUG_MAX_WATCHES (64)
+#define HOTPLUG_EVENT_MASK  (IN_CREATE | IN_ATTRIB | IN_MOVED_TO | \
+                             IN_DELETE | IN_MOVED_FROM)
+#define HOTPLUG_BUF_SIZE    (4096)
+
+typedef struct hotplugWatch {
+    int wd;                          /* inotify watch descriptor */
+    char dir[PATH_MAX];              /* Watched directory */
+} hotplugWatch;
+
+static int hotplug_fd = -1;
+static hotplugWatch watches[HOTPLUG_MAX_WATCHES];
+static int nwatches = 0;
+
+/**
+ * @brief Watch the directory containing a master device.
+ *
+ * @param[in] node - Master serial node
+ */
+static void _hotplugWatchNode(serialNode *node);
+
+/**
+ * @brief Return the directory a watch descriptor refers to.
+ *
+ * @param[in] wd - inotify watch descriptor
+ *
+ * @return Directory path or NULL if the watch is unknown
+ */
+static const char *_hotplugWatchDir(int wd);
+
+/**
+ * @brief Read callback for the inotify descriptor.
+ *
+ * @param[in] el - Pointer to event loop
+ * @param[in] fd - inotify file descriptor
+ * @param[in] privdata - Unused
+ * @param[in] mask - Event flags
+ */
+static void _hotplugReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+static void _hotplugWatchNode(serialNode *node)
+{
+    char path[PATH_MAX];
+    const char *dir;
+    int wd;
+    int j;
+
+    strlcpy(path, node->name, sizeof(path));
+    dir = dirname(path);
+
+    wd = inotify_add_watch(hotplug_fd, dir, HOTPLUG_EVENT_MASK);
+    if (wd == -1) {
+        serverLogErrno(LL_WARN, "Can't watch %s for %s, falling back to "
+                       "polling", dir, node->name);
+        return;
+    }
+
+    /* Several masters usually share /dev */
+    for (j = 0; j < nwatches; j++) {
+        if (watches[j].wd == wd) {
+            return;
+        }
+    }
+
+    if (nwatches == HOTPLUG_MAX_WATCHES) {
+        serverLog(LL_WARN, "Too many hotplug watches, not watching %s", dir);
+        inotify_rm_watch(hotplug_fd, wd);
+        return;
+    }
+
+    watches[nwatches].wd = wd;
+    strlcpy(watches[nwatches].dir, dir, sizeof(watches[nwatches].dir));
+    nwatches++;
+
+    serverLog(LL_DEBUG, "Watching %s for hotplug events", dir);
+}
+
+static const char *_hotplugWatchDir(int wd)
+{
+    int j;
+
+    for (j = 0; j < nwatches; j++) {
+        if (watches[j].wd == wd) {
+            return watches[j].dir;
+        }
+    }
+
+    return NULL;
+}
+
+static void _hotplugReadHandler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    char buf[HOTPLUG_BUF_SIZE]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    const struct inotify_event *ev;
+    serialNode *node;
+    const char *dir;
+    ssize_t nread;
+    char *p;
+
+    AE_NOTUSED(el);
+    AE_NOTUSED(privdata);
+    AE_NOTUSED(mask);
+
+    while ((nread = read(fd, buf, sizeof(buf))) > 0) {
+        for (p = buf; p < buf + nread; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event*)p;
+
+            if (!ev->len) {
+                continue;
+            }
+
+            dir = _hotplugWatchDir(ev->wd);
+            if (!dir) {
+                continue;
+            }
+
+            snprintf(path, sizeof(path), "%s/%s",
+                     strcmp(dir, "/") ? dir : "", ev->name);
+
+            node = serialGetNode(path);
+            if (!node) {
+                continue;
+            }
+
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                serialHotplugRemove(node);
+            } else {
+                serialHotplugAdd(node);
+            }
+        }
+    }
+
+    if (nread == -1 && errno != EAGAIN) {
+        serverLogErrno(LL_ERROR, "inotify read");
+    }
+}
+
+void hotplugInit(void)
+{
+    serialNode *node;
+
+    if (!server.hotplug) {
+        return;
+    }
+
+    hotplug_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplug_fd == -1) {
+        serverLogErrno(LL_WARN, "inotify_init1, hotplug disabled");
+        return;
+    }
+
+    for (node = server.serial.master_head; node; node = node->next) {
+        if (!nodeIsReplay(node)) {
+            _hotplugWatchNode(node);
+        }
+    }
+
+    if (aeCreateFileEvent(server.el, hotplug_fd, AE_READABLE,
+                          _hotplugReadHandler, NULL) == AE_ERR) {
+        serverLogErrno(LL_WARN, "Can't poll inotify, hotplug disabled");
+        hotplugTerm();
+    }
+}
+
+void hotplugTerm(void)
+{
+    if (hotplug_fd == -1) {
+        return;
+    }
+
+    aeDeleteFileEvent(server.el, hotplug_fd, AE_READABLE);
+    close(hotplug_fd);
+    hotplug_fd = -1;
+    nwatches = 0;
+}
@@ -0,0 +1,279 @@
+#include "sproxy.h"
+#include "ring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/futex.h>
+
+struct sproxy_ring {
+    const ringHeader *hdr;             /* Shared mapping, read only */
+    ringWait *wait;                    /* Futex mapping */
+    const unsigned char *data;         /* Data area */
+    uint64_t size;                     /* Size of the data area */
+    size_t maplen;                     /* Size of the mapping */
+    uint64_t pos;                      /* Consumer position */
+    uint64_t cur;                      /* Position of the current frame */
+    unsigned long long overruns;
+};
+
+/**
+ * @brief Receive the ring memfd and its futex memfd over a connected Unix
+ *        socket.
+ *
+ * @param[in] sock - Connected socket
+ * @param[out] fds - Ring and futex memfds
+ *
+ * @return 0 or -1
+ */
+static int _sproxyRecvFds(int sock, int fds[2]);
+
+static int _sproxyRecvFds(int sock, int fds[2])
+{
+    char byte;
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    /* A single fd comes from a daemon with the version 1 layout */
+    if (cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+        if (cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int));
+            close(fds[0]);
+        }
+        errno = EPROTO;
+        return -1;
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+    return 0;
+}
+
+sproxy_ring *sproxy_open(const char *path)
+{
+    struct sockaddr_un sa = {0};
+    struct stat st;
+    sproxy_ring *r;
+    void *map;
+    void *wait;
+    int sock;
+    int fds[2];
+    int ret;
+    int err;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        return NULL;
+    }
+
+    if (connect(sock, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+        err = errno;
+        close(sock);
+        errno = err;
+        return NULL;
+    }
+
+    ret = _sproxyRecvFds(sock, fds);
+    err = errno;
+    close(sock);
+    if (ret == -1) {
+        errno = err;
+        return NULL;
+    }
+
+    if (fstat(fds[0], &st) == -1 || st.st_size <= RING_HEADER_SIZE) {
+        close(fds[0]);
+        close(fds[1]);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    /* The ring is sealed against writes, only the futex is shared both
+     * ways */
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fds[0], 0);
+    err = errno;
+    close(fds[0]);
+    wait = mmap(NULL, RING_WAIT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fds[1], 0);
+    if (wait == MAP_FAILED) {
+        err = errno;
+    }
+    close(fds[1]);
+    if (map == MAP_FAILED || wait == MAP_FAILED) {
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+        if (wait != MAP_FAILED) {
+            munmap(wait, RING_WAIT_SIZE);
+        }
+        errno = err;
+        return NULL;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        munmap(map, st.st_size);
+        munmap(wait, RING_WAIT_SIZE);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    r->hdr = map;
+    r->wait = wait;
+    r->data = (const unsigned char*)map + RING_HEADER_SIZE;
+    r->maplen = st.st_size;
+    r->size = r->hdr->size;
+
+    if (r->hdr->magic != RING_MAGIC || r->hdr->version != RING_VERSION ||
+        r->size + RING_HEADER_SIZE > r->maplen) {
+        sproxy_close(r);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    r->pos = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    r->cur = r->pos;
+
+    return r;
+}
+
+void sproxy_close(sproxy_ring *r)
+{
+    if (!r) {
+        return;
+    }
+
+    munmap((void*)r->hdr, r->maplen);
+    munmap(r->wait, RING_WAIT_SIZE);
+    free(r);
+}
+
+int sproxy_next(sproxy_ring *r, const void **frame, size_t *len,
+                unsigned *flags)
+{
+    const ringRecord *rec;
+    uint64_t head;
+    uint64_t off;
+    uint32_t reclen;
+    uint32_t recflags;
+
+    for (;;) {
+        head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+        if (r->pos == head) {
+            return 0;
+        }
+
+        if (head - r->pos > r->size) {
+            goto overrun;
+        }
+
+        off = r->pos & (r->size - 1);
+        rec = (const ringRecord*)(r->data + off);
+        reclen = rec->len;
+        recflags = rec->flags;
+
+        /* The record header itself may have been overwritten already */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->hdr->reserve, __ATOMIC_RELAXED) - r->pos >
+            r->size) {
+            goto overrun;
+        }
+
+        if (reclen == RING_WRAP) {
+            r->pos += r->size - off;
+            continue;
+        }
+
+        if (off + RING_RECORD_SIZE(reclen) > r->size) {
+            goto overrun;
+        }
+
+        *frame = rec + 1;
+        *len = reclen;
+        if (flags) {
+            *flags = recflags;
+        }
+
+        r->cur = r->pos;
+        r->pos += RING_RECORD_SIZE(reclen);
+        return 1;
+    }
+
+overrun:
+    r->overruns++;
+    r->pos = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+    r->cur = r->pos;
+    return -1;
+}
+
+int sproxy_done(sproxy_ring *r)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&r->hdr->reserve, __ATOMIC_RELAXED) - r->cur >
+        r->size) {
+        r->overruns++;
+        return -1;
+    }
+
+    return 0;
+}
+
+int sproxy_wait(sproxy_ring *r, int timeout_ms)
+{
+    struct timespec ts;
+    uint32_t val;
+
+    __atomic_add_fetch(&r->wait->waiters, 1, __ATOMIC_SEQ_CST);
+    val = __atomic_load_n(&r->wait->futex, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE) == r->pos) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        syscall(SYS_futex, &r->wait->futex, FUTEX_WAIT, val,
+                timeout_ms < 0 ? NULL : &ts, NULL, 0);
+    }
+
+    __atomic_sub_fetch(&r->wait->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE) != r->pos;
+}
+
+unsigned long long sproxy_overruns(const sproxy_ring *r)
+{
+    return r->overruns;
+}
@@ -0,0 +1,368 @@
+#include "server.h"
+#include "serial.h"
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define LISTEN_MAX_LISTENERS (64)
+#define LISTEN_BACKLOG       (511)
+#define LISTEN_MAX_ACCEPTS   (1000)  /* Per event, keeps the loop fair */
+
+/* Listener types */
+enum {
+    LISTEN_TCP = 0,                  /* Clients get the stream */
+    LISTEN_UNIX,                     /* Clients get the stream */
+    LISTEN_RING,                     /* Clients get the shared memory ring */
+};
+
+typedef struct listener {
+    int fd;                          /* Listening socket */
+    int type;                        /* LISTEN_* */
+    serialNode *master;              /* Master the clients are attached to */
+    char addr[PATH_MAX];             /* Configured address */
+    mode_t mode;                     /* Socket file permissions, 0 leaves
+                                        them to the umask */
+} listener;
+
+static listener listeners[LISTEN_MAX_LISTENERS];
+static int nlisteners = 0;
+static int paused = 0;               /* Accepting stopped, out of fds */
+
+/**
+ * @brief Open a TCP listener.
+ *
+ * @param[in] l - Listener to open
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _listenTcp(listener *l);
+
+/**
+ * @brief Open a Unix socket listener, replacing a stale socket file. Its
+ *        permissions are set before it accepts anyone.
+ *
+ * @param[in] l - Listener to open
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _listenUnix(listener *l);
+
+/**
+ * @brief Add a listener for a master and start accepting on it.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] addr - host:port or Unix socket path
+ * @param[in] type - LISTEN_*
+ * @param[in] mode - Unix socket file permissions, 0 to leave them to the
+ *                   umask
+ */
+static void _listenAdd(serialNode *master, const char *addr, int type,
+                       mode_t mode);
+
+/**
+ * @brief Hand the shared memory ring of a master to a connected client.
+ *
+ * @param[in] l - Ring listener
+ * @param[in] cfd - Connected socket, closed when done
+ */
+static void _listenSendRing(listener *l, int cfd);
+
+/**
+ * @brief Stop accepting on every listener until a client goes away.
+ */
+static void _listenPause(void);
+
+/**
+ * @brief Accept callback for listening sockets.
+ *
+ * @param[in] el - Pointer to event loop
+ * @param[in] fd - Listening socket
+ * @param[in] privdata - Pointer to listener
+ * @param[in] mask - Event flags
+ */
+static void _listenAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+static int _listenTcp(listener *l)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *res = NULL;
+    struct addrinfo *ai;
+    char host[PATH_MAX];
+    const char *port;
+    char *sep;
+    int yes = 1;
+    int ret;
+
+    strlcpy(host, l->addr, sizeof(host));
+    sep = strrchr(host, ':');
+    if (!sep) {
+        serverLog(LL_ERROR, "tcp-listen must be host:port: %s", l->addr);
+        return C_ERR;
+    }
+    *sep = '\0';
+    port = sep + 1;
+
+    /* [::1]:4001 */
+    if (host[0] == '[' && sep > host && sep[-1] == ']') {
+        sep[-1] = '\0';
+        memmove(host, host + 1, strlen(host));
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    ret = getaddrinfo(*host && strcmp(host, "*") ? host : NULL, port,
+                      &hints, &res);
+    if (ret != 0) {
+        serverLog(LL_ERROR, "Can't resolve %s: %s", l->addr, gai_strerror(ret));
+        return C_ERR;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        l->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+                       SOCK_CLOEXEC, ai->ai_protocol);
+        if (l->fd == -1) {
+            continue;
+        }
+
+        if (setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR,
+                       &yes, sizeof(yes)) == 0 &&
+            bind(l->fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(l->fd, LISTEN_BACKLOG) == 0) {
+            break;
+        }
+
+        serverLogErrno(LL_ERROR, "Can't listen on %s", l->addr);
+        close(l->fd);
+        l->fd = -1;
+    }
+
+    freeaddrinfo(res);
+
+    return l->fd != -1 ? C_OK : C_ERR;
+}
+
+static int _listenUnix(listener *l)
+{
+    struct sockaddr_un sa = {0};
+
+    if (strlen(l->addr) >= sizeof(sa.sun_path)) {
+        serverLog(LL_ERROR, "unix-listen path too long: %s", l->addr);
+        return C_ERR;
+    }
+
+    sa.sun_family = AF_UNIX;
+    strlcpy(sa.sun_path, l->addr, sizeof(sa.sun_path));
+
+    l->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (l->fd == -1) {
+        serverLogErrno(LL_ERROR, "socket");
+        return C_ERR;
+    }
+
+    /* Left over by a previous run */
+    unlink(l->addr);
+
+    if (bind(l->fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 ||
+        (l->mode && chmod(l->addr, l->mode) == -1) ||
+        listen(l->fd, LISTEN_BACKLOG) == -1) {
+        serverLogErrno(LL_ERROR, "Can't listen on %s", l->addr);
+        close(l->fd);
+        l->fd = -1;
+        return C_ERR;
+    }
+
+    return C_OK;
+}
+
+static void _listenAdd(serialNode *master, const char *addr, int type,
+                       mode_t mode)
+{
+    listener *l;
+
+    if (nlisteners == LISTEN_MAX_LISTENERS) {
+        serverLog(LL_ERROR, "Too many listeners, not listening on %s", addr);
+        exit(1);
+    }
+
+    l = &listeners[nlisteners];
+    l->fd = -1;
+    l->type = type;
+    l->master = master;
+    l->mode = mode;
+    strlcpy(l->addr, addr, sizeof(l->addr));
+
+    if ((type == LISTEN_TCP ? _listenTcp(l) : _listenUnix(l)) == C_ERR ||
+        aeCreateFileEvent(server.el, l->fd, AE_READABLE,
+                          _listenAcceptHandler, l) == AE_ERR) {
+        serverLog(LL_ERROR, "Can't accept clients of %s on %s",
+                  master->name, addr);
+        exit(1);
+    }
+
+    nlisteners++;
+
+    serverLog(LL_INFO, "Accepting clients of %s on %s", master->name, addr);
+}
+
+static void _listenPause(void)
+{
+    int j;
+
+    if (paused) {
+        return;
+    }
+
+    for (j = 0; j < nlisteners; j++) {
+        aeDeleteFileEvent(server.el, listeners[j].fd, AE_READABLE);
+    }
+    paused = 1;
+}
+
+static void _listenSendRing(listener *l, int cfd)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))] = {0};
+    int fds[2] = { l->master->shm->fd, l->master->shm->wait_fd };
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    struct msghdr msg = {0};
+    struct cmsghdr *cmsg;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    /* A fresh socket has room for one byte, this does not block */
+    if (sendmsg(cfd, &msg, MSG_NOSIGNAL) == -1) {
+        serverLogErrno(LL_WARN, "Can't hand out the ring of %s",
+                       l->master->name);
+    } else {
+        serverLog(LL_DEBUG, "Handed out the ring of %s", l->master->name);
+    }
+
+    close(cfd);
+}
+
+static void _listenAcceptHandler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    listener *l = (listener*)privdata;
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    char name[PATH_MAX + NI_MAXHOST];
+    char host[NI_MAXHOST];
+    char port[NI_MAXSERV];
+    int yes = 1;
+    int cfd;
+    int j;
+
+    AE_NOTUSED(el);
+    AE_NOTUSED(mask);
+
+    for (j = 0; j < LISTEN_MAX_ACCEPTS; j++) {
+        salen = sizeof(sa);
+        cfd = accept4(fd, (struct sockaddr*)&sa, &salen,
+                      SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (cfd == -1) {
+            if (errno == EMFILE || errno == ENFILE) {
+                /* The pending connection would wake us up forever */
+                serverLogErrno(LL_WARN, "Not accepting clients until one "
+                               "disconnects");
+                _listenPause();
+            } else if (errno != EAGAIN && errno != EINTR &&
+                       errno != ECONNABORTED) {
+                serverLogErrno(LL_ERROR, "accept on %s", l->addr);
+            }
+            return;
+        }
+
+        if (l->type == LISTEN_RING) {
+            _listenSendRing(l, cfd);
+            continue;
+        }
+
+        if (l->type == LISTEN_UNIX) {
+            snprintf(name, sizeof(name), "unix:%s#%d", l->addr, cfd);
+        } else {
+            if (getnameinfo((struct sockaddr*)&sa, salen, host, sizeof(host),
+                            port, sizeof(port),
+                            NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+                strlcpy(host, "?", sizeof(host));
+                strlcpy(port, "?", sizeof(port));
+            }
+            snprintf(name, sizeof(name), "tcp:%s:%s", host, port);
+
+            /* Frames are written whole, do not hold them back */
+            setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+
+        if (serialAddClient(l->master, cfd, name) == C_ERR) {
+            close(cfd);
+        }
+    }
+}
+
+void listenInit(void)
+{
+    serialNode *node;
+
+    for (node = server.serial.master_head; node; node = node->next) {
+        if (node->tcp_listen) {
+            _listenAdd(node, node->tcp_listen, LISTEN_TCP, 0);
+        }
+        if (node->unix_listen) {
+            _listenAdd(node, node->unix_listen, LISTEN_UNIX, 0);
+        }
+        if (node->shm) {
+            _listenAdd(node, node->shm_listen, LISTEN_RING,
+                       node->shm_listen_mode);
+        }
+    }
+}
+
+void listenTerm(void)
+{
+    int j;
+
+    for (j = 0; j < nlisteners; j++) {
+        aeDeleteFileEvent(server.el, listeners[j].fd, AE_READABLE);
+        close(listeners[j].fd);
+        if (listeners[j].type != LISTEN_TCP) {
+            unlink(listeners[j].addr);
+        }
+    }
+
+    nlisteners = 0;
+    paused = 0;
+}
+
+void listenResume(void)
+{
+    int j;
+
+    if (!paused) {
+        return;
+    }
+
+    for (j = 0; j < nlisteners; j++) {
+        if (aeCreateFileEvent(server.el, listeners[j].fd, AE_READABLE,
+                              _listenAcceptHandler, &listeners[j]) == AE_ERR) {
+            serverLogErrno(LL_ERROR, "Can't accept on %s", listeners[j].addr);
+        }
+    }
+    paused = 0;
+
+    serverLog(LL_INFO, "Accepting clients again");
+}
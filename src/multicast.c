@@ -0,0 +1,179 @@
+#include "server.h"
+#include "multicast.h"
+
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+/**
+ * @brief Resolve group:port into the sender address.
+ *
+ * @param[in] m - Sender
+ * @param[in] spec - group:port
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _multicastResolve(multicastSender *m, const char *spec);
+
+static int _multicastResolve(multicastSender *m, const char *spec)
+{
+    struct addrinfo hints = {0};
+    struct addrinfo *res = NULL;
+    char host[PATH_MAX];
+    char *sep;
+    int ret;
+
+    strlcpy(host, spec, sizeof(host));
+    sep = strrchr(host, ':');
+    if (!sep) {
+        serverLog(LL_ERROR, "multicast must be group:port: %s", spec);
+        return C_ERR;
+    }
+    *sep = '\0';
+
+    if (host[0] == '[' && sep > host && sep[-1] == ']') {
+        sep[-1] = '\0';
+        memmove(host, host + 1, strlen(host));
+    }
+
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+
+    ret = getaddrinfo(host, sep + 1, &hints, &res);
+    if (ret != 0) {
+        serverLog(LL_ERROR, "Invalid multicast group %s: %s",
+                  spec, gai_strerror(ret));
+        return C_ERR;
+    }
+
+    memcpy(&m->addr, res->ai_addr, res->ai_addrlen);
+    m->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    return C_OK;
+}
+
+multicastSender *multicastCreate(const char *spec, int ttl)
+{
+    multicastSender *m;
+    int ret;
+
+    m = calloc(1, sizeof(*m));
+    if (!m) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+
+    m->fd = -1;
+
+    if (_multicastResolve(m, spec) == C_ERR) {
+        goto err;
+    }
+
+    m->fd = socket(m->addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                   0);
+    if (m->fd == -1) {
+        serverLogErrno(LL_ERROR, "socket");
+        goto err;
+    }
+
+    if (m->addr.ss_family == AF_INET6) {
+        ret = setsockopt(m->fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+                         &ttl, sizeof(ttl));
+    } else {
+        ret = setsockopt(m->fd, IPPROTO_IP, IP_MULTICAST_TTL,
+                         &ttl, sizeof(ttl));
+    }
+
+    if (ret == -1) {
+        serverLogErrno(LL_ERROR, "Can't set multicast TTL for %s", spec);
+        goto err;
+    }
+
+    return m;
+
+err:
+    multicastFree(m);
+    return NULL;
+}
+
+void multicastFree(multicastSender *m)
+{
+    if (!m) {
+        return;
+    }
+
+    if (m->fd != -1) {
+        close(m->fd);
+    }
+    free(m);
+}
+
+void multicastSend(multicastSender *m, const struct iovec *iov,
+                   const unsigned char *flags, int iovcnt)
+{
+    struct mmsghdr msgs[MULTICAST_MAX_BATCH];
+    struct iovec parts[MULTICAST_MAX_BATCH][2];
+    unsigned char headers[MULTICAST_MAX_BATCH][MULTICAST_HEADER_SIZE];
+    unsigned char *h;
+    int sent;
+    int n;
+    int j;
+
+    while (iovcnt > 0) {
+        n = 0;
+
+        for (j = 0; j < iovcnt && n < MULTICAST_MAX_BATCH; j++) {
+            if (iov[j].iov_len > MULTICAST_MAX_PAYLOAD) {
+                /* Still numbered, so receivers notice */
+                m->seq++;
+                m->drops++;
+                continue;
+            }
+
+            h = headers[n];
+            h[0] = MULTICAST_MAGIC0;
+            h[1] = MULTICAST_MAGIC1;
+            h[2] = MULTICAST_VERSION;
+            h[3] = flags ? flags[j] : 0;
+            h[4] = m->seq >> 24;
+            h[5] = m->seq >> 16;
+            h[6] = m->seq >> 8;
+            h[7] = m->seq;
+            m->seq++;
+
+            parts[n][0].iov_base = h;
+            parts[n][0].iov_len = MULTICAST_HEADER_SIZE;
+            parts[n][1] = iov[j];
+
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_name = &m->addr;
+            msgs[n].msg_hdr.msg_namelen = m->addrlen;
+            msgs[n].msg_hdr.msg_iov = parts[n];
+            msgs[n].msg_hdr.msg_iovlen = 2;
+            n++;
+        }
+
+        iov += j;
+        if (flags) {
+            flags += j;
+        }
+        iovcnt -= j;
+
+        if (!n) {
+            continue;
+        }
+
+        sent = sendmmsg(m->fd, msgs, n, 0);
+        if (sent == -1) {
+            if (errno != EAGAIN) {
+                serverLogErrno(LL_DEBUG, "sendmmsg");
+            }
+            sent = 0;
+        }
+
+        m->datagrams += sent;
+        m->drops += n - sent;
+    }
+}
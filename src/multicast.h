@@ -0,0 +1,66 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Every datagram starts with a header:
+ *   magic  2 bytes  'S' 'P'
+ *   version 1 byte  MULTICAST_VERSION
+ *   flags  1 byte   MULTICAST_FLAG_*
+ *   seq    4 bytes  big endian, incremented for every datagram
+ * followed by one frame (or one read() chunk on raw masters). */
+#define MULTICAST_MAGIC0        ('S')
+#define MULTICAST_MAGIC1        ('P')
+#define MULTICAST_VERSION       (1)
+#define MULTICAST_HEADER_SIZE   (8)
+#define MULTICAST_MAX_PAYLOAD   (65507 - MULTICAST_HEADER_SIZE)
+#define MULTICAST_MAX_BATCH     (64)   /* Datagrams per sendmmsg() */
+#define MULTICAST_DEFAULT_TTL   (1)
+
+/* Datagram flags */
+enum {
+    MULTICAST_FLAG_CORRUPT = 1,        /* Frame failed checksum validation */
+};
+
+typedef struct multicastSender {
+    int fd;                            /* UDP socket */
+    struct sockaddr_storage addr;      /* Group and port */
+    socklen_t addrlen;
+    uint32_t seq;                      /* Sequence of the next datagram */
+    unsigned long long datagrams;      /* Datagrams sent */
+    unsigned long long drops;          /* Datagrams not sent */
+} multicastSender;
+
+/**
+ * @brief Open a sender to a multicast group.
+ *
+ * @param[in] spec - group:port, ie. 239.1.2.3:5000 or [ff02::1]:5000
+ * @param[in] ttl - Multicast TTL (hops)
+ *
+ * @return Pointer to a newly allocated sender, or NULL on error
+ */
+multicastSender *multicastCreate(const char *spec, int ttl);
+
+/**
+ * @brief Close a sender.
+ *
+ * @param[in] m - Sender
+ */
+void multicastFree(multicastSender *m);
+
+/**
+ * @brief Send each buffer as one datagram, batched with sendmmsg(). The
+ *        cost does not depend on the number of receivers. Datagrams that
+ *        can't be sent right away are dropped, receivers see a sequence gap.
+ *
+ * @param[in] m - Sender
+ * @param[in] iov - Buffers, one per datagram
+ * @param[in] flags - MULTICAST_FLAG_* of each buffer, or NULL
+ * @param[in] iovcnt - Number of buffers
+ */
+void multicastSend(multicastSender *m, const struct iovec *iov,
+                   const unsigned char *flags, int iovcnt);
+
+#endif
@@ -0,0 +1,341 @@
+#include "server.h"
+#include "opener.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+typedef struct openerJob {
+    openerWorkProc *work;
+    openerDoneProc *done;
+    void *arg;
+    struct openerJob *next;
+} openerJob;
+
+typedef struct openerQueue {
+    openerJob *head;
+    openerJob *tail;
+} openerQueue;
+
+static pthread_mutex_t opener_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t opener_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t opener_idle = PTHREAD_COND_INITIALIZER;
+static openerQueue queued;           /* Waiting for a thread */
+static openerQueue finished;         /* Waiting for the event loop */
+static int maxthreads = 0;
+static int nthreads = 0;
+static int idle = 0;                 /* Threads waiting for a job */
+static int nqueued = 0;              /* Jobs waiting for a thread */
+static int running = 0;              /* Jobs being worked on */
+static int stopping = 0;
+static int opener_fd = -1;           /* eventfd, readable when finished */
+
+/**
+ * @brief Append a job to a queue.
+ */
+static void _openerPush(openerQueue *q, openerJob *job);
+
+/**
+ * @brief Take every job of a queue.
+ *
+ * @return First job of the list, NULL if the queue was empty
+ */
+static openerJob *_openerTake(openerQueue *q);
+
+/**
+ * @brief Call done on a list of jobs and free them.
+ *
+ * @param[in] job - First job of the list
+ * @param[in] cancelled - Passed to done
+ */
+static void _openerComplete(openerJob *job, int cancelled);
+
+/**
+ * @brief Start one more pool thread, with every signal blocked.
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _openerSpawn(void);
+
+/**
+ * @brief Main function of the pool threads.
+ *
+ * @param[in] arg - Unused
+ */
+static void *_openerThread(void *arg);
+
+/**
+ * @brief Read callback for the eventfd, completes finished jobs.
+ *
+ * @param[in] el - Pointer to event loop
+ * @param[in] fd - eventfd
+ * @param[in] privdata - Unused
+ * @param[in] mask - Event flags
+ */
+static void _openerHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+static void _openerPush(openerQueue *q, openerJob *job)
+{
+    job->next = NULL;
+
+    if (q->tail) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+}
+
+static openerJob *_openerTake(openerQueue *q)
+{
+    openerJob *job = q->head;
+
+    q->head = NULL;
+    q->tail = NULL;
+
+    return job;
+}
+
+static void _openerComplete(openerJob *job, int cancelled)
+{
+    openerJob *next;
+
+    while (job) {
+        next = job->next;
+        job->done(job->arg, cancelled);
+        free(job);
+        job = next;
+    }
+}
+
+static void *_openerThread(void *arg)
+{
+    uint64_t one = 1;
+    openerJob *job;
+    int notify;
+
+    (void) arg;
+
+    pthread_mutex_lock(&opener_lock);
+
+    for (;;) {
+        while (!queued.head && !stopping) {
+            idle++;
+            pthread_cond_wait(&opener_work, &opener_lock);
+            idle--;
+        }
+
+        if (stopping) {
+            break;
+        }
+
+        job = queued.head;
+        queued.head = job->next;
+        if (!queued.head) {
+            queued.tail = NULL;
+        }
+        nqueued--;
+        running++;
+
+        pthread_mutex_unlock(&opener_lock);
+        job->work(job->arg);
+        pthread_mutex_lock(&opener_lock);
+
+        running--;
+
+        /* The event loop is gone or about to be */
+        if (stopping) {
+            pthread_cond_signal(&opener_idle);
+            job->next = NULL;
+            pthread_mutex_unlock(&opener_lock);
+            _openerComplete(job, 1);
+            pthread_mutex_lock(&opener_lock);
+            break;
+        }
+
+        /* One wakeup for a burst of completions */
+        notify = finished.head == NULL;
+        _openerPush(&finished, job);
+
+        if (notify && write(opener_fd, &one, sizeof(one)) == -1) {
+            serverLogErrno(LL_WARN, "Can't wake up the event loop");
+        }
+    }
+
+    nthreads--;
+    pthread_mutex_unlock(&opener_lock);
+
+    return NULL;
+}
+
+static void _openerHandler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    uint64_t count;
+    openerJob *job;
+
+    (void) el;
+    (void) privdata;
+    (void) mask;
+
+    if (read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        serverLogErrno(LL_WARN, "eventfd read");
+    }
+
+    pthread_mutex_lock(&opener_lock);
+    job = _openerTake(&finished);
+    pthread_mutex_unlock(&opener_lock);
+
+    _openerComplete(job, 0);
+}
+
+static int _openerSpawn(void)
+{
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigset_t all;
+    sigset_t old;
+    int ret;
+
+    /* Threads are never joined, signals stay with the main thread */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, OPENER_STACK_SIZE);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    ret = pthread_create(&tid, &attr, _openerThread, NULL);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (ret != 0) {
+        errno = ret;
+        serverLogErrno(LL_WARN, "pthread_create");
+        return C_ERR;
+    }
+
+    nthreads++;
+
+    return C_OK;
+}
+
+void openerInit(int threads)
+{
+    if (threads <= 0) {
+        return;
+    }
+
+    opener_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (opener_fd == -1) {
+        serverLogErrno(LL_WARN, "eventfd, devices are opened synchronously");
+        return;
+    }
+
+    if (aeCreateFileEvent(server.el, opener_fd, AE_READABLE,
+                          _openerHandler, NULL) == AE_ERR) {
+        serverLogErrno(LL_WARN, "Can't poll eventfd, devices are opened "
+                       "synchronously");
+        close(opener_fd);
+        opener_fd = -1;
+        return;
+    }
+
+    maxthreads = threads > OPENER_MAX_THREADS ? OPENER_MAX_THREADS : threads;
+    stopping = 0;
+}
+
+void openerTerm(void)
+{
+    struct timespec deadline;
+    openerJob *pending;
+    openerJob *done;
+
+    if (opener_fd == -1) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += OPENER_TERM_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (OPENER_TERM_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&opener_lock);
+    stopping = 1;
+    pending = _openerTake(&queued);
+    nqueued = 0;
+    pthread_cond_broadcast(&opener_work);
+
+    while (running > 0) {
+        if (pthread_cond_timedwait(&opener_idle, &opener_lock,
+                                   &deadline) != 0) {
+            serverLog(LL_WARN, "%d device%s still blocked, not waiting",
+                      running, running > 1 ? "s" : "");
+            break;
+        }
+    }
+
+    done = _openerTake(&finished);
+    pthread_mutex_unlock(&opener_lock);
+
+    _openerComplete(done, 1);
+    _openerComplete(pending, 1);
+
+    aeDeleteFileEvent(server.el, opener_fd, AE_READABLE);
+    close(opener_fd);
+    opener_fd = -1;
+    maxthreads = 0;
+}
+
+void openerSubmit(openerWorkProc *work, openerDoneProc *done, void *arg)
+{
+    openerJob *job;
+    openerJob *next;
+
+    if (maxthreads == 0) {
+        work(arg);
+        done(arg, 0);
+        return;
+    }
+
+    job = malloc(sizeof(*job));
+    if (!job) {
+        serverLog(LL_ERROR, "malloc failed");
+        exit(1);
+    }
+
+    job->work = work;
+    job->done = done;
+    job->arg = arg;
+
+    pthread_mutex_lock(&opener_lock);
+    _openerPush(&queued, job);
+    nqueued++;
+
+    /* A blocked device keeps its thread, the next job gets another one.
+     * Idle threads may not have woken up for the jobs before this one */
+    if (nqueued > idle && nthreads < maxthreads) {
+        /* Without any thread nothing would ever run it, and the node
+         * would stay opening */
+        if (_openerSpawn() == C_ERR && nthreads == 0) {
+            job = _openerTake(&queued);
+            nqueued = 0;
+            pthread_mutex_unlock(&opener_lock);
+
+            serverLog(LL_WARN, "No opener thread, opening inline");
+            for (next = job; next; next = next->next) {
+                next->work(next->arg);
+            }
+            _openerComplete(job, 0);
+            return;
+        }
+    } else {
+        pthread_cond_signal(&opener_work);
+    }
+
+    pthread_mutex_unlock(&opener_lock);
+}
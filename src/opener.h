@@ -0,0 +1,46 @@
+#ifndef OPENER_H
+#define OPENER_H
+
+/* A pool of helper threads for work that may block for a long time, such as
+ * opening and configuring a device whose driver is wedged. The work function
+ * runs on a pool thread, the done function runs on the event loop thread
+ * once the work is finished, woken up through an eventfd. Work functions
+ * must only touch their own argument. Threads are started when work is
+ * queued and none is idle, up to the configured number, and then stay. */
+
+#define OPENER_MAX_THREADS      (256)
+#define OPENER_STACK_SIZE       (256*1024)
+#define OPENER_TERM_TIMEOUT_MS  (1000)  /* Wait for running work at exit */
+
+typedef void openerWorkProc(void *arg);
+
+/* cancelled is set when the work never ran or finished after openerTerm().
+ * The done function may then be called from a pool thread and must only
+ * release its argument. */
+typedef void openerDoneProc(void *arg, int cancelled);
+
+/**
+ * @brief Start the pool and register its eventfd with the event loop.
+ *
+ * @param[in] threads - Maximum number of threads, 0 to run work
+ *                      synchronously
+ */
+void openerInit(int threads);
+
+/**
+ * @brief Stop the pool. Queued work is cancelled, running work is waited for
+ *        up to OPENER_TERM_TIMEOUT_MS and cancelled when it finishes.
+ */
+void openerTerm(void);
+
+/**
+ * @brief Queue work for the pool. Without threads, or when none can be
+ *        started, work and done are called before returning.
+ *
+ * @param[in] work - Function run on a pool thread
+ * @param[in] done - Function run on the event loop thread afterwards
+ * @param[in] arg - Argument of both functions
+ */
+void openerSubmit(openerWorkProc *work, openerDoneProc *done, void *arg);
+
+#endif
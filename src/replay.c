@@ -0,0 +1,366 @@
+#include "server.h"
+#include "replay.h"
+#include "capture.h"
+
+#include <glob.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REPLAY_NO_ORIGIN UINT64_MAX
+
+/**
+ * @brief Map a file of the source, unmapping the previous one.
+ *
+ * @param[in] r - Replay
+ * @param[in] file - Index in files
+ *
+ * @return C_OK if successful, C_ERR if the file can't be replayed
+ */
+static int _replayMap(replay *r, int file);
+
+/**
+ * @brief Unmap the current file.
+ *
+ * @param[in] r - Replay
+ */
+static void _replayUnmap(replay *r);
+
+/**
+ * @brief Read the next record of the current file.
+ *
+ * @param[in] r - Replay
+ * @param[out] ts - Recorded time in nanoseconds
+ *
+ * @return 1 if a record was read into r->data, 0 at the end of the file
+ */
+static int _replayReadRecord(replay *r, uint64_t *ts);
+
+/**
+ * @brief Read the next record of the source and compute when it is due.
+ *
+ * @param[in] r - Replay
+ *
+ * @return 1 if a record was read, 0 at the end of the source
+ */
+static int _replayFetch(replay *r);
+
+/**
+ * @brief Add a file to the replay order.
+ */
+static void _replayAddFile(replay *r, const char *path);
+
+static void _replayAddFile(replay *r, const char *path)
+{
+    char **files;
+
+    files = realloc(r->files, (r->nfiles + 1) * sizeof(*files));
+    if (!files) {
+        serverLog(LL_ERROR, "realloc failed");
+        exit(1);
+    }
+    r->files = files;
+
+    r->files[r->nfiles] = strdup(path);
+    if (!r->files[r->nfiles]) {
+        serverLog(LL_ERROR, "strdup failed");
+        exit(1);
+    }
+    r->nfiles++;
+}
+
+static void _replayUnmap(replay *r)
+{
+    if (r->map) {
+        munmap((void*)r->map, r->maplen);
+        r->map = NULL;
+        r->maplen = 0;
+    }
+}
+
+static int _replayMap(replay *r, int file)
+{
+    const captureFileHeader *hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    _replayUnmap(r);
+    r->file = file;
+    r->off = 0;
+
+    fd = open(r->files[file], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        serverLogErrno(LL_WARN, "Can't open %s", r->files[file]);
+        return C_ERR;
+    }
+
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return C_ERR;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        serverLogErrno(LL_WARN, "Can't map %s", r->files[file]);
+        return C_ERR;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    r->map = map;
+    r->maplen = st.st_size;
+
+    if (r->format == REPLAY_CAPTURE) {
+        hdr = (const captureFileHeader*)r->map;
+        if (r->maplen < sizeof(*hdr) ||
+            memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+            hdr->version != CAPTURE_VERSION ||
+            hdr->header_size > r->maplen) {
+            serverLog(LL_WARN, "%s is not a capture segment, skipped",
+                      r->files[file]);
+            _replayUnmap(r);
+            return C_ERR;
+        }
+        r->off = hdr->header_size;
+    }
+
+    return C_OK;
+}
+
+static int _replayReadRecord(replay *r, uint64_t *ts)
+{
+    const captureRecord *rec;
+    uint64_t bits;
+    size_t chunk;
+
+    if (r->format == REPLAY_RAW) {
+        if (r->off >= r->maplen) {
+            return 0;
+        }
+
+        chunk = r->baudrate / 10000;
+        if (chunk < 1) chunk = 1;
+        if (chunk > REPLAY_MAX_CHUNK) chunk = REPLAY_MAX_CHUNK;
+        if (chunk > r->maplen - r->off) chunk = r->maplen - r->off;
+
+        /* Time the last bit of the chunk arrived on the line, seconds and
+         * the rest apart: bits * 10^9 overflows past 1.8 GB */
+        bits = (uint64_t)(r->off + chunk) * 10;
+        *ts = bits / r->baudrate * 1000000000ULL +
+              bits % r->baudrate * 1000000000ULL / r->baudrate;
+        r->data = (const char*)r->map + r->off;
+        r->len = chunk;
+        r->off += chunk;
+        return 1;
+    }
+
+    while (r->off + sizeof(captureRecord) <= r->maplen) {
+        rec = (const captureRecord*)(r->map + r->off);
+
+        /* Pre-allocated zeroes of a segment that was not closed */
+        if (rec->len == 0 && rec->dir == 0) {
+            return 0;
+        }
+
+        if (r->off + CAPTURE_RECORD_SIZE(rec->len) > r->maplen) {
+            serverLog(LL_WARN, "%s: truncated record at %zu",
+                      r->files[r->file], r->off);
+            return 0;
+        }
+
+        r->off += CAPTURE_RECORD_SIZE(rec->len);
+
+        /* What writers sent to the device is not replayed */
+        if (rec->dir != CAPTURE_RX || rec->len == 0) {
+            continue;
+        }
+
+        *ts = rec->timestamp;
+        r->data = (const char*)(rec + 1);
+        r->len = rec->len;
+        return 1;
+    }
+
+    return 0;
+}
+
+static int _replayFetch(replay *r)
+{
+    uint64_t ts;
+    double elapsed;
+
+    for (;;) {
+        if (r->map && _replayReadRecord(r, &ts)) {
+            break;
+        }
+
+        do {
+            if (r->file + 1 >= r->nfiles) {
+                _replayUnmap(r);
+                return 0;
+            }
+        } while (_replayMap(r, r->file + 1) == C_ERR);
+    }
+
+    if (r->origin == REPLAY_NO_ORIGIN) {
+        r->origin = ts;
+        r->last = ts;
+    }
+
+    /* Segments of different daemon runs: keep going without a pause */
+    if (ts < r->last) {
+        r->origin -= r->last - ts;
+    }
+    r->last = ts;
+
+    if (r->speed > 0) {
+        elapsed = (double)(ts - r->origin) / 1000.0 / r->speed;
+        r->due_us = r->start_us + (long long)elapsed;
+    } else {
+        r->due_us = r->start_us;
+    }
+
+    return 1;
+}
+
+replay *replayOpen(const char *path, double speed, int loop, int baudrate)
+{
+    char pattern[PATH_MAX + 16];
+    char magic[sizeof(CAPTURE_MAGIC)];
+    struct stat st;
+    replay *r;
+    glob_t g;
+    size_t j;
+    int fd;
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+
+    strlcpy(r->path, path, sizeof(r->path));
+    r->speed = speed;
+    r->loop = loop;
+    r->baudrate = baudrate > 0 ? baudrate : 9600;
+    r->file = -1;
+    r->due_us = -1;
+    r->origin = REPLAY_NO_ORIGIN;
+
+    if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+        _replayAddFile(r, path);
+        r->format = REPLAY_RAW;
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            if (read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+                memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0) {
+                r->format = REPLAY_CAPTURE;
+            }
+            close(fd);
+        }
+    } else {
+        /* A capture prefix, zero padded sequence numbers sort in order */
+        snprintf(pattern, sizeof(pattern), "%s.[0-9]*", path);
+        if (glob(pattern, 0, NULL, &g) == 0) {
+            for (j = 0; j < g.gl_pathc && j < REPLAY_MAX_SEGMENTS; j++) {
+                _replayAddFile(r, g.gl_pathv[j]);
+            }
+            globfree(&g);
+        }
+        r->format = REPLAY_CAPTURE;
+    }
+
+    if (r->nfiles == 0) {
+        serverLog(LL_ERROR, "Nothing to replay at %s", path);
+        replayFree(r);
+        return NULL;
+    }
+
+    serverLog(LL_INFO, "Replaying %s (%s, %d file%s)", path,
+              r->format == REPLAY_RAW ? "raw" : "capture", r->nfiles,
+              r->nfiles > 1 ? "s" : "");
+
+    return r;
+}
+
+void replayFree(replay *r)
+{
+    int j;
+
+    if (!r) {
+        return;
+    }
+
+    _replayUnmap(r);
+
+    for (j = 0; j < r->nfiles; j++) {
+        free(r->files[j]);
+    }
+    free(r->files);
+    free(r);
+}
+
+void replayStart(replay *r, long long now)
+{
+    _replayUnmap(r);
+    r->file = -1;
+    r->due_us = -1;
+    r->origin = REPLAY_NO_ORIGIN;
+    r->start_us = now;
+    r->pass = 0;
+}
+
+int replayNext(replay *r, long long now, const char **data, size_t *len)
+{
+    long long lag;
+
+    if (r->start_us == -1) {
+        r->start_us = now;
+    }
+
+    if (r->due_us == -1 && !_replayFetch(r)) {
+        if (!r->loop || r->pass == 0) {
+            return -1;
+        }
+
+        r->loops++;
+        replayStart(r, now);
+        if (!_replayFetch(r)) {
+            return -1;
+        }
+    }
+
+    if (r->due_us > now) {
+        return 0;
+    }
+
+    if (r->speed > 0) {
+        lag = now - r->due_us;
+        r->lag_us += lag;
+        if (lag > r->lag_max_us) {
+            r->lag_max_us = lag;
+        }
+        if (lag > 1000) {
+            r->late_records++;
+        }
+    }
+
+    *data = r->data;
+    *len = r->len;
+    r->record_us = r->due_us;
+    r->due_us = -1;
+    r->pass++;
+    r->records++;
+    r->bytes += r->len;
+
+    return 1;
+}
+
+long long replayDue(const replay *r)
+{
+    return r->due_us;
+}
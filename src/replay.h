@@ -0,0 +1,105 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <linux/limits.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A replay source is either a capture (see capture.h), given as the path
+ * prefix of its segments or as a single segment, or any other file, which
+ * is treated as a raw dump of the line. Captures are replayed with their
+ * recorded timing, only what was read from the device (CAPTURE_RX). Raw
+ * dumps are paced by the baudrate, in chunks of one millisecond of line
+ * time (10 bits per byte). */
+
+#define REPLAY_MAX_SEGMENTS    (1024)
+#define REPLAY_MAX_CHUNK       (8192)  /* Bytes per raw chunk */
+#define REPLAY_BATCH_BYTES     (65536) /* Bytes per event when unpaced */
+
+/* Source formats */
+enum {
+    REPLAY_CAPTURE = 0,
+    REPLAY_RAW,
+};
+
+typedef struct replay {
+    char path[PATH_MAX];               /* Capture prefix or file */
+    int format;                        /* REPLAY_CAPTURE or REPLAY_RAW */
+    double speed;                      /* Speed factor, 0: unpaced */
+    int loop;                          /* Start over at the end */
+    int baudrate;                      /* Pacing of raw dumps */
+    char **files;                      /* Files in replay order */
+    int nfiles;
+    int file;                          /* Index of the mapped file */
+    const unsigned char *map;          /* Mapped file, NULL if none */
+    size_t maplen;
+    size_t off;                        /* Offset of the next record */
+    const char *data;                  /* Next record, if read */
+    size_t len;
+    uint64_t last;                     /* Recorded time of the last record */
+    uint64_t origin;                   /* Recorded time of the first record
+                                          in nanoseconds */
+    long long start_us;                /* Monotonic time of the first record */
+    long long due_us;                  /* Monotonic time of the next record,
+                                          -1 if not read yet */
+    long long record_us;               /* Monotonic time the record last
+                                          returned was due */
+    unsigned long long pass;           /* Records replayed since the start */
+    unsigned long long records;        /* Records replayed */
+    unsigned long long bytes;          /* Bytes replayed */
+    unsigned long long loops;          /* Times the source was started over */
+    unsigned long long late_records;   /* Records replayed over 1 ms late */
+    long long lag_us;                  /* Sum of replay delays */
+    long long lag_max_us;              /* Largest replay delay */
+} replay;
+
+/**
+ * @brief Open a replay source.
+ *
+ * @param[in] path - Capture segment prefix, capture segment or raw dump
+ * @param[in] speed - Speed factor (2: twice as fast), 0 to replay as fast
+ *                    as possible
+ * @param[in] loop - Start over at the end
+ * @param[in] baudrate - Line speed used to pace raw dumps
+ *
+ * @return Pointer to a newly allocated replay, or NULL on error
+ */
+replay *replayOpen(const char *path, double speed, int loop, int baudrate);
+
+/**
+ * @brief Close the source and free the replay.
+ *
+ * @param[in] r - Replay
+ */
+void replayFree(replay *r);
+
+/**
+ * @brief Start (over) at the first record, timed from now.
+ *
+ * @param[in] r - Replay
+ * @param[in] now - Monotonic time in microseconds, -1 to start at the
+ *                  first replayNext() call
+ */
+void replayStart(replay *r, long long now);
+
+/**
+ * @brief Return the next record if it is due.
+ *
+ * @param[in] r - Replay
+ * @param[in] now - Monotonic time in microseconds
+ * @param[out] data - Start of record, valid until the next call
+ * @param[out] len - Length of record
+ *
+ * @return 1 if a record was returned, 0 if the next one is not due yet
+ *         (see replayDue), -1 at the end of the source
+ */
+int replayNext(replay *r, long long now, const char **data, size_t *len);
+
+/**
+ * @brief Return the monotonic time in microseconds the next record is due.
+ *
+ * @param[in] r - Replay
+ */
+long long replayDue(const replay *r);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+/* Layout of the shared memory ring a master publishes its frames in. It is
+ * shared by sproxyd (single producer) and libsproxy (any number of
+ * consumers), both sides only use this header.
+ *
+ * The memfd holds a RING_HEADER_SIZE header followed by a power of two data
+ * area. Positions are byte counts since the ring was created, the offset in
+ * the data area is position & (size - 1). Each record is a ringRecord
+ * followed by the frame, padded to RING_ALIGN. A record never wraps, a
+ * RING_WRAP record fills the end of the data area instead.
+ *
+ * The producer never waits for consumers: it stores reserve (end of the
+ * record about to be written) before copying and head (end of the last
+ * complete record) after. A consumer at position p knows its data was
+ * intact while reserve - p <= size.
+ *
+ * The memfd is sealed against writes once the producer mapped it, consumers
+ * can only map it read only. What sleeping consumers write, the futex and
+ * the number of sleepers, is in a second memfd of RING_WAIT_SIZE bytes handed
+ * out along with it: a consumer can disturb the wakeups there, not the
+ * frames. */
+
+#define RING_MAGIC       (0x53505231)  /* "SPR1" */
+#define RING_VERSION     (2)
+#define RING_HEADER_SIZE (4096)
+#define RING_WAIT_SIZE   (4096)
+#define RING_ALIGN       (8)
+#define RING_WRAP        (0xffffffffu) /* Record length: skip to offset 0 */
+#define RING_MIN_SIZE    (4096)
+#define RING_MAX_SIZE    (1U << 30)
+
+/* Record flags */
+enum {
+    RING_FLAG_CORRUPT = 1,             /* Frame failed checksum validation */
+};
+
+typedef struct ringHeader {
+    uint32_t magic;                    /* RING_MAGIC */
+    uint32_t version;                  /* RING_VERSION */
+    uint64_t size;                     /* Size of the data area */
+    uint64_t reserve __attribute__ ((aligned(64))); /* End of the record
+                                          being written */
+    uint64_t head __attribute__ ((aligned(64)));    /* End of the last
+                                          complete record */
+} ringHeader;
+
+typedef struct ringWait {
+    uint32_t futex;                    /* Bumped at every publish */
+    uint32_t waiters;                  /* Consumers sleeping on futex */
+} ringWait;
+
+typedef struct ringRecord {
+    uint32_t len;                      /* Frame length or RING_WRAP */
+    uint32_t flags;                    /* RING_FLAG_* */
+} ringRecord;
+
+#define RING_RECORD_SIZE(len) \
+    ((sizeof(ringRecord) + (len) + RING_ALIGN - 1) & ~(uint64_t)(RING_ALIGN - 1))
+
+#endif
@@ -1,24 +1,144 @@
 #include "server.h"
 #include "serial.h"
+#include "opener.h"
+#include "baud.h"
+#include "trace.h"
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
 #include <pty.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
 #include <linux/serial.h>
 
 /* <device-path>.<virtual-suffix> */
 #define SERIAL_VIRTUAL_FORMAT ("%s.%s")
 
+/* Frames handed to writev() at once */
+#define SERIAL_MAX_IOV (64)
+
+/* First allocation of a backlog, doubled as needed. Small, so that what a
+ * partial write leaves over costs little when memory is tight */
+#define SERIAL_MIN_BACKLOG (512)
+
+/* Room kept in the backlog of a virtual above flow-high, for the read that
+ * throttles its master. On framed masters that read may complete a frame of
+ * up to FRAMING_BUF_SIZE bytes, most of it read before */
+#define SERIAL_FLOW_HEADROOM (BUFSIZ)
+#define SERIAL_FLOW_FRAMED_HEADROOM (FRAMING_BUF_SIZE + BUFSIZ)
+
+/* USB-serial adapters (ftdi_sio) expose their latency timer here */
+#define SERIAL_LATENCY_TIMER_FORMAT ("/sys/class/tty/%s/device/latency_timer")
+
+/* Tuning applied by each profile, indexed by SERIAL_PROFILE_* */
+static const serialTuning profile_tuning[] = {
+    { -1, -1, -1, -1 },              /* none */
+    {  1,  0,  1,  1 },              /* latency */
+    {  1,  0,  0, 16 },              /* throughput */
+    { -1, -1, -1, -1 },              /* custom */
+};
+
+/* Share of max-buffer-memory each priority class may fill, in percent,
+ * indexed by SERIAL_PRIORITY_*. What the lower classes may not take is
+ * left to the ones above */
+static const int priority_share[] = { 100, 75, 50 };
+
+static const char *priority_names[] = {
+    "critical",
+    "normal",
+    "bulk",
+};
+
+static const char *output_names[] = {
+    "raw",
+    "framed",
+};
+
+static const char *flow_names[] = {
+    "keep",
+    "none",
+    "rtscts",
+    "xonxoff",
+};
+
+static const char *flow_policy_names[] = {
+    "drop",
+    "throttle-master",
+};
+
+static const char *profile_names[] = {
+    "none",
+    "latency",
+    "throughput",
+    "custom",
+};
+
+/* A device being opened and configured on an opener thread. The thread
+ * only works on the copies, the node is left to the event loop */
+typedef struct serialOpen {
+    serialNode *node;
+    char name[PATH_MAX];
+    int master;
+    int baudrate;
+    int baud_actual;                 /* Rate reported by the driver */
+    serialTuning tuning;
+    int flow_control;                /* SERIAL_FLOW_* */
+    int fd;
+    int sfd;
+    int ret;                         /* C_OK once configured */
+} serialOpen;
+
 /**
- * @brief Create and open a new connection link.
+ * @brief Create a connection link for an open device and poll it. Replay
+ *        masters open their timer here.
  *
  * @param[in] node - Serial node to assign connection link to
+ * @param[in] fd - Device, or master side of the pty of a virtual
+ * @param[in] sfd - Slave side of the pty of a virtual, -1 otherwise
+ *
+ * @return Pointer to a newly allocated serial connection link, NULL on
+ *         error (fd and sfd are closed)
+ */
+static serialLink *_serialCreateLink(serialNode *node, int fd, int sfd);
+
+/**
+ * @brief Open and configure a master device, or create the pty and symlink
+ *        of a virtual. Runs on an opener thread, anything here may block.
+ *
+ * @param[in] arg - serialOpen of the node
+ */
+static void _serialOpenDevice(void *arg);
+
+/**
+ * @brief Create the link of a device opened by _serialOpenDevice(), then
+ *        connect the virtuals of a master.
+ *
+ * @param[in] arg - serialOpen of the node
+ * @param[in] cancelled - Shutting down, only release the device
+ */
+static void _serialOpenDone(void *arg, int cancelled);
+
+/**
+ * @brief Resolve the tuning of a master from its profile and explicit
+ *        overrides.
+ *
+ * @param[in] node - Master serial node
+ * @param[out] tuning - Effective tuning
+ */
+static void _serialGetTuning(serialNode *node, serialTuning *tuning);
+
+/**
+ * @brief Apply driver level tuning (low latency flag, USB latency timer)
+ *        to an open master. Unsupported settings are skipped.
  *
- * @return Pointer to a newly allocated serial connection link
+ * @param[in] fd - Master device
+ * @param[in] name - Path of the master
+ * @param[in] tuning - Effective tuning
  */
-static serialLink *_serialCreateLink(serialNode *node);
+static void _serialApplyTuning(int fd, const char *name,
+                               const serialTuning *tuning);
 
 /**
  * @brief Close connection and release memory.
@@ -38,17 +158,377 @@ static void _serialLinkIOError(serialLink *link);
 /**
  * @brief Iterate through all master and virtual serial devices and reconnect
  *        devices which are disconnected.
+ *
+ * @return Number of nodes that are still disconnected
+ */
+static int _serialReconnect(void);
+
+/**
+ * @brief Reconnect a master serial device, if disconnected, and then any of
+ *        its disconnected virtuals.
+ *
+ * @param[in] node - Master serial node
+ *
+ * @return C_OK if the master is connected, C_ERR otherwise
  */
-static void _serialReconnect(void);
+static int _serialReconnectMaster(serialNode *node);
 
 /**
- * @brief Write data from fromlink to tolink.
+ * @brief Write data to tolink without blocking the event loop. What the fd
+ *        does not accept is kept in the link backlog and written once the
+ *        fd is writable. Buffers that do not fit in output-backlog go to
+ *        the spill of the virtual or are dropped whole, the rest of a
+ *        partially written buffer is always kept so frames are never cut.
  *
  * @param[in] tolink - Link to write to
- * @param[in[ fromlink - Link to read buffer
+ * @param[in] iov - Buffers to write
+ * @param[in] iovcnt - Number of buffers
+ * @param[in] len - Total number of bytes in iov
+ *
+ * @return C_ERR if the write failed and the link, and a client node, was
+ *         freed, C_OK otherwise
+ */
+static int _serialWriteLink(serialLink *tolink, const struct iovec *iov,
+                            int iovcnt, size_t len);
+
+/**
+ * @brief Handle a failed write to a virtual or client link.
+ *
+ * @param[in] link - Link the write failed on
+ */
+static void _serialLinkWriteError(serialLink *link);
+
+/**
+ * @brief Return the size the backlog buffer of a link needs to take more
+ *        bytes.
+ *
+ * @param[in] link - Link
+ * @param[in] len - Number of bytes to add
+ *
+ * @return Size in bytes, osize if it is large enough
+ */
+static size_t _serialLinkSize(serialLink *link, size_t len);
+
+/**
+ * @brief Tell whether the backlog of a link can take more bytes, within
+ *        output-backlog and the memory share of its priority class.
+ *
+ * @param[in] link - Link
+ * @param[in] len - Number of bytes
+ *
+ * @return 1 if it can, 0 otherwise
+ */
+static int _serialLinkRoom(serialLink *link, size_t len);
+
+/**
+ * @brief Tell whether a node may allocate more buffer memory, within the
+ *        share of max-buffer-memory of its priority class. Refusals are
+ *        counted.
+ *
+ * @param[in] node - Serial node
+ * @param[in] bytes - Bytes to allocate
+ *
+ * @return 1 if it may, 0 otherwise
+ */
+static int _serialMemAllowed(serialNode *node, size_t bytes);
+
+/**
+ * @brief Account buffer memory allocated for a node.
+ *
+ * @param[in] node - Serial node
+ * @param[in] bytes - Bytes allocated
+ */
+static void _serialMemCharge(serialNode *node, size_t bytes);
+
+/**
+ * @brief Account buffer memory a node released.
+ *
+ * @param[in] node - Serial node
+ * @param[in] bytes - Bytes released
+ */
+static void _serialMemRelease(serialNode *node, size_t bytes);
+
+/**
+ * @brief Return the bytes of the buffers a node allocates once, as
+ *        configured: history, shared memory ring and framer.
+ *
+ * @param[in] node - Serial node
+ *
+ * @return Number of bytes
+ */
+static size_t _serialFixedMemory(serialNode *node);
+
+/**
+ * @brief Append bytes to the backlog of a link.
+ *
+ * @param[in] link - Link
+ * @param[in] data - Bytes to append
+ * @param[in] len - Number of bytes
+ */
+static void _serialLinkAppend(serialLink *link, const char *data, size_t len);
+
+/**
+ * @brief Queue a buffer after everything pending for a link: in its backlog
+ *        while it fits in output-backlog, then in its spill until the spill
+ *        is drained again.
+ *
+ * @param[in] link - Link
+ * @param[in] data - Bytes to queue
+ * @param[in] len - Number of bytes
+ *
+ * @return C_OK if queued, C_ERR if there is no room
+ */
+static int _serialLinkQueue(serialLink *link, const char *data, size_t len);
+
+/**
+ * @brief Return the bytes waiting for a link, in its backlog and its spill.
+ *
+ * @param[in] link - Link
+ *
+ * @return Number of bytes
+ */
+static size_t _serialLinkPending(serialLink *link);
+
+/**
+ * @brief Write the backlog of a link, then its spill, until both are empty
+ *        or the fd would block.
+ *
+ * @param[in] link - Link with a backlog
+ */
+static void _serialFlushLink(serialLink *link);
+
+/**
+ * @brief Queue buffers to a link's backlog without writing, for the event
+ *        loop to write them once more urgent consumers were served. Buffers
+ *        that do not fit in the output backlog are shed.
+ *
+ * @param[in] link - Communication link of a virtual
+ * @param[in] iov - Buffers
+ * @param[in] iovcnt - Number of buffers
+ */
+static void _serialDeferLink(serialLink *link, const struct iovec *iov,
+                             int iovcnt);
+
+/**
+ * @brief Stop reading the master of a virtual (throttle-master policy) once
+ *        the backlog of the virtual reaches flow-high.
+ *
+ * @param[in] link - Link of a virtual that just queued output
+ */
+static void _serialFlowHold(serialLink *link);
+
+/**
+ * @brief Resume reading a throttled master once the backlog of each of its
+ *        virtuals is down to flow-low.
+ *
+ * @param[in] master - Master serial node, may be NULL
+ */
+static void _serialFlowRelease(serialNode *master);
+
+/**
+ * @brief Stop or resume reading a master. With XON/XOFF the other end is
+ *        told right away, with RTS/CTS the tty layer deasserts RTS once its
+ *        buffer fills up.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] on - 1 to stop reading, 0 to resume
+ */
+static void _serialThrottle(serialNode *master, int on);
+
+/**
+ * @brief Order the virtuals of a master by priority, keeping the order
+ *        within a class.
+ *
+ * @param[in] master - Master node
+ */
+static void _serialSortVirtuals(serialNode *master);
+
+/**
+ * @brief Write data read from a master to all of its connected virtuals,
+ *        its multicast group and its shared memory ring. Virtuals with a subscription list only get
+ *        the frames whose mask has their bit set, corrupt frames are handled
+ *        per virtual.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] iov - Buffers to write, each holding whole frames
+ * @param[in] info - Subscribers and validation result of each buffer, or
+ *                   NULL to deliver every buffer to every virtual
+ * @param[in] iovcnt - Number of buffers
+ * @param[in] len - Total number of bytes in iov
+ */
+static void _serialFanout(serialNode *master, const struct iovec *iov,
+                          const serialFrameInfo *info, int iovcnt, size_t len);
+
+/**
+ * @brief Write the header of a framed output record.
+ *
+ * @param[out] p - SERIAL_FRAMED_HEADER_SIZE bytes
+ * @param[in] flags - SERIAL_FRAMED_FLAG_*
+ * @param[in] len - Payload length
+ * @param[in] seq - Master sequence number
+ * @param[in] drops - Records lost by the virtual so far
+ * @param[in] us - Receive time, CLOCK_MONOTONIC microseconds
+ */
+static void _serialFramedHeader(unsigned char *p, int flags, uint32_t len,
+                                uint32_t seq, uint32_t drops, long long us);
+
+/**
+ * @brief Turn the buffers sent to a framed virtual into records, built in
+ *        server.serial.framed, so that each record is queued or dropped
+ *        whole.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] vnode - Virtual with framed output
+ * @param[in] info - Validation result of the fanned out buffers, or NULL
+ * @param[in,out] iov - Buffers for the virtual, pointed to records
+ * @param[in] idx - Index of each buffer among the fanned out ones
+ * @param[in] iovcnt - Number of buffers
+ * @param[in] len - Total number of bytes in iov
+ *
+ * @return Total number of bytes of the records
+ */
+static size_t _serialFrameRecords(serialNode *master, serialNode *vnode,
+                                  const serialFrameInfo *info,
+                                  struct iovec *iov, const int *idx,
+                                  int iovcnt, size_t len);
+
+/**
+ * @brief Return the virtuals subscribed to the message type of a frame.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] frame - Complete frame
+ * @param[in] len - Length of frame
+ *
+ * @return Mask of subscribed virtuals (subindex bits)
+ */
+static uint64_t _serialSubscribers(serialNode *master, const char *frame,
+                                   size_t len);
+
+/**
+ * @brief Run bytes read from a master through its framer and fan out the
+ *        complete frames.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] data - Bytes read
+ * @param[in] len - Number of bytes read
+ */
+static void _serialFrameInput(serialNode *master, const char *data, size_t len);
+
+/**
+ * @brief Fan out the complete frames pending in the framer of a master.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] info - Per frame results buffer, or NULL if not needed
+ */
+static void _serialFrameOutput(serialNode *master, serialFrameInfo *info);
+
+/**
+ * @brief Fan out the frames a silence framed master completed, stamped
+ *        with the read their first bytes came in.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] info - Per frame results buffer, or NULL if not needed
+ */
+static void _serialSilenceOutput(serialNode *master, serialFrameInfo *info);
+
+/**
+ * @brief Return the silence ending a frame on a silence framed master, from
+ *        its rate.
+ *
+ * @param[in] master - Master serial node
+ *
+ * @return Silence in microseconds
+ */
+static long long _serialSilenceUs(serialNode *master);
+
+/**
+ * @brief Timer callback of a silence framed master, the line has been
+ *        silent since the last bytes read: they are a frame.
+ *
+ * @param[in] el - Pointer to event loop
+ * @param[in] fd - timerfd
+ * @param[in] privdata - Master serial node
+ * @param[in] mask - Event flags
+ */
+static void _serialSilenceHandler(aeEventLoop *el, int fd, void *privdata,
+                                  int mask);
+
+/**
+ * @brief Queue a complete frame from a writer for its master.
+ *
+ * @param[in] writer - Writer virtual node
+ * @param[in] frame - Complete frame
+ * @param[in] len - Length of frame
+ *
+ * @return C_OK if queued, C_ERR if the queue is full or its buffer can't
+ *         be allocated within max-buffer-memory
+ */
+static int _serialQueuePush(serialNode *writer, const char *frame,
+                            size_t len);
+
+/**
+ * @brief Return the oldest frame of a writer queue without removing it.
+ *
+ * @param[in] q - Writer queue
+ * @param[out] frame - Start of frame
+ * @param[out] len - Length of frame
+ *
+ * @return 1 if a frame was returned, 0 if the queue is empty
+ */
+static int _serialQueuePeek(const serialQueue *q, const char **frame,
+                            size_t *len);
+
+/**
+ * @brief Remove the oldest frame of a writer queue.
+ *
+ * @param[in] q - Writer queue
+ */
+static void _serialQueuePop(serialQueue *q);
+
+/**
+ * @brief Drop every frame of a writer queue and release its buffer.
+ *
+ * @param[in] writer - Writer virtual node
+ */
+static void _serialQueueClear(serialNode *writer);
+
+/**
+ * @brief Register or unregister interest in a link becoming writable.
  *
+ * @param[in] link - Link
+ * @param[in] on - 1 to register, 0 to unregister
  */
-static void _serialWriteLink(serialLink *tolink, serialLink *fromlink);
+static void _serialSetWritable(serialLink *link, int on);
+
+/**
+ * @brief Pick the writer whose frame goes to the master next. A frame in
+ *        flight is always finished first, then writers are served round
+ *        robin, up to their weight in frames per turn.
+ *
+ * @param[in] master - Master serial node
+ *
+ * @return Writer node or NULL if no writer has queued frames
+ */
+static serialNode *_serialNextWriter(serialNode *master);
+
+/**
+ * @brief Write queued writer frames to a master until the queues are empty
+ *        or the master would block.
+ *
+ * @param[in] master - Master serial node
+ */
+static void _serialWriteMaster(serialNode *master);
+
+/**
+ * @brief Split bytes read from a writer into frames, queue them and kick
+ *        the master scheduler.
+ *
+ * @param[in] writer - Writer virtual node
+ * @param[in] data - Bytes read
+ * @param[in] len - Number of bytes read
+ */
+static void _serialWriterInput(serialNode *writer, const char *data,
+                               size_t len);
 
 /**
  * @brief Callback for read and writes.
@@ -61,19 +541,91 @@ static void _serialWriteLink(serialLink *tolink, serialLink *fromlink);
 static void _serialEventHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 
 /**
- * @brief Write handle callback when data is ready to be written.
+ * @brief Poll a link for events, charging the time of its callbacks to its
+ *        master.
+ *
+ * @param[in] link - Link to poll
+ * @param[in] mask - AE_READABLE and/or AE_WRITABLE
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _serialPollLink(serialLink *link, int mask);
+
+/**
+ * @brief Charge the time ae measured for a callback to a master.
  *
- * @param[in] link - Communication link with a write event
+ * @param[in] el - Pointer to event loop
+ * @param[in] data - Master serial node
+ * @param[in] us - Duration of the callback
  */
-static void _serialWriteHandler(serialLink *link);
+static void _serialAccountEvent(aeEventLoop *el, void *data, long long us);
 
 /**
- * @brief Read handle callback when data is ready to be read.
+ * @brief Read handle callback when data is ready to be read. Data read from
+ *        a master is pushed to all of its virtuals, data read from a writer
+ *        virtual is queued for its master.
  *
  * @param[in] link - Communication link with a read event
  */
 static void _serialReadHandler(serialLink *link);
 
+/**
+ * @brief Pass data read by a master to its capture, framer and fan-out.
+ *
+ * @param[in] master - Master node
+ * @param[in] data - Data
+ * @param[in] len - Length of data
+ */
+static void _serialMasterInput(serialNode *master, const char *data,
+                               size_t len);
+
+/**
+ * @brief Open the timer driving a replay master and start the replay.
+ *
+ * @param[in] link - Link of a replay master
+ *
+ * @return C_OK if successful, C_ERR otherwise
+ */
+static int _serialCreateReplayLink(serialLink *link);
+
+/**
+ * @brief Timer expiry of a replay master: hand the due records to the
+ *        normal input path and arm the timer for the next one.
+ *
+ * @param[in] link - Link of a replay master
+ */
+static void _serialReplayHandler(serialLink *link);
+
+/**
+ * @brief Queue the history of its master to a virtual or client, newest
+ *        frames first to fit in the output backlog, filtered like the
+ *        fan-out. Writing is left to the event loop.
+ *
+ * @param[in] vnode - Virtual or client node with a link
+ */
+static void _serialPrime(serialNode *vnode);
+
+/**
+ * @brief Watch the slave of a virtual for opens, to prime whoever opens it.
+ *
+ * @param[in] link - Link of a virtual
+ */
+static void _serialWatchOpen(serialLink *link);
+
+/**
+ * @brief inotify events of primed virtuals. On the first open, discard
+ *        what the slave has pending and prime it. On the last close,
+ *        discard what is left and stop writing to it until it is opened
+ *        again. Opens and closes in between (stty, udev) change nothing.
+ *
+ * @param[in] el - Pointer to event loop
+ * @param[in] fd - inotify file descriptor
+ * @param[in] privdata - Unused
+ * @param[in] mask - Event flags
+ */
+static void _serialOpenHandler(aeEventLoop *el, int fd, void *privdata,
+                               int mask);
+
 /**
  * @brief Return the event flags a serial node should have (based on current
  *        configuration).
@@ -93,11 +645,81 @@ static int _serialEventFlags(serialNode *node);
  */
 static const char *_serialEventString(serialNode *node);
 
-static serialLink *_serialCreateLink(serialNode *node)
+/**
+ * @brief Return the receive overruns (UART FIFO and tty buffer) counted by
+ *        the driver of a master.
+ *
+ * @param[in] node - Master serial node
+ *
+ * @return Overruns since the device was opened, -1 if not available
+ */
+static long long _serialOverruns(serialNode *node);
+
+static void _serialGetTuning(serialNode *node, serialTuning *tuning)
+{
+    const serialTuning *preset = &profile_tuning[node->profile];
+
+    *tuning = node->tuning;
+
+    if (tuning->vmin == -1) tuning->vmin = preset->vmin;
+    if (tuning->vtime == -1) tuning->vtime = preset->vtime;
+    if (tuning->low_latency == -1) tuning->low_latency = preset->low_latency;
+    if (tuning->latency_timer == -1) {
+        tuning->latency_timer = preset->latency_timer;
+    }
+}
+
+static void _serialApplyTuning(int fd, const char *name,
+                               const serialTuning *tuning)
+{
+    struct serial_struct ser;
+    char path[PATH_MAX];
+    char sysfs[PATH_MAX + sizeof(SERIAL_LATENCY_TIMER_FORMAT)];
+    char *dev;
+    FILE *fp;
+
+    if (tuning->low_latency != -1) {
+        if (ioctl(fd, TIOCGSERIAL, &ser) == -1) {
+            serverLogErrno(LL_DEBUG, "%s: no serial_struct, low latency flag "
+                           "not set", name);
+        } else {
+            if (tuning->low_latency) {
+                ser.flags |= ASYNC_LOW_LATENCY;
+            } else {
+                ser.flags &= ~ASYNC_LOW_LATENCY;
+            }
+
+            if (ioctl(fd, TIOCSSERIAL, &ser) == -1) {
+                serverLogErrno(LL_WARN, "%s: TIOCSSERIAL", name);
+            }
+        }
+    }
+
+    if (tuning->latency_timer == -1 || !realpath(name, path)) {
+        return;
+    }
+
+    dev = strrchr(path, '/');
+    dev = dev ? dev + 1 : path;
+    snprintf(sysfs, sizeof(sysfs), SERIAL_LATENCY_TIMER_FORMAT, dev);
+
+    /* Only USB-serial bridges have a latency timer */
+    fp = fopen(sysfs, "w");
+    if (!fp) {
+        return;
+    }
+
+    if (fprintf(fp, "%d\n", tuning->latency_timer) < 0 || fclose(fp) != 0) {
+        serverLogErrno(LL_WARN, "%s: can't set latency timer", name);
+    } else {
+        serverLog(LL_DEBUG, "%s: latency timer %d ms",
+                  name, tuning->latency_timer);
+    }
+}
+
+static serialLink *_serialCreateLink(serialNode *node, int fd, int sfd)
 {
     serialLink *link;
-    struct termios ts;
-    int custom_baud = 0;
 
     link = calloc(1, sizeof(*link));
     if (!link) {
@@ -105,42 +727,93 @@ static serialLink *_serialCreateLink(serialNode *node)
         exit(1);
     }
 
-    link->fd = -1;
-    link->sfd = -1;
-
-    if (nodeIsMaster(node)) {
-        link->fd = open(node->name, O_RDWR | O_NOCTTY);
-        if (link->fd == -1) {
-            serverLogErrno(LL_ERROR, "open");
-            goto err;
-        }
-
-        if (isatty(link->fd) == -1) {
-            serverLogErrno(LL_ERROR, "isatty");
-            goto err;
-        }
-    } else if (nodeIsVirtual(node)) {
-        if (openpty(&link->fd, &link->sfd, NULL, NULL, NULL) == -1) {
-            serverLogErrno(LL_ERROR, "openpty");
-            goto err;
-        }
-
-        remove(node->name);
+    link->fd = fd;
+    link->sfd = sfd;
+    link->open_wd = -1;
+    link->node = node;
+    _serialMemCharge(node, sizeof(*link));
 
-        if (symlink(ttyname(link->sfd), node->name) == -1) {
-            serverLogErrno(LL_ERROR, "symlink");
+    if (nodeIsReplay(node)) {
+        if (_serialCreateReplayLink(link) == C_ERR) {
             goto err;
         }
+    } else if (nodeIsVirtual(node) && node->prime) {
+        link->idle = 1;
+        _serialWatchOpen(link);
     }
 
-    if (tcgetattr(link->fd, &ts) == -1) {
+    if (_serialEventFlags(node) != AE_NONE &&
+        _serialPollLink(link, _serialEventFlags(node)) == C_ERR) {
+        serverLogErrno(LL_ERROR, "aeCreateFileEvent");
+        goto err;
+    }
+
+    node->link = link;
+    goto done;
+err:
+    if (link) {
+        _serialLinkIOError(link);
+        link = NULL;
+    }
+done:
+    return link;
+}
+
+static void _serialOpenDevice(void *arg)
+{
+    serialOpen *op = arg;
+    char slave[PATH_MAX];
+    struct termios ts;
+    int custom_baud = 0;
+    int ret;
+
+    op->ret = C_ERR;
+
+    if (op->master) {
+        op->fd = open(op->name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (op->fd == -1) {
+            serverLogErrno(LL_ERROR, "open");
+            goto err;
+        }
+
+        if (isatty(op->fd) == -1) {
+            serverLogErrno(LL_ERROR, "isatty");
+            goto err;
+        }
+    } else {
+        if (openpty(&op->fd, &op->sfd, NULL, NULL, NULL) == -1) {
+            serverLogErrno(LL_ERROR, "openpty");
+            goto err;
+        }
+
+        if (fcntl(op->fd, F_SETFL, O_NONBLOCK) == -1) {
+            serverLogErrno(LL_ERROR, "fcntl");
+            goto err;
+        }
+
+        remove(op->name);
+
+        ret = ttyname_r(op->sfd, slave, sizeof(slave));
+        if (ret != 0) {
+            errno = ret;
+            serverLogErrno(LL_ERROR, "ttyname_r");
+            goto err;
+        }
+
+        if (symlink(slave, op->name) == -1) {
+            serverLogErrno(LL_ERROR, "symlink");
+            goto err;
+        }
+    }
+
+    if (tcgetattr(op->fd, &ts) == -1) {
         serverLogErrno(LL_ERROR, "tcgetattr");
         goto err;
     }
 
-    if (nodeIsMaster(node)) {
+    if (op->master) {
         speed_t baud;
-        switch (node->baudrate) {
+        switch (op->baudrate) {
         #ifdef B0
             case 0: baud = B0; break;
         #endif
@@ -253,24 +926,9 @@ static serialLink *_serialCreateLink(serialNode *node)
             case 4000000: baud = B4000000; break;
         #endif
             default:
-            {
-                struct serial_struct ser;
-
+                /* Set exactly once the rest of termios is applied */
                 custom_baud = 1;
-
-                if (ioctl(link->fd, TIOCGSERIAL, &ser) == -1) {
-                    goto err;
-                }
-
-                ser.custom_divisor = ser.baud_base / node->baudrate;
-                ser.flags &= ~ASYNC_SPD_MASK;
-                ser.flags |= ASYNC_SPD_CUST;
-
-                if (ioctl(link->fd, TIOCSSERIAL, &ser) == -1) {
-                    serverLogErrno(LL_ERROR, "ioctl");
-                    goto err;
-                }
-            }
+                break;
         }
 
         if (!custom_baud) {
@@ -281,42 +939,117 @@ static serialLink *_serialCreateLink(serialNode *node)
 
     cfmakeraw(&ts);
 
-    if (tcsetattr(link->fd, TCSANOW, &ts) == -1) {
+    if (op->master) {
+        /* The descriptor is non-blocking, VMIN is the number of queued
+         * bytes needed before it polls readable (when VTIME is 0). Poll
+         * ignores VTIME, over 1 a trailing partial batch waits for more
+         * data, so profiles keep it at 1 */
+        if (op->tuning.vmin != -1) ts.c_cc[VMIN] = op->tuning.vmin;
+        if (op->tuning.vtime != -1) ts.c_cc[VTIME] = op->tuning.vtime;
+
+        switch (op->flow_control) {
+            case SERIAL_FLOW_NONE:
+                ts.c_cflag &= ~CRTSCTS;
+                ts.c_iflag &= ~(IXON | IXOFF | IXANY);
+                break;
+            case SERIAL_FLOW_RTSCTS:
+                ts.c_cflag |= CRTSCTS;
+                ts.c_iflag &= ~(IXON | IXOFF | IXANY);
+                break;
+            case SERIAL_FLOW_XONXOFF:
+                ts.c_cflag &= ~CRTSCTS;
+                ts.c_iflag |= IXON | IXOFF;
+                break;
+        }
+    }
+
+    if (tcsetattr(op->fd, TCSANOW, &ts) == -1) {
         serverLogErrno(LL_ERROR, "tcsetattr");
         goto err;
     }
 
-    aeCreateFileEvent(server.el,
-                      link->fd,
-                      _serialEventFlags(node),
-                      _serialEventHandler,
-                      link);
+    if (op->master && custom_baud && baudSet(op->fd, op->baudrate) == -1) {
+        serverLogErrno(LL_ERROR, "%s: can't set %d baud", op->name,
+                       op->baudrate);
+        goto err;
+    }
+
+    if (op->master) {
+        op->baud_actual = baudGet(op->fd);
+        if (op->baud_actual > 0 && op->baudrate > 0 &&
+            llabs((long long)op->baud_actual - op->baudrate) * 1000 >
+            (long long)op->baudrate * BAUD_TOLERANCE_PERMILLE) {
+            serverLog(LL_WARN, "%s: %d baud requested, the driver runs at %d",
+                      op->name, op->baudrate, op->baud_actual);
+        }
+
+        _serialApplyTuning(op->fd, op->name, &op->tuning);
+    }
+
+    op->ret = C_OK;
+    return;
 
-    node->link = link;
-    link->node = node;
-    goto done;
 err:
-    if (link) {
-        _serialLinkIOError(link);
-        link = NULL;
+    if (op->fd != -1) {
+        close(op->fd);
+        op->fd = -1;
+    }
+
+    if (op->sfd != -1) {
+        close(op->sfd);
+        op->sfd = -1;
+    }
+}
+
+static void _serialOpenDone(void *arg, int cancelled)
+{
+    serialOpen *op = arg;
+    serialNode *node = op->node;
+
+    if (cancelled) {
+        if (op->fd != -1) close(op->fd);
+        if (op->sfd != -1) close(op->sfd);
+        free(op);
+        return;
+    }
+
+    node->opening = 0;
+
+    if (op->ret == C_ERR) {
+        free(op);
+        serverLog(LL_WARN, "Problem reconnecting %s: %s",
+                  nodeIsMaster(node) ? "serial device" :
+                  "virtual serial device", node->name);
+        serverScheduleJob(CRON_RECONNECT, server.reconnect_interval);
+        return;
+    }
+
+    if (!_serialCreateLink(node, op->fd, op->sfd)) {
+        free(op);
+        return;
+    }
+    node->baud_actual = op->baud_actual;
+    free(op);
+
+    serverLog(LL_INFO, "Reconnected %s: %s (%d) [%s]",
+              nodeIsMaster(node) ? "serial" : "virtual", node->name,
+              node->link->fd, _serialEventString(node));
+
+    if (nodeIsMaster(node)) {
+        _serialReconnectMaster(node);
     }
-done:
-    return link;
 }
 
 static int _serialEventFlags(serialNode *node)
 {
-    int flags = 0;
+    int flags = AE_NONE;
 
     if (nodeIsMaster(node)) {
         flags = AE_READABLE;
-        if (serialGetVirtualWriterNode(node)) {
-            flags |= AE_WRITABLE;
-        }
     } else if (nodeIsVirtual(node)) {
-        flags = AE_WRITABLE;
-        if (nodeIsWriter(node)) {
-            flags |= AE_READABLE;
+        /* Clients are read to notice when they hang up */
+        if (nodeIsWriter(node) || nodeIsClient(node)) {
+            flags = AE_READABLE;
         }
     }
 
@@ -325,368 +1058,2424 @@ static int _serialEventFlags(serialNode *node)
 
 static const char *_serialEventString(serialNode *node)
 {
-    const char *str = NULL;
+    const char *str = "-";
     int flags = _serialEventFlags(node);
 
-    if (flags & (AE_READABLE | AE_WRITABLE)) {
+    if ((flags & AE_READABLE) && (flags & AE_WRITABLE)) {
         str = "rw";
     } else if (flags & AE_READABLE) {
         str = "r";
-    } else if (flags & AE_READABLE) {
+    } else if (flags & AE_WRITABLE) {
         str = "w";
     }
 
-    return str;
-}
+    return str;
+}
+
+static void _serialFreeLink(serialLink *link)
+{
+    serialNode *vnode;
+
+    if (link->fd != -1 && link->node) {
+        aeDeleteFileEvent(server.el, link->fd, _serialEventFlags(link->node) |
+                          (link->writable ? AE_WRITABLE : 0));
+    }
+
+    if (link->open_wd != -1) {
+        inotify_rm_watch(server.serial.prime_fd, link->open_wd);
+        link->open_wd = -1;
+    }
+
+    if (link->node) {
+        link->node->link = NULL;
+        _serialMemRelease(link->node, sizeof(*link) + link->osize);
+
+        /* Its backlog is gone with it */
+        if (link->node->spill) {
+            spillClear(link->node->spill);
+        }
+        _serialFlowRelease(link->node->virtualof);
+
+        /* A partial frame will never be completed by the next device */
+        if (link->node->framer) {
+            framerReset(link->node->framer);
+        }
+
+        /* Commands queued for this device are stale once it is gone */
+        if (nodeIsMaster(link->node)) {
+            for (vnode = link->node->virtual_head; vnode; vnode = vnode->next) {
+                _serialQueueClear(vnode);
+            }
+            link->node->wturn = NULL;
+            link->node->wcredit = 0;
+            link->node->woff = 0;
+
+            if (link->node->throttled) {
+                link->node->stats.throttled_ms += mstime() -
+                                                  link->node->throttle_ms;
+                link->node->throttled = 0;
+            }
+        }
+    }
+
+    if (link->fd != -1) {
+        close(link->fd);
+        link->fd = -1;
+    }
+
+    if (link->sfd != -1) {
+        close(link->sfd);
+        link->sfd = -1;
+    }
+
+    free(link->obuf);
+    free(link);
+    link = NULL;
+}
+
+static void _serialLinkIOError(serialLink *link)
+{
+    serialNode *node = link->node;
+
+    TRACE3(link_error, node ? node->name : NULL, link->fd, errno);
+
+    _serialFreeLink(link);
+
+    /* Clients are not reconnected, they connect again */
+    if (node && nodeIsClient(node)) {
+        serialFreeNode(node);
+        listenResume();
+        return;
+    }
+
+    serverScheduleJob(CRON_RECONNECT, server.reconnect_interval);
+}
+
+static int _serialReconnectMaster(serialNode *node)
+{
+    serialNode *vnode;
+
+    if (!node->link) {
+        if (serialConnectNode(node) == C_ERR) {
+            serverLog(LL_WARN, "Problem reconnecting serial device: %s",
+                      node->name);
+            return C_ERR;
+        }
+
+        /* Its virtuals follow once it is open */
+        if (!node->link) {
+            return C_OK;
+        }
+    }
+
+    vnode = node->virtual_head;
+
+    while (vnode) {
+        if (!vnode->link && serialConnectNode(vnode) == C_ERR) {
+            serverLog(LL_WARN, "Problem reconnecting virtual serial"
+                     " device: %s", vnode->name);
+        }
+        vnode = vnode->next;
+    }
+
+    return C_OK;
+}
+
+static int _serialReconnect(void)
+{
+    serialNode *node = server.serial.master_head;
+    serialNode *vnode;
+#ifdef HAVE_SYS_SDT_H
+    long long start = ustime();
+#endif
+    int missing = 0;
+
+    while (node) {
+        if (_serialReconnectMaster(node) == C_ERR) {
+            missing++;
+        } else {
+            for (vnode = node->virtual_head; vnode; vnode = vnode->next) {
+                if (!vnode->link) {
+                    missing++;
+                }
+            }
+        }
+        node = node->next;
+    }
+
+#ifdef HAVE_SYS_SDT_H
+    TRACE2(reconnect, missing, ustime() - start);
+#endif
+
+    return missing;
+}
+
+void serialHotplugAdd(serialNode *node)
+{
+    if (!nodeIsMaster(node) || node->link) {
+        return;
+    }
+
+    serverLog(LL_INFO, "Hotplug: %s appeared", node->name);
+
+    /* udev may still be adjusting permissions, a later IN_ATTRIB or the
+     * reconnect cron will retry */
+    _serialReconnectMaster(node);
+}
+
+void serialHotplugRemove(serialNode *node)
+{
+    if (!nodeIsMaster(node) || !node->link) {
+        return;
+    }
+
+    serverLog(LL_INFO, "Hotplug: %s removed", node->name);
+    _serialLinkIOError(node->link);
+}
+
+serialNode *serialCreateNode(const char *nodename, uint32_t flags)
+{
+    serialNode *node = NULL;
+
+    if (!nodename) {
+        serverLog(LL_ERROR, "Cannot create a serial node without a name");
+        goto done;
+    }
+
+    node = calloc(1, sizeof(*node));
+    if (!node) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+
+    strlcpy(node->name, nodename, sizeof(node->name));
+    node->flags = flags;
+    node->baudrate = 9600;
+    node->profile = SERIAL_PROFILE_NONE;
+    node->tuning.vmin = -1;
+    node->tuning.vtime = -1;
+    node->tuning.low_latency = -1;
+    node->tuning.latency_timer = -1;
+    node->subindex = -1;
+    node->weight = 1;
+    node->priority = SERIAL_PRIORITY_NORMAL;
+    node->multicast_ttl = MULTICAST_DEFAULT_TTL;
+    node->shm_size = SERIAL_DEFAULT_SHM_SIZE;
+    node->shm_listen_mode = SERIAL_DEFAULT_SHM_LISTEN_MODE;
+    node->capture_size = CAPTURE_DEFAULT_SIZE;
+    node->capture_files = CAPTURE_DEFAULT_FILES;
+    node->spill_size = SPILL_DEFAULT_SIZE;
+    node->replay_speed = 1;
+    node->silence_fd = -1;
+
+done:
+    return node;
+}
+
+void serialFreeNode(serialNode *n)
+{
+    int j;
+    serialNode *cur = n->virtual_head;
+
+    while (cur) {
+        cur->virtualof = NULL;
+        cur = cur->next;
+    }
+
+    if (nodeIsVirtual(n)) {
+        if (!nodeIsClient(n)) {
+            remove(n->name);
+        }
+
+        if (n->virtualof) {
+            serialRemoveVirtualNode(n->virtualof, n);
+        }
+    }
+
+    n->virtual_head = NULL;
+    if (n->silence_fd != -1) {
+        aeDeleteFileEvent(server.el, n->silence_fd, AE_READABLE);
+        close(n->silence_fd);
+    }
+    framerFree(n->framer);
+    _serialQueueClear(n);
+    free(n->tcp_listen);
+    free(n->unix_listen);
+    free(n->multicast);
+    multicastFree(n->mcast);
+    free(n->shm_listen);
+    shmRingFree(n->shm);
+    free(n->capture_path);
+    captureFree(n->capture);
+    free(n->spill_dir);
+    spillFree(n->spill);
+    free(n->transform);
+    while (n->chains) {
+        transformChain *chain = n->chains;
+
+        n->chains = chain->next;
+        transformFree(chain);
+    }
+    free(n->replay_path);
+    replayFree(n->replay);
+    historyFree(n->history);
+    free(n->subscribe);
+    free(n->subs);
+    free(n);
+    n = NULL;
+}
+
+int serialConnectNode(serialNode *node)
+{
+    serialOpen *op;
+
+    if (node->link || node->opening) {
+        return C_OK;
+    }
+
+    /* A timerfd does not block, replays start right away */
+    if (nodeIsReplay(node)) {
+        if (!_serialCreateLink(node, -1, -1)) {
+            return C_ERR;
+        }
+
+        serverLog(LL_INFO, "Reconnected serial: %s (%d) [%s]",
+                  node->name, node->link->fd, _serialEventString(node));
+        return C_OK;
+    }
+
+    op = calloc(1, sizeof(*op));
+    if (!op) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+
+    op->node = node;
+    strlcpy(op->name, node->name, sizeof(op->name));
+    op->master = nodeIsMaster(node);
+    op->baudrate = node->baudrate;
+    op->fd = -1;
+    op->sfd = -1;
+    if (op->master) {
+        _serialGetTuning(node, &op->tuning);
+        op->flow_control = node->flow_control;
+    }
+
+    node->opening = 1;
+    openerSubmit(_serialOpenDevice, _serialOpenDone, op);
+
+    return C_OK;
+}
+
+void serialInit(void)
+{
+    server.serial.master_head = NULL;
+    server.serial.prime_fd = -1;
+    serialLoadConfig(server.serial_configfile);
+    serialPrepareNodes();
+    serialCron();
+}
+
+void serialAddVirtualNode(serialNode *master, serialNode *virtual)
+{
+    serialNode **pos = &master->virtual_head;
+
+    /* First of its class, the fan-out serves classes in order */
+    while (*pos && (*pos)->priority < virtual->priority) {
+        pos = &(*pos)->next;
+    }
+
+    virtual->next = *pos;
+    *pos = virtual;
+    virtual->virtualof = master;
+}
+
+static void _serialSortVirtuals(serialNode *master)
+{
+    serialNode *head = NULL;
+    serialNode **pos;
+    serialNode *vnode;
+
+    /* Insertion sort, after the equal ones to keep their order */
+    while ((vnode = master->virtual_head)) {
+        master->virtual_head = vnode->next;
+
+        pos = &head;
+        while (*pos && (*pos)->priority <= vnode->priority) {
+            pos = &(*pos)->next;
+        }
+        vnode->next = *pos;
+        *pos = vnode;
+    }
+
+    master->virtual_head = head;
+}
+
+void serialRemoveVirtualNode(serialNode *master, serialNode *virtual)
+{
+    serialNode *prev = NULL;
+    serialNode *cur = master->virtual_head;
+
+    while (cur) {
+        if (virtual == cur) {
+            if (!prev) {
+                master->virtual_head = virtual->next;
+            } else {
+                prev->next = virtual->next;
+            }
+            virtual->next = NULL;
+            break;
+        }
+        prev = cur;
+        cur = cur->next;
+    }
+}
+
+static void _serialEventHandler(aeEventLoop *el, int fd, void *privdata, int mask)
+{
+    serialLink *link = (serialLink*)privdata;
+
+    (void) el;
+    (void) fd;
+
+    /* Could be closed if an error occurred while processing a read event */
+    if (!link) {
+        return;
+    }
+
+    /* ae calls back once per direction, the read event first */
+    if (mask & AE_READABLE) {
+        if (nodeIsReplay(link->node)) {
+            _serialReplayHandler(link);
+        } else {
+            _serialReadHandler(link);
+        }
+    } else if (mask & AE_WRITABLE) {
+        if (nodeIsMaster(link->node)) {
+            _serialWriteMaster(link->node);
+        } else {
+            _serialFlushLink(link);
+        }
+    }
+}
+
+static int _serialPollLink(serialLink *link, int mask)
+{
+    serialNode *master;
+
+    if (aeCreateFileEvent(server.el, link->fd, mask, _serialEventHandler,
+                          link) == AE_ERR) {
+        return C_ERR;
+    }
+
+    /* ae already times every callback, the link may be gone after one */
+    master = nodeIsMaster(link->node) ? link->node : link->node->virtualof;
+    if (master) {
+        aeSetFileEventAccount(server.el, link->fd, _serialAccountEvent,
+                              master);
+    }
+
+    return C_OK;
+}
+
+static void _serialAccountEvent(aeEventLoop *el, void *data, long long us)
+{
+    serialNode *master = data;
+
+    (void) el;
+
+    master->stats.loop_us += us;
+    master->stats.loop_callbacks++;
+}
+
+static int _serialWriteLink(serialLink *tolink, const struct iovec *iov,
+                            int iovcnt, size_t len)
+{
+    ssize_t nwrite = 0;
+    size_t skip;
+    int j;
+
+    if (!len) {
+        return C_OK;
+    }
+
+    /* Anything new goes after the backlog to keep the stream in order */
+    if (!_serialLinkPending(tolink)) {
+        nwrite = writev(tolink->fd, iov, iovcnt);
+        if (nwrite == -1 && errno == EAGAIN) {
+            nwrite = 0;
+        } else if (nwrite <= 0) {
+            _serialLinkWriteError(tolink);
+            return C_ERR;
+        } else {
+            tolink->node->stats.write_bytes += nwrite;
+            serverLog(LL_DEBUG, "Wrote %zd bytes to %s (%d)",
+                      nwrite, tolink->node->name, tolink->fd);
+        }
+    }
+
+    /* Bytes written directly, 0 when all of it is queued */
+    TRACE4(write, tolink->node->name, tolink->fd, len, nwrite);
+
+    if ((size_t)nwrite == len) {
+        return C_OK;
+    }
+
+    skip = nwrite;
+    for (j = 0; j < iovcnt; j++) {
+        if (skip >= iov[j].iov_len) {
+            skip -= iov[j].iov_len;
+            continue;
+        }
+
+        if (skip) {
+            _serialLinkAppend(tolink, (const char*)iov[j].iov_base + skip,
+                              iov[j].iov_len - skip);
+            skip = 0;
+        } else if (_serialLinkQueue(tolink, iov[j].iov_base,
+                                    iov[j].iov_len) == C_ERR) {
+            /* Nobody is draining the other end fast enough */
+            tolink->node->stats.drop_bytes += iov[j].iov_len;
+            tolink->node->stats.drop_frames++;
+            TRACE3(drop, tolink->node->name, tolink->fd, iov[j].iov_len);
+            serverLog(LL_DEBUG, "Dropped %zu bytes to %s (%d)",
+                      iov[j].iov_len, tolink->node->name, tolink->fd);
+        }
+    }
+
+    if (_serialLinkPending(tolink)) {
+        _serialSetWritable(tolink, 1);
+        _serialFlowHold(tolink);
+    }
+
+    return C_OK;
+}
+
+static void _serialLinkWriteError(serialLink *link)
+{
+    /* Clients hanging up is business as usual */
+    if (nodeIsClient(link->node) && (errno == EPIPE || errno == ECONNRESET)) {
+        serverLog(LL_INFO, "Client disconnected: %s (%d)",
+                  link->node->name, link->fd);
+    } else {
+        serverLogErrno(LL_ERROR, "I/O error writing to %s (%d) node link",
+                       link->node->name, link->fd);
+    }
+
+    _serialLinkIOError(link);
+}
+
+static void _serialLinkAppend(serialLink *link, const char *data, size_t len)
+{
+    size_t size;
+
+    if (link->opos) {
+        memmove(link->obuf, link->obuf + link->opos, link->olen - link->opos);
+        link->olen -= link->opos;
+        link->opos = 0;
+    }
+
+    if (link->olen + len > link->osize) {
+        size = _serialLinkSize(link, len);
+
+        link->obuf = realloc(link->obuf, size);
+        if (!link->obuf) {
+            serverLog(LL_ERROR, "realloc failed");
+            exit(1);
+        }
+        _serialMemCharge(link->node, size - link->osize);
+        link->osize = size;
+    }
+
+    memcpy(link->obuf + link->olen, data, len);
+    link->olen += len;
+}
+
+static int _serialLinkQueue(serialLink *link, const char *data, size_t len)
+{
+    spill *sp = link->node->spill;
+    int room = _serialLinkRoom(link, len);
+
+    /* Once spilling, everything goes to the spill to stay in order */
+    if (sp && (!room || spillPending(sp))) {
+        return spillAppend(sp, data, len);
+    } else if (!room) {
+        return C_ERR;
+    }
+
+    _serialLinkAppend(link, data, len);
+
+    return C_OK;
+}
+
+static size_t _serialLinkSize(serialLink *link, size_t len)
+{
+    size_t need = link->olen - link->opos + len;
+    size_t size = link->osize ? link->osize : SERIAL_MIN_BACKLOG;
+
+    while (size < need) {
+        size *= 2;
+    }
+
+    return size;
+}
+
+static int _serialLinkRoom(serialLink *link, size_t len)
+{
+    size_t size;
+
+    if (link->olen - link->opos + len > (size_t)server.output_backlog) {
+        return 0;
+    }
+
+    size = _serialLinkSize(link, len);
+
+    return size <= link->osize ||
+           _serialMemAllowed(link->node, size - link->osize);
+}
+
+static int _serialMemAllowed(serialNode *node, size_t bytes)
+{
+    long long limit;
+
+    if (!server.max_buffer_memory) {
+        return 1;
+    }
+
+    limit = server.max_buffer_memory / 100 * priority_share[node->priority];
+    if ((long long)(server.serial.memory_fixed + server.serial.memory +
+                    bytes) <= limit) {
+        return 1;
+    }
+
+    node->stats.memory_refusals++;
+    server.serial.memory_refusals++;
+
+    return 0;
+}
+
+static void _serialMemCharge(serialNode *node, size_t bytes)
+{
+    node->memory += bytes;
+    server.serial.memory += bytes;
+
+    if (server.serial.memory + server.serial.memory_fixed >
+        server.serial.memory_peak) {
+        server.serial.memory_peak = server.serial.memory +
+                                    server.serial.memory_fixed;
+    }
+}
+
+static void _serialMemRelease(serialNode *node, size_t bytes)
+{
+    node->memory -= bytes;
+    server.serial.memory -= bytes;
+}
+
+static size_t _serialFixedMemory(serialNode *node)
+{
+    size_t bytes = 0;
+
+    if (node->history) bytes += node->history->size;
+    if (node->shm) bytes += node->shm->size;
+    if (node->framer) bytes += FRAMING_BUF_SIZE;
+
+    return bytes;
+}
+
+static size_t _serialLinkPending(serialLink *link)
+{
+    size_t pending = link->olen - link->opos;
+
+    if (link->node->spill) {
+        pending += spillPending(link->node->spill);
+    }
+
+    return pending;
+}
+
+static void _serialFlushLink(serialLink *link)
+{
+    spill *sp = link->node->spill;
+    ssize_t nwrite;
+
+    while (link->opos < link->olen) {
+        nwrite = write(link->fd, link->obuf + link->opos,
+                       link->olen - link->opos);
+        if (nwrite == -1 && errno == EAGAIN) {
+            _serialFlowRelease(link->node->virtualof);
+            return;
+        } else if (nwrite <= 0) {
+            _serialLinkWriteError(link);
+            return;
+        }
+
+        link->node->stats.write_bytes += nwrite;
+        link->opos += nwrite;
+        TRACE4(flush, link->node->name, link->fd, nwrite,
+               _serialLinkPending(link));
+    }
+
+    link->opos = 0;
+    link->olen = 0;
+
+    /* A burst is over, give back what it took */
+    if (link->osize > BUFSIZ) {
+        _serialMemRelease(link->node, link->osize);
+        free(link->obuf);
+        link->obuf = NULL;
+        link->osize = 0;
+    }
+
+    /* The spill only holds what came after the backlog */
+    while (sp && spillPending(sp)) {
+        nwrite = spillDrain(sp, link->fd);
+        if (nwrite == -1 && errno == EAGAIN) {
+            _serialFlowRelease(link->node->virtualof);
+            return;
+        } else if (nwrite <= 0) {
+            _serialLinkWriteError(link);
+            return;
+        }
+
+        link->node->stats.write_bytes += nwrite;
+        TRACE4(flush, link->node->name, link->fd, nwrite, spillPending(sp));
+    }
+
+    _serialSetWritable(link, 0);
+    _serialFlowRelease(link->node->virtualof);
+}
+
+static void _serialFlowHold(serialLink *link)
+{
+    serialNode *master = link->node->virtualof;
+
+    /* Clients come and go, and an idle virtual has nobody to wait for */
+    if (!master || master->flow_policy != SERIAL_FLOW_POLICY_THROTTLE ||
+        master->throttled || nodeIsClient(link->node) || link->idle ||
+        link->olen - link->opos < master->flow_high) {
+        return;
+    }
+
+    _serialThrottle(master, 1);
+}
+
+static void _serialFlowRelease(serialNode *master)
+{
+    serialNode *vnode;
+    serialLink *link;
+
+    if (!master || !master->throttled) {
+        return;
+    }
+
+    for (vnode = master->virtual_head; vnode; vnode = vnode->next) {
+        link = vnode->link;
+        if (!link || link->idle || nodeIsClient(vnode)) {
+            continue;
+        }
+
+        if (link->olen - link->opos > master->flow_low) {
+            return;
+        }
+    }
+
+    _serialThrottle(master, 0);
+}
+
+static void _serialThrottle(serialNode *master, int on)
+{
+    serialLink *link = master->link;
+
+    if (!link || master->throttled == on) {
+        return;
+    }
+
+    if (on) {
+        aeDeleteFileEvent(server.el, link->fd, AE_READABLE);
+        master->throttle_ms = mstime();
+        master->stats.throttles++;
+    } else {
+        if (_serialPollLink(link, AE_READABLE) == C_ERR) {
+            serverLogErrno(LL_ERROR, "Can't poll %s (%d) for reads",
+                           master->name, link->fd);
+            return;
+        }
+        master->stats.throttled_ms += mstime() - master->throttle_ms;
+    }
+
+    if (master->flow_control == SERIAL_FLOW_XONXOFF &&
+        tcflow(link->fd, on ? TCIOFF : TCION) == -1) {
+        serverLogErrno(LL_WARN, "%s: can't send %s", master->name,
+                       on ? "XOFF" : "XON");
+    }
+
+    master->throttled = on;
+
+    serverLog(LL_DEBUG, "%s reading %s (%d)", on ? "Stopped" : "Resumed",
+              master->name, link->fd);
+}
+
+static void _serialDeferLink(serialLink *link, const struct iovec *iov,
+                             int iovcnt)
+{
+    serialStats *st = &link->node->stats;
+    int j;
+
+    for (j = 0; j < iovcnt; j++) {
+        if (_serialLinkQueue(link, iov[j].iov_base,
+                             iov[j].iov_len) == C_ERR) {
+            st->shed_bytes += iov[j].iov_len;
+            st->drop_frames++;
+            continue;
+        }
+
+        st->deferred_bytes += iov[j].iov_len;
+    }
+
+    if (_serialLinkPending(link)) {
+        _serialSetWritable(link, 1);
+        _serialFlowHold(link);
+    }
+}
+
+static void _serialFanout(serialNode *master, const struct iovec *iov,
+                          const serialFrameInfo *info, int iovcnt, size_t len)
+{
+    struct iovec subiov[SERIAL_MAX_IOV];
+    int subidx[SERIAL_MAX_IOV];
+    unsigned char flags[SERIAL_MAX_IOV];
+    serialNode *vnode = master->virtual_head;
+    serialNode *next;
+    transformChain *chain;
+    const struct iovec *src;
+    const int *srcidx;
+    uint64_t bit;
+    size_t sublen;
+    long long elapsed;
+    int priority = SERIAL_PRIORITY_CRITICAL;
+    int defer = 0;
+    int subcnt;
+    int srccnt;
+    int k;
+    int j;
+
+    if (master->history) {
+        long long now = mstime();
+
+        for (j = 0; j < iovcnt; j++) {
+            historyAppend(master->history, iov[j].iov_base, iov[j].iov_len,
+                          info ? info[j].subscribers : 0,
+                          info ? info[j].corrupt : 0, now);
+        }
+    }
+
+    /* Consumers that do not cost a write each, both use 1 for corrupt */
+    if (master->mcast || master->shm) {
+        for (j = 0; info && j < iovcnt; j++) {
+            flags[j] = info[j].corrupt ? MULTICAST_FLAG_CORRUPT : 0;
+        }
+        if (master->mcast) {
+            multicastSend(master->mcast, iov, info ? flags : NULL, iovcnt);
+        }
+        if (master->shm) {
+            shmRingWrite(master->shm, iov, info ? flags : NULL, iovcnt);
+        }
+    }
+
+    /* Chains are run by the first virtual needing them */
+    for (chain = master->chains; chain; chain = chain->next) {
+        chain->ready = 0;
+    }
+
+    for (; vnode; vnode = next) {
+        /* A client failing the write below is freed */
+        next = vnode->next;
+
+        /* Virtuals are sorted by class, check the budget when entering
+         * one. Past it, lower classes only queue, written after the more
+         * urgent consumers of this and other masters */
+        if (vnode->priority != priority) {
+            priority = vnode->priority;
+            if (server.fanout_budget && !defer) {
+                elapsed = ustime() - server.serial.work_us;
+                if (elapsed > 2LL*server.fanout_budget ||
+                    (priority == SERIAL_PRIORITY_BULK &&
+                     elapsed > server.fanout_budget)) {
+                    defer = 1;
+                    master->stats.overloads++;
+                }
+            }
+        }
+
+        if (!vnode->link || vnode->link->idle) {
+            continue;
+        }
+
+        if (!info && vnode->output == SERIAL_OUTPUT_RAW && !vnode->chain) {
+            if (defer) {
+                _serialDeferLink(vnode->link, iov, iovcnt);
+            } else {
+                _serialWriteLink(vnode->link, iov, iovcnt, len);
+            }
+            continue;
+        }
+
+        src = iov;
+        srcidx = NULL;
+        srccnt = iovcnt;
+        if (vnode->chain) {
+            if (!vnode->chain->ready) {
+                transformApply(vnode->chain, iov, iovcnt);
+                vnode->chain->ready = 1;
+            }
+            /* Packets keep the info and sequence of the buffer they come
+             * from, a buffer may hold none or several */
+            src = vnode->chain->iov;
+            srcidx = vnode->chain->src;
+            srccnt = vnode->chain->iovcnt;
+        }
+
+        bit = vnode->subindex != -1 ? 1ULL << vnode->subindex : 0;
+        subcnt = 0;
+        sublen = 0;
+
+        for (k = 0; k < srccnt; k++) {
+            j = srcidx ? srcidx[k] : k;
+
+            if (info && bit && !(info[j].subscribers & bit)) {
+                vnode->stats.filter_bytes += src[k].iov_len;
+                continue;
+            }
+
+            /* Swallowed by the chain, ie. a packet still being decoded */
+            if (!src[k].iov_len) {
+                continue;
+            }
+
+            if (info && info[j].corrupt &&
+                vnode->validate != SERIAL_VALIDATE_PASS) {
+                vnode->stats.corrupt_frames++;
+                if (vnode->validate == SERIAL_VALIDATE_DROP) {
+                    continue;
+                }
+            }
+
+            subidx[subcnt] = j;
+            subiov[subcnt++] = src[k];
+            sublen += src[k].iov_len;
+
+            /* A chain may decode more packets than fit, send them in
+             * batches. Framed records are queued or copied on the way */
+            if (subcnt < SERIAL_MAX_IOV) {
+                continue;
+            }
+
+            if (vnode->output == SERIAL_OUTPUT_FRAMED) {
+                sublen = _serialFrameRecords(master, vnode, info, subiov,
+                                             subidx, subcnt, sublen);
+            }
+
+            if (defer) {
+                _serialDeferLink(vnode->link, subiov, subcnt);
+            } else if (_serialWriteLink(vnode->link, subiov, subcnt,
+                                        sublen) == C_ERR) {
+                /* Freed along with a client */
+                subcnt = 0;
+                break;
+            }
+
+            subcnt = 0;
+            sublen = 0;
+        }
+
+        if (subcnt && vnode->output == SERIAL_OUTPUT_FRAMED) {
+            sublen = _serialFrameRecords(master, vnode, info, subiov, subidx,
+                                         subcnt, sublen);
+        }
+
+        if (subcnt && defer) {
+            _serialDeferLink(vnode->link, subiov, subcnt);
+        } else if (subcnt) {
+            _serialWriteLink(vnode->link, subiov, subcnt, sublen);
+        }
+    }
+
+    master->seq += iovcnt;
+
+    /* Started at the read, both on the CLOCK_MONOTONIC of bpftrace nsecs */
+    TRACE5(fanout, master->name, iovcnt, len, server.serial.input_us, defer);
+}
+
+static void _serialFramedHeader(unsigned char *p, int flags, uint32_t len,
+                                uint32_t seq, uint32_t drops, long long us)
+{
+    uint64_t time = us;
+    int j;
+
+    p[0] = SERIAL_FRAMED_MAGIC0;
+    p[1] = SERIAL_FRAMED_MAGIC1;
+    p[2] = SERIAL_FRAMED_VERSION;
+    p[3] = flags;
+
+    for (j = 0; j < 4; j++) {
+        p[4 + j] = len >> (24 - 8*j);
+        p[8 + j] = seq >> (24 - 8*j);
+        p[12 + j] = drops >> (24 - 8*j);
+    }
+
+    for (j = 0; j < 8; j++) {
+        p[16 + j] = time >> (56 - 8*j);
+    }
+}
+
+static size_t _serialFrameRecords(serialNode *master, serialNode *vnode,
+                                  const serialFrameInfo *info,
+                                  struct iovec *iov, const int *idx,
+                                  int iovcnt, size_t len)
+{
+    size_t need = len + (size_t)iovcnt * SERIAL_FRAMED_HEADER_SIZE;
+    unsigned char *p;
+    int flags;
+    int j;
+
+    /* Shared by every framed virtual, they are written one after the other
+     * and whatever is queued is copied */
+    if (need > server.serial.framed_size) {
+        p = realloc(server.serial.framed, need);
+        if (!p) {
+            serverLog(LL_ERROR, "realloc failed");
+            exit(1);
+        }
+        server.serial.framed = p;
+        server.serial.framed_size = need;
+    }
+
+    p = server.serial.framed;
+
+    for (j = 0; j < iovcnt; j++) {
+        flags = info && info[idx[j]].corrupt &&
+                vnode->validate == SERIAL_VALIDATE_TAG ?
+                SERIAL_FRAMED_FLAG_CORRUPT : 0;
+
+        _serialFramedHeader(p, flags, iov[j].iov_len, master->seq + idx[j],
+                            vnode->stats.drop_frames, server.serial.input_us);
+        memcpy(p + SERIAL_FRAMED_HEADER_SIZE, iov[j].iov_base,
+               iov[j].iov_len);
+
+        iov[j].iov_base = p;
+        iov[j].iov_len += SERIAL_FRAMED_HEADER_SIZE;
+        p += iov[j].iov_len;
+    }
+
+    return need;
+}
+
+static uint64_t _serialSubscribers(serialNode *master, const char *frame,
+                                   size_t len)
+{
+    char type[FRAMING_MAX_TYPE];
+    uint64_t mask = 0;
+    int typelen;
+    int j;
+
+    typelen = framingClassify(frame, len, type);
+    if (!typelen) {
+        return 0;
+    }
+
+    for (j = 0; j < master->nsubs; j++) {
+        const char *subtype = master->subs[j].type;
+
+        /* GGA matches any talker (GPGGA, GNGGA...), proprietary sentences
+         * (P...) have no talker */
+        if (!strcmp(subtype, type) ||
+            (typelen == 5 && type[0] != 'P' && !strcmp(subtype, type + 2))) {
+            mask |= master->subs[j].mask;
+        }
+    }
+
+    return mask;
+}
+
+static void _serialFrameInput(serialNode *master, const char *data, size_t len)
+{
+    serialFrameInfo info[SERIAL_MAX_IOV];
+    serialFrameInfo *pinfo = NULL;
+    framer *f = master->framer;
+    long long silence = 0;
+    long long now = server.serial.input_us;
+    size_t nread = len;
+    size_t n;
+
+    if (master->subscribers || master->checksum != CHECKSUM_NONE) {
+        pinfo = info;
+    }
+
+    if (f->type == FRAMING_SILENCE) {
+        silence = _serialSilenceUs(master);
+
+        /* Replays keep the recorded timing, late records included */
+        if (nodeIsReplay(master)) {
+            now = master->replay->record_us;
+        }
+
+        /* Bytes read as they come in arrived a character time apart, the
+         * line was silent before the first one started if the gap is long
+         * enough. The timer ends a frame unless these bytes were waiting */
+        if (f->len > f->pos &&
+            now - (long long)len * silence / f->silence -
+            master->silence_last_us >= silence) {
+            framerEnd(f);
+            _serialSilenceOutput(master, pinfo);
+        }
+
+        if (f->len == f->pos) {
+            master->silence_first_us = server.serial.input_us;
+        }
+    }
+
+    while (len) {
+        n = framerFeed(f, data, len);
+        data += n;
+        len -= n;
+
+        /* Frames stay valid until the next feed, deliver them now */
+        if (f->type == FRAMING_SILENCE) {
+            /* Only a full buffer is flushed, the rest is a new frame */
+            _serialSilenceOutput(master, pinfo);
+            if (f->len == f->pos) {
+                master->silence_first_us = server.serial.input_us;
+            }
+        } else {
+            _serialFrameOutput(master, pinfo);
+        }
+    }
+
+    if (f->type == FRAMING_SILENCE && master->silence_fd != -1) {
+        struct itimerspec its = {{0, 0}, {0, 0}};
+        long long due;
+
+        /* Bytes handed over several at a time may be on their way, the
+         * next batch is waited for as long as this one took */
+        master->silence_last_us = now;
+        due = now + silence + (long long)(nread - 1) * silence / f->silence;
+        its.it_value.tv_sec = due / 1000000;
+        its.it_value.tv_nsec = (due % 1000000) * 1000;
+        if (timerfd_settime(master->silence_fd, TFD_TIMER_ABSTIME, &its,
+                            NULL) == -1) {
+            serverLogErrno(LL_ERROR, "timerfd_settime");
+        }
+    }
+}
+
+static void _serialFrameOutput(serialNode *master, serialFrameInfo *info)
+{
+    struct iovec iov[SERIAL_MAX_IOV];
+    const char *frame;
+    size_t framelen;
+    size_t total = 0;
+    int iovcnt = 0;
+
+    while (framerNext(master->framer, &frame, &framelen)) {
+        if (iovcnt == SERIAL_MAX_IOV) {
+            _serialFanout(master, iov, info, iovcnt, total);
+            iovcnt = 0;
+            total = 0;
+        }
+        iov[iovcnt].iov_base = (void*)frame;
+        iov[iovcnt].iov_len = framelen;
+        if (info) {
+            /* Classified and validated once here, whatever the number
+             * of virtuals */
+            info[iovcnt].subscribers = master->subscribers ?
+                _serialSubscribers(master, frame, framelen) : 0;
+            info[iovcnt].corrupt = !checksumValidate(master->checksum,
+                                                     frame, framelen);
+            if (info[iovcnt].corrupt) {
+                master->stats.corrupt_frames++;
+            }
+        }
+        iovcnt++;
+        total += framelen;
+    }
+
+    if (iovcnt) {
+        _serialFanout(master, iov, info, iovcnt, total);
+    }
+}
+
+static void _serialSilenceOutput(serialNode *master, serialFrameInfo *info)
+{
+    long long input_us = server.serial.input_us;
+
+    server.serial.input_us = master->silence_first_us;
+    _serialFrameOutput(master, info);
+    server.serial.input_us = input_us;
+}
+
+static long long _serialSilenceUs(serialNode *master)
+{
+    int baud = master->link && master->baud_actual > 0 ?
+               master->baud_actual : master->baudrate;
+    long long us;
+
+    if (baud <= 0) {
+        baud = 9600;
+    }
+
+    us = master->framer->silence * FRAMING_CHAR_BITS * 1000000 / baud;
+
+    return us > 0 ? us : 1;
+}
+
+static void _serialSilenceHandler(aeEventLoop *el, int fd, void *privdata,
+                                  int mask)
+{
+    serialNode *master = privdata;
+    serialFrameInfo info[SERIAL_MAX_IOV];
+    uint64_t expirations;
+    long long due;
+    int waiting = 0;
+
+    (void) el;
+    (void) mask;
+
+    /* Not expired, a read re-armed it after the poll */
+    if (read(fd, &expirations, sizeof(expirations)) == -1) {
+        if (errno != EAGAIN) {
+            serverLogErrno(LL_WARN, "I/O error reading from %s silence "
+                           "timer", master->name);
+        }
+        return;
+    }
+
+    /* Bytes not read yet may have come in before the silence was over, the
+     * read decides */
+    if (nodeIsReplay(master)) {
+        due = master->replay ? replayDue(master->replay) : -1;
+        if (due != -1 && due < master->silence_last_us +
+                               _serialSilenceUs(master)) {
+            return;
+        }
+    } else if (master->link &&
+               ioctl(master->link->fd, FIONREAD, &waiting) == 0 &&
+               waiting > 0) {
+        return;
+    }
+
+    if (master->framer->len == master->framer->pos) {
+        return;
+    }
+
+    server.serial.work_us = ustime();
+    framerEnd(master->framer);
+    _serialSilenceOutput(master,
+                         master->subscribers ||
+                         master->checksum != CHECKSUM_NONE ? info : NULL);
+}
+
+static int _serialQueuePush(serialNode *writer, const char *frame,
+                            size_t len)
+{
+    serialQueue *q = &writer->wqueue;
+    uint32_t framelen = len;
+
+    if (!q->buf) {
+        if (!_serialMemAllowed(writer, SERIAL_WRITE_QUEUE_SIZE)) {
+            return C_ERR;
+        }
+
+        q->buf = malloc(SERIAL_WRITE_QUEUE_SIZE);
+        if (!q->buf) {
+            serverLog(LL_ERROR, "malloc failed");
+            exit(1);
+        }
+        _serialMemCharge(writer, SERIAL_WRITE_QUEUE_SIZE);
+    }
+
+    if (q->pos && q->len + sizeof(framelen) + len > SERIAL_WRITE_QUEUE_SIZE) {
+        memmove(q->buf, q->buf + q->pos, q->len - q->pos);
+        q->len -= q->pos;
+        q->pos = 0;
+    }
+
+    if (q->len + sizeof(framelen) + len > SERIAL_WRITE_QUEUE_SIZE) {
+        return C_ERR;
+    }
+
+    memcpy(q->buf + q->len, &framelen, sizeof(framelen));
+    memcpy(q->buf + q->len + sizeof(framelen), frame, len);
+    q->len += sizeof(framelen) + len;
+
+    return C_OK;
+}
+
+static int _serialQueuePeek(const serialQueue *q, const char **frame,
+                            size_t *len)
+{
+    uint32_t framelen;
+
+    if (q->pos == q->len) {
+        return 0;
+    }
+
+    memcpy(&framelen, q->buf + q->pos, sizeof(framelen));
+    *frame = q->buf + q->pos + sizeof(framelen);
+    *len = framelen;
+
+    return 1;
+}
+
+static void _serialQueuePop(serialQueue *q)
+{
+    uint32_t framelen;
+
+    memcpy(&framelen, q->buf + q->pos, sizeof(framelen));
+    q->pos += sizeof(framelen) + framelen;
+
+    if (q->pos == q->len) {
+        q->pos = 0;
+        q->len = 0;
+    }
+}
+
+static void _serialQueueClear(serialNode *writer)
+{
+    serialQueue *q = &writer->wqueue;
+
+    if (q->buf) {
+        _serialMemRelease(writer, SERIAL_WRITE_QUEUE_SIZE);
+    }
+
+    free(q->buf);
+    q->buf = NULL;
+    q->len = 0;
+    q->pos = 0;
+}
+
+static void _serialSetWritable(serialLink *link, int on)
+{
+    if (link->writable == on) {
+        return;
+    }
+
+    if (on) {
+        if (_serialPollLink(link, AE_WRITABLE) == C_ERR) {
+            serverLogErrno(LL_ERROR, "Can't poll %s (%d) for writes",
+                           link->node->name, link->fd);
+            return;
+        }
+    } else {
+        aeDeleteFileEvent(server.el, link->fd, AE_WRITABLE);
+    }
+
+    link->writable = on;
+}
+
+static serialNode *_serialNextWriter(serialNode *master)
+{
+    serialNode *cur = master->wturn;
+    serialNode *stop = master->wturn;
+
+    if (cur && (master->woff || (master->wcredit > 0 &&
+                                 cur->wqueue.pos < cur->wqueue.len))) {
+        return cur;
+    }
+
+    for (;;) {
+        cur = cur && cur->next ? cur->next : master->virtual_head;
+        if (!cur) {
+            return NULL;
+        }
+
+        if (nodeIsWriter(cur) && cur->wqueue.pos < cur->wqueue.len) {
+            master->wturn = cur;
+            master->wcredit = cur->weight;
+            return cur;
+        }
+
+        if (!stop) {
+            stop = cur;
+        } else if (cur == stop) {
+            return NULL;
+        }
+    }
+}
+
+static void _serialWriteMaster(serialNode *master)
+{
+    serialLink *link = master->link;
+    serialNode *writer;
+    const char *frame;
+    size_t framelen;
+    ssize_t nwrite;
+
+    while (link) {
+        writer = _serialNextWriter(master);
+        if (!writer) {
+            _serialSetWritable(link, 0);
+            return;
+        }
+
+        /* The scheduler only picks writers with a frame queued */
+        if (!_serialQueuePeek(&writer->wqueue, &frame, &framelen)) {
+            _serialSetWritable(link, 0);
+            return;
+        }
+
+        nwrite = write(link->fd, frame + master->woff, framelen - master->woff);
+        if (nwrite == -1 && errno == EAGAIN) {
+            _serialSetWritable(link, 1);
+            return;
+        } else if (nwrite <= 0) {
+            serverLogErrno(LL_ERROR, "I/O error writing to %s (%d) node link",
+                           master->name, link->fd);
+            _serialLinkIOError(link);
+            return;
+        }
+
+        serverLog(LL_DEBUG, "Wrote %zd bytes from %s to %s (%d)",
+                  nwrite, writer->name, master->name, link->fd);
+        master->stats.write_bytes += nwrite;
+        if (master->capture) {
+            struct iovec iov = { (void*)(frame + master->woff), nwrite };
+
+            captureWrite(master->capture, CAPTURE_TX, &iov, 1);
+        }
+        master->woff += nwrite;
+
+        /* The rest of the frame goes out before any other writer's */
+        if (master->woff < framelen) {
+            _serialSetWritable(link, 1);
+            return;
+        }
+
+        master->woff = 0;
+        master->wcredit--;
+        _serialQueuePop(&writer->wqueue);
+    }
+}
+
+static void _serialWriterInput(serialNode *writer, const char *data,
+                               size_t len)
+{
+    serialNode *master = writer->virtualof;
+    const char *frame;
+    size_t framelen;
+    size_t n;
+
+    /* A replayed master has no device to write to */
+    if (!master || !master->link || nodeIsReplay(master)) {
+        writer->stats.drop_bytes += len;
+        return;
+    }
+
+    if (!writer->framer) {
+        /* Raw masters: each read is written as a whole */
+        if (_serialQueuePush(writer, data, len) == C_ERR) {
+            writer->stats.drop_bytes += len;
+        }
+    } else {
+        while (len) {
+            n = framerFeed(writer->framer, data, len);
+            data += n;
+            len -= n;
+
+            while (framerNext(writer->framer, &frame, &framelen)) {
+                if (_serialQueuePush(writer, frame, framelen) == C_ERR) {
+                    writer->stats.drop_bytes += framelen;
+                }
+            }
+        }
+    }
+
+    if (!master->link->writable) {
+        _serialWriteMaster(master);
+    }
+}
+
+static void _serialReadHandler(serialLink *link)
+{
+    serialNode *node = link->node;
+    long long start = ustime();
+    long long latency;
+    int nread;
+
+    nread = read(link->fd, link->recvbuf, sizeof(link->recvbuf));
+    if (nread <= 0) {
+        if (nread == 0 && nodeIsClient(node)) {
+            serverLog(LL_INFO, "Client disconnected: %s (%d)",
+                      node->name, link->fd);
+            _serialLinkIOError(link);
+            link = NULL;
+        } else if (nread == 0 || errno != EAGAIN) {
+            serverLogErrno(LL_ERROR, "I/O error reading from %s (%d) node link",
+                           link->node->name, link->fd);
+            _serialLinkIOError(link);
+            link = NULL;
+        }
+        return;
+    }
+
+    serverLog(LL_DEBUG, "Read %d bytes from %s (%d)",
+              nread, link->node->name, link->fd);
+    link->recvbuflen = nread;
+
+    node->stats.reads++;
+    node->stats.read_bytes += nread;
+    if (nread > node->stats.read_max) {
+        node->stats.read_max = nread;
+    }
+    server.serial.input_us = start;
+    server.serial.work_us = start;
+
+    if (nodeIsMaster(node)) {
+        _serialMasterInput(node, link->recvbuf, nread);
+    } else if (nodeIsWriter(node)) {
+        _serialWriterInput(node, link->recvbuf, nread);
+    }
+
+    link->recvbuflen = 0;
+
+    latency = ustime() - start;
+    node->stats.latency_us += latency;
+    if (latency > node->stats.latency_max_us) {
+        node->stats.latency_max_us = latency;
+    }
+
+    TRACE4(read, node->name, link->fd, nread, latency);
+}
+
+static void _serialMasterInput(serialNode *master, const char *data,
+                               size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)data;
+    iov.iov_len = len;
+
+    if (master->capture) {
+        captureWrite(master->capture, CAPTURE_RX, &iov, 1);
+    }
+
+    if (master->framer) {
+        _serialFrameInput(master, data, len);
+    } else {
+        _serialFanout(master, &iov, NULL, 1, len);
+    }
+}
+
+static int _serialCreateReplayLink(serialLink *link)
+{
+    struct itimerspec its = {{0, 0}, {0, 1}};
+
+    link->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (link->fd == -1) {
+        serverLogErrno(LL_ERROR, "timerfd_create");
+        return C_ERR;
+    }
+
+    /* Timed from the first expiry, once the virtuals are up */
+    replayStart(link->node->replay, -1);
+
+    if (timerfd_settime(link->fd, 0, &its, NULL) == -1) {
+        serverLogErrno(LL_ERROR, "timerfd_settime");
+        return C_ERR;
+    }
+
+    return C_OK;
+}
+
+static void _serialReplayHandler(serialLink *link)
+{
+    serialNode *node = link->node;
+    replay *r = node->replay;
+    struct itimerspec its = {{0, 0}, {0, 0}};
+    uint64_t expirations;
+    long long start = ustime();
+    long long latency;
+    long long due;
+    size_t budget = REPLAY_BATCH_BYTES;
+    const char *data;
+    size_t len;
+    int ret;
+
+    if (read(link->fd, &expirations, sizeof(expirations)) == -1 &&
+        errno != EAGAIN) {
+        serverLogErrno(LL_ERROR, "I/O error reading from %s (%d) replay timer",
+                       node->name, link->fd);
+        _serialLinkIOError(link);
+        return;
+    }
+
+    /* Unpaced replays yield to other events after a batch */
+    while ((ret = replayNext(r, ustime(), &data, &len)) == 1) {
+        server.serial.input_us = start;
+        server.serial.work_us = start;
+        node->stats.reads++;
+        node->stats.read_bytes += len;
+        if ((int)len > node->stats.read_max) {
+            node->stats.read_max = len;
+        }
+
+        _serialMasterInput(node, data, len);
+
+        if (!node->link) {
+            return;
+        }
+        if (node->throttled) {
+            break;
+        }
+        if (len >= budget) {
+            break;
+        }
+        budget -= len;
+    }
+
+    if (ret == -1) {
+        serverLog(LL_INFO, "Replay of %s finished: %llu records, %llu bytes, "
+                  "lag avg %lld us max %lld us, %llu late",
+                  node->name, r->records, r->bytes,
+                  r->records ? r->lag_us / (long long)r->records : 0,
+                  r->lag_max_us, r->late_records);
+    } else {
+        due = ret == 1 ? ustime() : replayDue(r);
+        its.it_value.tv_sec = due / 1000000;
+        its.it_value.tv_nsec = (due % 1000000) * 1000;
+        if (timerfd_settime(link->fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+            serverLogErrno(LL_ERROR, "timerfd_settime");
+        }
+    }
+
+    latency = ustime() - start;
+    node->stats.latency_us += latency;
+    if (latency > node->stats.latency_max_us) {
+        node->stats.latency_max_us = latency;
+    }
+}
+
+static void _serialPrime(serialNode *vnode)
+{
+    serialNode *master = vnode->virtualof;
+    serialLink *link = vnode->link;
+    const historyRecord *rec;
+    const void *data;
+    transformChain *chain = NULL;
+    struct iovec in;
+    const struct iovec *out;
+    uint64_t bit = vnode->subindex != -1 ? 1ULL << vnode->subindex : 0;
+    uint64_t first;
+    uint64_t pos;
+    unsigned char header[SERIAL_FRAMED_HEADER_SIZE];
+    size_t hlen = vnode->output == SERIAL_OUTPUT_FRAMED ? sizeof(header) : 0;
+    size_t total = 0;
+    size_t queued = 0;
+    int flags;
+    int pass;
+    int outcnt;
+    int k;
+
+    if (!master || !master->history || !link) {
+        return;
+    }
+
+    first = historyFirst(master->history, mstime());
+
+    /* Count first, what does not fit in the backlog is the oldest part */
+    for (pass = 0; pass < 2; pass++) {
+        /* The shared chain is in the middle of the live stream, each pass
+         * transforms the history from the start */
+        if (vnode->chain) {
+            transformFree(chain);
+            chain = transformCreate(vnode->chain->spec);
+        }
+
+        pos = first;
+        while ((rec = historyNext(master->history, &pos, &data))) {
+            if ((bit && !(rec->subscribers & bit)) ||
+                (rec->corrupt && vnode->validate == SERIAL_VALIDATE_DROP)) {
+                continue;
+            }
+
+            in.iov_base = (void*)data;
+            in.iov_len = rec->len;
+            out = &in;
+            outcnt = 1;
+            if (chain) {
+                out = transformApply(chain, &in, 1);
+                outcnt = chain->iovcnt;
+            }
+
+            for (k = 0; k < outcnt; k++) {
+                if (!out[k].iov_len) {
+                    continue;
+                }
+
+                if (pass == 0) {
+                    total += hlen + out[k].iov_len;
+                } else if (total > (size_t)server.output_backlog) {
+                    total -= hlen + out[k].iov_len;
+                } else if (_serialLinkRoom(link, hlen + out[k].iov_len)) {
+                    if (hlen) {
+                        flags = SERIAL_FRAMED_FLAG_HISTORY;
+                        if (rec->corrupt &&
+                            vnode->validate == SERIAL_VALIDATE_TAG) {
+                            flags |= SERIAL_FRAMED_FLAG_CORRUPT;
+                        }
+                        _serialFramedHeader(header, flags, out[k].iov_len, 0,
+                                            vnode->stats.drop_frames,
+                                            rec->ms * 1000);
+                        _serialLinkAppend(link, (const char*)header, hlen);
+                    }
+                    _serialLinkAppend(link, out[k].iov_base, out[k].iov_len);
+                    queued += hlen + out[k].iov_len;
+                }
+            }
+        }
+    }
+
+    transformFree(chain);
+
+    vnode->stats.primes++;
+    vnode->stats.prime_bytes += queued;
+
+    serverLog(LL_DEBUG, "Primed %s (%d) with %zu bytes", vnode->name,
+              link->fd, queued);
+
+    if (link->olen > link->opos) {
+        _serialSetWritable(link, 1);
+    }
+}
+
+static void _serialWatchOpen(serialLink *link)
+{
+    int fd = server.serial.prime_fd;
+
+    if (fd == -1) {
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd == -1) {
+            serverLogErrno(LL_WARN, "inotify_init1, priming disabled");
+            return;
+        }
+
+        if (aeCreateFileEvent(server.el, fd, AE_READABLE,
+                              _serialOpenHandler, NULL) == AE_ERR) {
+            serverLogErrno(LL_WARN, "Can't poll inotify, priming disabled");
+            close(fd);
+            return;
+        }
+
+        server.serial.prime_fd = fd;
+    }
+
+    link->open_wd = inotify_add_watch(fd, ttyname(link->sfd),
+                                      IN_OPEN | IN_CLOSE);
+    if (link->open_wd == -1) {
+        serverLogErrno(LL_WARN, "Can't watch %s for opens", link->node->name);
+        link->idle = 0;
+    }
+}
+
+static void _serialOpenHandler(aeEventLoop *el, int fd, void *privdata,
+                               int mask)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    serialNode *node;
+    serialNode *vnode;
+    serialLink *link;
+    ssize_t len;
+    char *p;
+
+    (void) el;
+    (void) privdata;
+    (void) mask;
+
+    for (;;) {
+        len = read(fd, buf, sizeof(buf));
+        if (len <= 0) {
+            break;
+        }
+
+        for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event*)p;
+            if (!(ev->mask & (IN_OPEN | IN_CLOSE))) {
+                continue;
+            }
+
+            for (node = server.serial.master_head; node; node = node->next) {
+                for (vnode = node->virtual_head; vnode; vnode = vnode->next) {
+                    link = vnode->link;
+                    if (!link || link->open_wd != ev->wd) {
+                        continue;
+                    }
+
+                    if (ev->mask & IN_OPEN) {
+                        link->opens++;
+                    } else if (link->opens > 0) {
+                        link->opens--;
+                    }
+
+                    serverLog(LL_DEBUG, "Virtual %s: %s, %d open",
+                              vnode->name,
+                              ev->mask & IN_OPEN ? "opened" : "closed",
+                              link->opens);
+
+                    /* A reader already there keeps its stream, a brief
+                     * open by another process must not disturb it */
+                    if (link->opens != ((ev->mask & IN_OPEN) ? 1 : 0)) {
+                        continue;
+                    }
+
+                    /* Whatever waited in the slave is older than the
+                     * history */
+                    tcflush(link->sfd, TCIFLUSH);
+                    link->olen = 0;
+                    link->opos = 0;
+                    if (vnode->spill) {
+                        spillClear(vnode->spill);
+                    }
+                    link->idle = !link->opens;
+                    if (!link->idle) {
+                        _serialPrime(vnode);
+                    }
+                }
+
+                _serialFlowRelease(node);
+            }
+        }
+    }
+}
+
+void serialAddNode(serialNode *node)
+{
+    if (server.serial.master_head) {
+        node->next = server.serial.master_head;
+    }
+
+    server.serial.master_head = node;
+}
+
+void serialDelNode(serialNode *node)
+{
+    serialNode *prev = NULL;
+    serialNode *cur = server.serial.master_head;
+
+    while (cur) {
+        if (node == cur) {
+            if (!prev) {
+                server.serial.master_head = node->next;
+            } else {
+                prev->next = node->next;
+            }
+            node->next = NULL;
+            break;
+        }
+        prev = cur;
+        cur = cur->next;
+    }
+}
+
+serialNode *serialGetNode(const char *nodename)
+{
+    serialNode *node = NULL;
+    serialNode *cur = server.serial.master_head;
+
+    while (cur) {
+        if (nodename && strcmp(nodename, cur->name) == 0) {
+            node = cur;
+            break;
+        }
+        cur = cur->next;
+    }
+
+    return node;
+}
+
+serialNode *serialGetVirtualNode(serialNode *master, const char *nodename)
+{
+    serialNode *node = NULL;
+    serialNode *cur = master->virtual_head;
+
+    while (cur) {
+        if (nodename && strcmp(nodename, cur->name) == 0) {
+            node = cur;
+            break;
+        }
+        cur = cur->next;
+    }
+
+    return node;
+}
+
+serialNode *serialFindVirtualNode(const char *nodename)
+{
+    serialNode *node = NULL;
+    serialNode *cur = server.serial.master_head;
+
+    while (cur && !node) {
+        node = serialGetVirtualNode(cur, nodename);
+        cur = cur->next;
+    }
+
+    return node;
+}
+
+serialNode *serialFindNodeByFd(int fd)
+{
+    serialNode *node;
+    serialNode *vnode;
+
+    for (node = server.serial.master_head; node; node = node->next) {
+        if (node->link && node->link->fd == fd) {
+            return node;
+        }
+
+        for (vnode = node->virtual_head; vnode; vnode = vnode->next) {
+            if (vnode->link && vnode->link->fd == fd) {
+                return vnode;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Add a virtual to the subscribers of a message type.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] type - Message type
+ * @param[in] bit - Subscription bit of the virtual
+ */
+static void _serialSubscribe(serialNode *master, const char *type, uint64_t bit)
+{
+    serialSubscription *sub;
+    int j;
+
+    for (j = 0; j < master->nsubs; j++) {
+        if (!strcmp(master->subs[j].type, type)) {
+            master->subs[j].mask |= bit;
+            return;
+        }
+    }
+
+    sub = realloc(master->subs, sizeof(*sub)*(master->nsubs + 1));
+    if (!sub) {
+        serverLog(LL_ERROR, "realloc failed");
+        exit(1);
+    }
+
+    master->subs = sub;
+    sub = &master->subs[master->nsubs++];
+    strlcpy(sub->type, type, sizeof(sub->type));
+    sub->mask = bit;
+}
+
+void serialPrepareNodes(void)
+{
+    serialNode *node;
+    serialNode *vnode;
+    transformChain *chain;
+    transformChain *same;
+    char *str;
+    char *token;
+    char *save;
+    int index;
+
+    server.serial.memory_fixed = 0;
+
+    for (node = server.serial.master_head; node; node = node->next) {
+        free(node->subs);
+        node->subs = NULL;
+        node->nsubs = 0;
+        node->subscribers = 0;
+        index = 0;
+
+        _serialSortVirtuals(node);
+
+        for (vnode = node->virtual_head; vnode; vnode = vnode->next) {
+            vnode->subindex = -1;
+
+            if (!vnode->subscribe) {
+                continue;
+            }
+
+            if (index == SERIAL_MAX_SUBSCRIBERS) {
+                serverLog(LL_ERROR, "%s: more than %d subscribing virtuals",
+                          node->name, SERIAL_MAX_SUBSCRIBERS);
+                exit(1);
+            }
+
+            vnode->subindex = index++;
+            node->subscribers |= 1ULL << vnode->subindex;
+
+            str = strdup(vnode->subscribe);
+            if (!str) {
+                serverLog(LL_ERROR, "strdup failed");
+                exit(1);
+            }
+
+            for (token = strtok_r(str, " ,", &save); token;
+                 token = strtok_r(NULL, " ,", &save)) {
+                _serialSubscribe(node, token, 1ULL << vnode->subindex);
+            }
+
+            free(str);
+        }
+
+        if (node->checksum != CHECKSUM_NONE && !node->framer) {
+            serverLog(LL_WARN, "%s: checksum validation needs framing, "
+                      "disabled", node->name);
+            node->checksum = CHECKSUM_NONE;
+        }
+
+        if (node->subscribers && !node->framer) {
+            serverLog(LL_WARN, "%s: subscriptions need framing, delivering "
+                      "everything to every virtual", node->name);
+            node->subscribers = 0;
+            for (vnode = node->virtual_head; vnode; vnode = vnode->next) {
+                vnode->subindex = -1;
+            }
+        }
+
+        if (node->multicast && !node->mcast) {
+            node->mcast = multicastCreate(node->multicast, node->multicast_ttl);
+            if (!node->mcast) {
+                serverLog(LL_ERROR, "%s: can't multicast to %s",
+                          node->name, node->multicast);
+                exit(1);
+            }
+        }
 
-static void _serialFreeLink(serialLink *link)
-{
-    if (link->fd != -1 && link->node) {
-        aeDeleteFileEvent(server.el, link->fd, _serialEventFlags(link->node));
-    }
+        if (node->shm_listen && !node->shm) {
+            node->shm = shmRingCreate(node->shm_size);
+            if (!node->shm) {
+                serverLog(LL_ERROR, "%s: can't create the shared memory ring",
+                          node->name);
+                exit(1);
+            }
+        }
 
-    if (link->node) {
-        link->node->link = NULL;
-    }
+        if ((node->history_size || node->history_ms) && !node->history) {
+            node->history = historyCreate(node->history_size ?
+                                          node->history_size :
+                                          HISTORY_DEFAULT_SIZE,
+                                          node->history_ms);
+        }
 
-    if (link->fd != -1) {
-        close(link->fd);
-        link->fd = -1;
-    }
+        for (vnode = node->virtual_head; vnode; vnode = vnode->next) {
+            if (vnode->spill_dir && !vnode->spill) {
+                vnode->spill = spillCreate(vnode->spill_dir, vnode->name,
+                                           vnode->spill_size);
+                if (!vnode->spill) {
+                    serverLog(LL_ERROR, "%s: can't spill to %s",
+                              vnode->name, vnode->spill_dir);
+                    exit(1);
+                }
+            }
 
-    if (link->sfd != -1) {
-        close(link->sfd);
-        link->sfd = -1;
-    }
+            if (vnode->transform && !vnode->chain) {
+                chain = transformCreate(vnode->transform);
+                if (!chain) {
+                    serverLog(LL_ERROR, "%s: invalid transform %s",
+                              vnode->name, vnode->transform);
+                    exit(1);
+                }
 
-    free(link);
-    link = NULL;
-}
+                /* Virtuals with the same stages get the same output, the
+                 * chain runs once for all of them */
+                for (same = node->chains; same; same = same->next) {
+                    if (!strcmp(same->spec, chain->spec)) {
+                        break;
+                    }
+                }
 
-static void _serialLinkIOError(serialLink *link)
-{
-    _serialFreeLink(link);
-}
+                if (same) {
+                    transformFree(chain);
+                    chain = same;
+                } else {
+                    chain->next = node->chains;
+                    node->chains = chain;
+                }
 
-static void _serialReconnect(void)
-{
-    serialNode *node = server.serial.master_head;
-    serialNode *vnode;
+                vnode->chain = chain;
+            }
 
-    while (node) {
-        int connected = 1;
+            if (vnode->prime && !node->history) {
+                serverLog(LL_WARN, "%s: prime needs a history on %s, "
+                          "disabled", vnode->name, node->name);
+                vnode->prime = 0;
+            }
+        }
 
-        if (!node->link) {
-            if (serialConnectNode(node) == C_ERR) {
-                serverLog(LL_WARN, "Problem reconnecting serial device: %s",
-                          node->name);
-                connected = 0;
+        if (node->flow_policy == SERIAL_FLOW_POLICY_THROTTLE) {
+            int headroom = node->framer ? SERIAL_FLOW_FRAMED_HEADROOM :
+                                          SERIAL_FLOW_HEADROOM;
+
+            /* What was read before reading stopped must still fit */
+            if (server.output_backlog <= 2 * headroom) {
+                serverLog(LL_WARN, "%s: throttle-master needs an "
+                          "output-backlog over %d bytes, dropping instead",
+                          node->name, 2 * headroom);
+                node->flow_policy = SERIAL_FLOW_POLICY_DROP;
             } else {
-                serverLog(LL_INFO, "Reconnected serial: %s (%d) [%s]",
-                          node->name, node->link->fd, _serialEventString(node));
+                if (!node->flow_high ||
+                    node->flow_high > (size_t)(server.output_backlog -
+                                               headroom)) {
+                    node->flow_high = !node->flow_high ?
+                                      server.output_backlog / 2 :
+                                      server.output_backlog - headroom;
+                }
+                if (!node->flow_low || node->flow_low >= node->flow_high) {
+                    node->flow_low = node->flow_high / 4;
+                }
             }
         }
 
-        if (connected) {
-            vnode = node->virtual_head;
+        if (node->replay_path && !node->replay) {
+            node->replay = replayOpen(node->replay_path, node->replay_speed,
+                                      node->replay_loop, node->baudrate);
+            if (!node->replay) {
+                serverLog(LL_ERROR, "%s: can't replay %s",
+                          node->name, node->replay_path);
+                exit(1);
+            }
+        }
 
-            while (vnode) {
-                if (!vnode->link) {
-                    if (serialConnectNode(vnode) == C_ERR) {
-                        serverLog(LL_WARN, "Problem reconnecting virtual serial"
-                                 " device: %s", vnode->name);
-                    } else {
-                        serverLog(LL_INFO, "Reconnected virtual: %s (%d) [%s]",
-                                  vnode->name, vnode->link->fd,
-                                  _serialEventString(vnode));
-                    }
-                }
-                vnode = vnode->next;
+        if (node->capture_path && !node->capture) {
+            node->capture = captureCreate(node->capture_path, node->name,
+                                          node->baudrate, node->capture_size,
+                                          node->capture_files);
+            if (!node->capture) {
+                serverLog(LL_ERROR, "%s: can't capture to %s",
+                          node->name, node->capture_path);
+                exit(1);
             }
         }
 
-        node = node->next;
-    }
-}
+        if (node->framer && node->framer->type == FRAMING_SILENCE &&
+            node->silence_fd == -1) {
+            /* Silences are seen on bytes delivered as they come in */
+            if (node->profile == SERIAL_PROFILE_NONE) {
+                node->profile = SERIAL_PROFILE_LATENCY;
+            }
 
-void serialBeforeSleep(void)
-{
-    serialNode *node = server.serial.master_head;
-    serialNode *vnode;
+            node->silence_fd = timerfd_create(CLOCK_MONOTONIC,
+                                              TFD_NONBLOCK | TFD_CLOEXEC);
+            if (node->silence_fd == -1) {
+                serverLogErrno(LL_ERROR, "timerfd_create");
+                exit(1);
+            }
 
-    while (node) {
-        if (node->link) {
-            node->link->recvbuflen = 0;
+            if (aeCreateFileEvent(server.el, node->silence_fd, AE_READABLE,
+                                  _serialSilenceHandler, node) == AE_ERR) {
+                serverLogErrno(LL_ERROR, "%s: can't poll the silence timer",
+                               node->name);
+                exit(1);
+            }
         }
 
-        vnode = node->virtual_head;
-        while (vnode) {
-            if (vnode->link) {
-                vnode->link->recvbuflen = 0;
+        /* Writers are framed like their master, so that their frames are
+         * never interleaved on the wire. Their writes have no line timing,
+         * silence framed masters take each one as a frame */
+        for (vnode = node->virtual_head; vnode; vnode = vnode->next) {
+            if (nodeIsWriter(vnode) && node->framer && !vnode->framer &&
+                node->framer->type != FRAMING_SILENCE) {
+                vnode->framer = framerClone(node->framer);
             }
-            vnode = vnode->next;
+            server.serial.memory_fixed += _serialFixedMemory(vnode);
         }
-        node = node->next;
+        server.serial.memory_fixed += _serialFixedMemory(node);
+    }
+
+    if (server.max_buffer_memory &&
+        (long long)server.serial.memory_fixed >= server.max_buffer_memory) {
+        serverLog(LL_WARN, "Histories, rings and framers take %zu bytes, "
+                  "max-buffer-memory leaves nothing for backlogs",
+                  server.serial.memory_fixed);
     }
-    usleep(1000000);
 }
 
-serialNode *serialCreateNode(const char *nodename, uint32_t flags)
+int serialAddClient(serialNode *master, int fd, const char *name)
 {
-    serialNode *node = NULL;
+    serialNode *node;
+    serialLink *link;
 
-    if (!nodename) {
-        serverLog(LL_ERROR, "Cannot create a serial node without a name");
-        goto done;
+    /* Judged like its master's clients are */
+    if (!_serialMemAllowed(master, sizeof(*link))) {
+        serverLog(LL_WARN, "Client refused, over max-buffer-memory: %s (%d)",
+                  name, fd);
+        return C_ERR;
     }
 
-    node = calloc(1, sizeof(*node));
+    node = serialCreateNode(name, SERIAL_FLAG_VIRTUAL | SERIAL_FLAG_CLIENT);
     if (!node) {
+        return C_ERR;
+    }
+    node->priority = master->priority;
+
+    link = calloc(1, sizeof(*link));
+    if (!link) {
         serverLog(LL_ERROR, "calloc failed");
         exit(1);
     }
 
-    strlcpy(node->name, nodename, sizeof(node->name));
-    node->flags = flags;
-    node->baudrate = 9600;
-
-done:
-    return node;
-}
+    link->fd = fd;
+    link->sfd = -1;
+    link->open_wd = -1;
+    link->node = node;
+    _serialMemCharge(node, sizeof(*link));
 
-void serialFreeNode(serialNode *n)
-{
-    int j;
-    serialNode *cur = n->virtual_head;
+    /* Attached first, its callbacks are charged to the master */
+    serialAddVirtualNode(master, node);
 
-    while (cur) {
-        cur->virtualof = NULL;
-        cur = cur->next;
+    if (_serialPollLink(link, _serialEventFlags(node)) == C_ERR) {
+        serverLogErrno(LL_ERROR, "Can't poll client %s (%d)", name, fd);
+        _serialMemRelease(node, sizeof(*link));
+        free(link);
+        serialFreeNode(node);
+        return C_ERR;
     }
 
-    if (nodeIsVirtual(n)) {
-        remove(n->name);
+    node->link = link;
 
-        if (n->virtualof) {
-            serialRemoveVirtualNode(n->virtualof, n);
-        }
+    serverLog(LL_INFO, "Client connected: %s (%d) to %s",
+              name, fd, master->name);
+
+    if (master->prime) {
+        node->prime = 1;
+        _serialPrime(node);
     }
 
-    n->virtual_head = NULL;
-    free(n);
-    n = NULL;
+    return C_OK;
 }
 
-int serialConnectNode(serialNode *node)
+serialNode *serialGetVirtualWriterNode(serialNode *master)
 {
-    int ret = C_ERR;
-    struct serialLink *link;
-
-    if (node->link) {
-        goto done;
-    }
+    serialNode *node = NULL;
+    serialNode *cur = master->virtual_head;
 
-    link = _serialCreateLink(node);
-    if (!link) {
-        goto done;
+    while (cur) {
+        if (nodeIsWriter(cur)) {
+            node = cur;
+            break;
+        }
+        cur = cur->next;
     }
 
-    ret = C_OK;
-done:
-    return ret;
+    return node;
 }
 
-void serialInit(void)
+int serialPriorityFromName(const char *name)
 {
-    server.serial.master_head = NULL;
-    serialLoadConfig(server.serial_configfile);
-    _serialReconnect();
-}
+    int j;
 
-void serialAddVirtualNode(serialNode *master, serialNode *virtual)
-{
-    if (master->virtual_head) {
-        virtual->next = master->virtual_head;
+    for (j = 0; j < (int)(sizeof(priority_names)/sizeof(priority_names[0]));
+         j++) {
+        if (!strcasecmp(name, priority_names[j])) {
+            return j;
+        }
     }
 
-    master->virtual_head = virtual;
-    virtual->virtualof = master;
+    return -1;
 }
 
-void serialRemoveVirtualNode(serialNode *master, serialNode *virtual)
+int serialFlowFromName(const char *name)
 {
-    serialNode *prev = NULL;
-    serialNode *cur = master->virtual_head;
+    int j;
 
-    while (cur) {
-        if (virtual == cur) {
-            if (!prev) {
-                master->virtual_head = NULL;
-            } else {
-                prev->next = virtual->next;
-            }
-            virtual->next = NULL;
-            break;
+    for (j = 0; j < (int)(sizeof(flow_names)/sizeof(flow_names[0])); j++) {
+        if (!strcasecmp(name, flow_names[j])) {
+            return j;
         }
-        cur = cur->next;
     }
+
+    return -1;
 }
 
-static void _serialEventHandler(aeEventLoop *el, int fd, void *privdata, int mask)
+int serialFlowPolicyFromName(const char *name)
 {
-    serialLink *link = (serialLink*)privdata;
-
-    (void) el;
-    (void) fd;
-
-    /* Could be closed if an error occurred while processing a read event */
-    if (!link) {
-        return;
-    }
+    int j;
 
-    if (mask & AE_READABLE) {
-        _serialReadHandler(link);
+    for (j = 0;
+         j < (int)(sizeof(flow_policy_names)/sizeof(flow_policy_names[0]));
+         j++) {
+        if (!strcasecmp(name, flow_policy_names[j])) {
+            return j;
+        }
     }
 
-    if (mask & AE_WRITABLE) {
-        _serialWriteHandler(link);
-    }
+    return -1;
 }
 
-static void _serialWriteLink(serialLink *fromlink, serialLink *tolink)
+int serialProfileFromName(const char *name)
 {
-    int nwrite;
+    int j;
 
-    /*
-    serverLog(LL_DEBUG, "%s (%d) -> %s (%d)",
-              fromlink->node->name, fromlink->recvbuflen,
-              tolink->node->name, tolink->recvbuflen);
-*/
-    if (fromlink && fromlink->recvbuflen > 0) {
-        nwrite = write(tolink->fd, fromlink->recvbuf, fromlink->recvbuflen);
-        if (nwrite <= 0) {
-            serverLogErrno(LL_ERROR, "I/O error writing to %s (%d) node link",
-                           tolink->node->name, tolink->fd);
-            _serialLinkIOError(tolink);
-            tolink = NULL;
-        } else {
-            serverLog(LL_DEBUG, "Wrote %d bytes from %s (%d) to %s (%d)",
-                      nwrite,
-                      fromlink->node->name, fromlink->fd,
-                      tolink->node->name, tolink->fd);
+    for (j = 0; j < (int)(sizeof(profile_names)/sizeof(profile_names[0]));
+         j++) {
+        if (!strcasecmp(name, profile_names[j])) {
+            return j;
         }
     }
+
+    return -1;
 }
 
-static void _serialWriteHandler(serialLink *link)
+static long long _serialOverruns(serialNode *node)
 {
-    serialNode *virtual;
+    struct serial_icounter_struct icount;
 
-    if (nodeIsVirtual(link->node)) {
-        /* Read from master */
-        _serialWriteLink(link->node->virtualof->link, link);
-    } else if (nodeIsMaster(link->node)) {
-        /* Read from virtual */
-        virtual = serialGetVirtualWriterNode(link->node);
-        if (virtual) {
-            _serialWriteLink(virtual->link, link);
-        }
+    if (!node->link || nodeIsReplay(node) ||
+        ioctl(node->link->fd, TIOCGICOUNT, &icount) == -1) {
+        return -1;
     }
+
+    return (long long)icount.overrun + icount.buf_overrun;
 }
 
-static void _serialReadHandler(serialLink *link)
+/**
+ * @brief Write one statistics line of a node.
+ *
+ * @param[in] fp - Stream to write to
+ * @param[in] node - Serial node
+ */
+static void _serialWriteNodeStats(FILE *fp, serialNode *node)
 {
-    int nread;
+    const serialStats *st = &node->stats;
+
+    fprintf(fp, "%s:%s connected:%d read_bytes:%llu reads:%llu "
+            "read_avg:%llu read_max:%d latency_avg_us:%lld latency_max_us:%lld "
+            "write_bytes:%llu drop_bytes:%llu filter_bytes:%llu "
+            "corrupt_frames:%llu backlog:%zu",
+            nodeIsMaster(node) ? "master" :
+            nodeIsClient(node) ? "client" : "virtual", node->name,
+            node->link != NULL, st->read_bytes, st->reads,
+            st->reads ? st->read_bytes/st->reads : 0, st->read_max,
+            st->reads ? st->latency_us/(long long)st->reads : 0,
+            st->latency_max_us, st->write_bytes, st->drop_bytes,
+            st->filter_bytes, st->corrupt_frames,
+            node->link ? node->link->olen - node->link->opos : 0);
 
-    nread = read(link->fd, &link->recvbuf, BUFSIZ);
-    if (nread <= 0) {
-        if (errno != EAGAIN) {
-            serverLogErrno(LL_ERROR, "I/O error reading from %s (%d) node link",
-                           link->node->name, link->fd);
-            _serialLinkIOError(link);
-            link = NULL;
-        }
+    if (nodeIsMaster(node)) {
+        fprintf(fp, " overloads:%llu flow:%s flow_policy:%s throttled:%d "
+                "throttles:%llu throttled_ms:%lld loop_us:%lld "
+                "loop_callbacks:%llu", st->overloads,
+                flow_names[node->flow_control],
+                flow_policy_names[node->flow_policy], node->throttled,
+                st->throttles, st->throttled_ms +
+                (node->throttled ? mstime() - node->throttle_ms : 0),
+                st->loop_us, st->loop_callbacks);
     } else {
-        serverLog(LL_DEBUG, "Read %d bytes from %s (%d)",
-                  nread, link->node->name, link->fd);
-        link->recvbuflen = nread;
+        fprintf(fp, " priority:%s deferred_bytes:%llu shed_bytes:%llu "
+                "drop_frames:%llu output:%s", priority_names[node->priority],
+                st->deferred_bytes, st->shed_bytes, st->drop_frames,
+                output_names[node->output]);
     }
-}
 
-void serialAddNode(serialNode *node)
-{
-    if (server.serial.master_head) {
-        node->next = server.serial.master_head;
+    fprintf(fp, " memory:%zu memory_refusals:%llu",
+            node->memory + _serialFixedMemory(node), st->memory_refusals);
+
+    if (node->spill) {
+        fprintf(fp, " spill_bytes:%llu spill_pending:%zu spill_peak:%zu "
+                "spill_drops:%llu", node->spill->bytes,
+                spillPending(node->spill), node->spill->peak,
+                node->spill->drops);
     }
 
-    server.serial.master_head = node;
-}
+    /* Counts of the chain, shared by virtuals with the same stages */
+    if (node->chain) {
+        fprintf(fp, " transform:%s transform_in_bytes:%llu "
+                "transform_out_bytes:%llu transform_packet_drops:%llu",
+                node->chain->spec, node->chain->in_bytes,
+                node->chain->out_bytes, node->chain->packet_drops);
+    }
 
-void serialDelNode(serialNode *node)
-{
-    serialNode *prev = NULL;
-    serialNode *cur = server.serial.master_head;
+    if (!nodeIsMaster(node) && node->prime) {
+        fprintf(fp, " primes:%llu prime_bytes:%llu", st->primes,
+                st->prime_bytes);
+    }
 
-    while (cur) {
-        if (node == cur) {
-            if (!prev) {
-                server.serial.master_head = NULL;
-            } else {
-                prev->next = node->next;
+    if (nodeIsMaster(node)) {
+        serialTuning tuning;
+
+        fprintf(fp, " framing:%s checksum:%s", framerTypeName(node->framer),
+                checksumName(node->checksum));
+        if (node->framer) {
+            fprintf(fp, " frames:%llu framing_discarded:%llu "
+                    "framing_oversized:%llu",
+                    node->framer->frames, node->framer->discarded,
+                    node->framer->oversized);
+            if (node->framer->type == FRAMING_SILENCE) {
+                fprintf(fp, " silence_us:%lld", _serialSilenceUs(node));
             }
-            node->next = NULL;
-            break;
         }
-        cur = cur->next;
-    }
-}
 
-serialNode *serialGetNode(const char *nodename)
-{
-    serialNode *node = NULL;
-    serialNode *cur = server.serial.master_head;
+        if (node->mcast) {
+            fprintf(fp, " multicast_datagrams:%llu multicast_drops:%llu",
+                    node->mcast->datagrams, node->mcast->drops);
+        }
 
-    while (cur) {
-        if (nodename && strcmp(nodename, cur->name) == 0) {
-            node = cur;
-            break;
+        if (node->shm) {
+            fprintf(fp, " shm_records:%llu shm_drops:%llu shm_wakeups:%llu",
+                    node->shm->records, node->shm->drops, node->shm->wakeups);
         }
-        cur = cur->next;
-    }
 
-    return node;
-}
+        if (node->history) {
+            fprintf(fp, " history_frames:%llu history_bytes:%llu",
+                    node->history->records, node->history->bytes);
+        }
 
-serialNode *serialGetVirtualNode(serialNode *master, const char *nodename)
-{
-    serialNode *node = NULL;
-    serialNode *cur = master->virtual_head;
+        if (node->replay) {
+            fprintf(fp, " replay_records:%llu replay_loops:%llu "
+                    "replay_lag_avg_us:%lld replay_lag_max_us:%lld "
+                    "replay_late:%llu",
+                    node->replay->records, node->replay->loops,
+                    node->replay->records ?
+                    node->replay->lag_us / (long long)node->replay->records : 0,
+                    node->replay->lag_max_us, node->replay->late_records);
+        }
 
-    while (cur) {
-        if (nodename && strcmp(nodename, cur->name) == 0) {
-            node = cur;
-            break;
+        if (node->capture) {
+            fprintf(fp, " capture_records:%llu capture_bytes:%llu "
+                    "capture_drops:%llu capture_stalls:%llu",
+                    node->capture->records, node->capture->bytes,
+                    node->capture->drops, node->capture->stalls);
         }
-        cur = cur->next;
+
+        _serialGetTuning(node, &tuning);
+        fprintf(fp, " baudrate:%d baud_actual:%d overruns:%lld profile:%s "
+                "vmin:%d vtime:%d low_latency:%d latency_timer:%d",
+                node->baudrate, node->link ? node->baud_actual : -1,
+                _serialOverruns(node), profile_names[node->profile],
+                tuning.vmin, tuning.vtime, tuning.low_latency,
+                tuning.latency_timer);
     }
 
-    return node;
+    fprintf(fp, "\n");
 }
 
-serialNode *serialGetVirtualWriterNode(serialNode *master)
+void serialWriteStats(FILE *fp)
 {
-    serialNode *node = NULL;
-    serialNode *cur = master->virtual_head;
+    serialNode *node;
+    serialNode *vnode;
 
-    while (cur) {
-        if (nodeIsWriter(cur)) {
-            node = cur;
-            break;
+    fprintf(fp, "system:sproxyd buffer_memory:%zu buffer_memory_fixed:%zu "
+            "buffer_memory_peak:%zu max_buffer_memory:%lld "
+            "memory_refusals:%llu\n",
+            server.serial.memory + server.serial.memory_fixed,
+            server.serial.memory_fixed, server.serial.memory_peak,
+            server.max_buffer_memory, server.serial.memory_refusals);
+
+    for (node = server.serial.master_head; node; node = node->next) {
+        _serialWriteNodeStats(fp, node);
+
+        for (vnode = node->virtual_head; vnode; vnode = vnode->next) {
+            _serialWriteNodeStats(fp, vnode);
         }
-        cur = cur->next;
     }
-
-    return node;
 }
 
 int serialVirtualName(const char *device, const char *suffix,
@@ -705,7 +3494,24 @@ int serialVirtualName(const char *device, const char *suffix,
 
 void serialCron(void)
 {
-    _serialReconnect();
+    if (_serialReconnect() > 0) {
+        serverScheduleJob(CRON_RECONNECT, server.reconnect_interval);
+    }
+}
+
+int serialCaptureCron(void)
+{
+    serialNode *node;
+    int count = 0;
+
+    for (node = server.serial.master_head; node; node = node->next) {
+        if (node->capture) {
+            captureMaintain(node->capture);
+            count++;
+        }
+    }
+
+    return count;
 }
 
 void serialTerm(void)
@@ -745,4 +3551,14 @@ void serialTerm(void)
         serialFreeNode(tmp);
         tmp = NULL;
     }
+
+    if (server.serial.prime_fd != -1) {
+        aeDeleteFileEvent(server.el, server.serial.prime_fd, AE_READABLE);
+        close(server.serial.prime_fd);
+        server.serial.prime_fd = -1;
+    }
+
+    free(server.serial.framed);
+    server.serial.framed = NULL;
+    server.serial.framed_size = 0;
 }
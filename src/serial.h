@@ -1,29 +1,189 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
+#include "framing.h"
+#include "checksum.h"
+#include "multicast.h"
+#include "shmring.h"
+#include "capture.h"
+#include "replay.h"
+#include "history.h"
+#include "spill.h"
+#include "transform.h"
+
 #include <linux/limits.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 /* Serial flags */
 enum {
     SERIAL_FLAG_MASTER  = 1,  /* The node is a master */
     SERIAL_FLAG_VIRTUAL = 2,  /* The node is a virtual */
     SERIAL_FLAG_WRITER  = 4,  /* The node is a writer */
+    SERIAL_FLAG_CLIENT  = 8,  /* The virtual is a network client */
+    SERIAL_FLAG_REPLAY  = 16, /* The master replays a file */
+};
+
+/* Master tuning profiles */
+enum {
+    SERIAL_PROFILE_NONE = 0,         /* Leave driver defaults alone */
+    SERIAL_PROFILE_LATENCY,          /* Deliver every byte as soon as possible */
+    SERIAL_PROFILE_THROUGHPUT,       /* Batch reads to reduce wakeups */
+    SERIAL_PROFILE_CUSTOM,           /* Only apply explicitly set values */
 };
 
+/* What a virtual does with frames that failed checksum validation */
+enum {
+    SERIAL_VALIDATE_DROP = 0,        /* Do not deliver them */
+    SERIAL_VALIDATE_TAG,             /* Deliver and count them */
+    SERIAL_VALIDATE_PASS,            /* Deliver them, ignore validation */
+};
+
+/* Fan-out classes, served in this order */
+enum {
+    SERIAL_PRIORITY_CRITICAL = 0,    /* Always served right away */
+    SERIAL_PRIORITY_NORMAL,          /* Deferred at twice the fan-out budget */
+    SERIAL_PRIORITY_BULK,            /* Deferred past the fan-out budget */
+};
+
+/* Line flow control of a master */
+enum {
+    SERIAL_FLOW_KEEP = 0,            /* Leave the driver setting alone */
+    SERIAL_FLOW_NONE,                /* No flow control */
+    SERIAL_FLOW_RTSCTS,              /* Hardware, RTS/CTS lines */
+    SERIAL_FLOW_XONXOFF,             /* Software, XON/XOFF characters */
+};
+
+/* What a master does when its virtuals fall behind */
+enum {
+    SERIAL_FLOW_POLICY_DROP = 0,     /* Keep reading, drop what does not fit */
+    SERIAL_FLOW_POLICY_THROTTLE,     /* Stop reading until they catch up */
+};
+
+/* What a virtual is sent */
+enum {
+    SERIAL_OUTPUT_RAW = 0,           /* The bytes of the master */
+    SERIAL_OUTPUT_FRAMED,            /* Each frame or read chunk in a record */
+};
+
+/* Records of framed virtuals start with a header, big endian:
+ *   magic   2 bytes  'S' 'F'
+ *   version 1 byte   SERIAL_FRAMED_VERSION
+ *   flags   1 byte   SERIAL_FRAMED_FLAG_*
+ *   length  4 bytes  payload bytes following the header
+ *   seq     4 bytes  master sequence number of the frame or read chunk
+ *   drops   4 bytes  records the virtual lost before this one was built
+ *   time    8 bytes  CLOCK_MONOTONIC microseconds of the read
+ * The sequence counts every frame of the master, subscriptions and dropped
+ * corrupt frames leave gaps, drops tells losses apart. */
+#define SERIAL_FRAMED_MAGIC0       ('S')
+#define SERIAL_FRAMED_MAGIC1       ('F')
+#define SERIAL_FRAMED_VERSION      (1)
+#define SERIAL_FRAMED_HEADER_SIZE  (24)
+
+/* Record flags */
+enum {
+    SERIAL_FRAMED_FLAG_CORRUPT = 1,  /* Failed checksum validation (tag) */
+    SERIAL_FRAMED_FLAG_HISTORY = 2,  /* Primed from the history, seq is 0
+                                        and time has millisecond precision */
+};
+
+/* Virtuals with a subscription list, per master (one bit each) */
+#define SERIAL_MAX_SUBSCRIBERS (64)
+
+/* Default size of the shared memory ring of a master */
+#define SERIAL_DEFAULT_SHM_SIZE (1024*1024)
+
+/* Default permissions of the socket handing out the ring, owner and group */
+#define SERIAL_DEFAULT_SHM_LISTEN_MODE (0660)
+
+/* Bytes of frames a writer may have waiting for its master */
+#define SERIAL_WRITE_QUEUE_SIZE (2*FRAMING_BUF_SIZE)
+
 #define nodeIsMaster(n) ((n)->flags & SERIAL_FLAG_MASTER)
 #define nodeIsVirtual(n) ((n)->flags & SERIAL_FLAG_VIRTUAL)
 #define nodeIsWriter(n) ((n)->flags & SERIAL_FLAG_WRITER)
+#define nodeIsClient(n) ((n)->flags & SERIAL_FLAG_CLIENT)
+#define nodeIsReplay(n) ((n)->flags & SERIAL_FLAG_REPLAY)
 
 struct serialNode;
 
+/* Low level read tuning of a master. A value of -1 leaves the setting alone
+ * (or takes it from the profile). */
+typedef struct serialTuning {
+    int vmin;                        /* termios VMIN (read threshold) */
+    int vtime;                       /* termios VTIME (deciseconds) */
+    int low_latency;                 /* ASYNC_LOW_LATENCY via TIOCSSERIAL */
+    int latency_timer;               /* USB-serial sysfs latency_timer (ms) */
+} serialTuning;
+
+typedef struct serialStats {
+    unsigned long long reads;        /* read() calls that returned data */
+    unsigned long long read_bytes;   /* Bytes read */
+    int read_max;                    /* Largest single read */
+    unsigned long long write_bytes;  /* Bytes written */
+    unsigned long long drop_bytes;   /* Bytes dropped on a full link */
+    unsigned long long drop_frames;  /* Frames or read chunks dropped or
+                                        shed (virtuals) */
+    long long latency_us;            /* Sum of read to delivered latencies */
+    long long latency_max_us;        /* Worst read to delivered latency */
+    unsigned long long filter_bytes; /* Bytes not subscribed to */
+    unsigned long long corrupt_frames; /* Corrupt frames seen (masters),
+                                          dropped or tagged (virtuals) */
+    unsigned long long primes;       /* Times primed from the history */
+    unsigned long long prime_bytes;  /* Bytes queued by priming */
+    unsigned long long deferred_bytes; /* Bytes queued instead of written,
+                                          fan-out over budget */
+    unsigned long long shed_bytes;   /* Bytes dropped, fan-out over budget
+                                        and backlog full */
+    unsigned long long overloads;    /* Fan-outs over budget (masters) */
+    unsigned long long memory_refusals; /* Allocations refused, over
+                                           max-buffer-memory */
+    unsigned long long throttles;    /* Times reading was stopped (masters) */
+    long long throttled_ms;          /* Time spent not reading (masters) */
+    long long loop_us;               /* Event loop time in callbacks of the
+                                        master and its virtuals (masters) */
+    unsigned long long loop_callbacks; /* Callbacks counted in loop_us */
+} serialStats;
+
+/* Per frame results of the master read path, computed once for all of its
+ * virtuals */
+typedef struct serialFrameInfo {
+    uint64_t subscribers;            /* Virtuals subscribed to the frame type */
+    int corrupt;                     /* Failed checksum validation */
+} serialFrameInfo;
+
+typedef struct serialSubscription {
+    char type[FRAMING_MAX_TYPE];     /* Message type, ie. GPGGA or GGA */
+    uint64_t mask;                   /* Subscribed virtuals (subindex bits) */
+} serialSubscription;
+
+/* Complete frames a writer queued for its master, each stored after its
+ * uint32_t length so the scheduler can tell frames apart */
+typedef struct serialQueue {
+    char *buf;                       /* SERIAL_WRITE_QUEUE_SIZE bytes or NULL */
+    size_t len;                      /* Bytes used in buf */
+    size_t pos;                      /* Start of the next frame in buf */
+} serialQueue;
+
 typedef struct serialLink {
     int fd;                          /* Serial file descriptor */
     int sfd;                         /* Slave serial file descriptor */
     char recvbuf[BUFSIZ];            /* Receive buffer */
     int recvbuflen;                  /* Number of bytes received */
     struct serialNode *node;         /* Node related to this link if any, or NULL */
+    int writable;                    /* AE_WRITABLE is registered */
+    int open_wd;                     /* inotify watch of the slave, -1 if
+                                        not primed on open */
+    int idle;                        /* Primed virtual nobody has open,
+                                        frames are only kept in history */
+    int opens;                       /* Open descriptions of the slave
+                                        besides ours, primed virtuals */
+    char *obuf;                      /* Output not yet accepted by the fd */
+    size_t osize;                    /* Allocated size of obuf */
+    size_t olen;                     /* Bytes used in obuf */
+    size_t opos;                     /* Bytes of obuf already written */
 } serialLink;
 
 typedef struct serialNode {
@@ -32,12 +192,98 @@ typedef struct serialNode {
     struct serialNode *virtual_head; /* Pointers to virtuals (if node is master) */
     struct serialNode *virtualof;    /* Pointer to master (if node is virtual) */
     int baudrate;                    /* Baudrate of device */
+    int baud_actual;                 /* Rate the driver settled on */
+    int profile;                     /* SERIAL_PROFILE_* (masters) */
+    serialTuning tuning;             /* Explicit tuning overrides */
+    serialStats stats;               /* Traffic statistics */
+    int opening;                     /* Device being opened by a helper
+                                        thread */
+    framer *framer;                  /* Frame boundary engine, NULL for raw */
+    int silence_fd;                  /* timerfd ending a frame on silence, -1
+                                        if not silence framed (masters) */
+    long long silence_last_us;       /* When the pending bytes were read */
+    long long silence_first_us;      /* When the pending frame started to be
+                                        read */
+    char *subscribe;                 /* Subscribed message types (virtuals) */
+    int subindex;                    /* Bit in the master subscription masks */
+    serialSubscription *subs;        /* Message type to virtuals (masters) */
+    int nsubs;                       /* Number of entries in subs */
+    uint64_t subscribers;            /* Virtuals with subscriptions (masters) */
+    int checksum;                    /* CHECKSUM_* validation (masters) */
+    int validate;                    /* SERIAL_VALIDATE_* (virtuals) */
+    int output;                      /* SERIAL_OUTPUT_* (virtuals) */
+    uint32_t seq;                    /* Sequence of the next frame or read
+                                        chunk (masters) */
+    char *transform;                 /* Transform stages (virtuals) */
+    transformChain *chain;           /* Transform chain, shared with virtuals
+                                        of the master with the same stages */
+    transformChain *chains;          /* Transform chains of the virtuals
+                                        (masters) */
+    int priority;                    /* SERIAL_PRIORITY_* (virtuals), of
+                                        network clients (masters) */
+    int flow_control;                /* SERIAL_FLOW_* (masters) */
+    int flow_policy;                 /* SERIAL_FLOW_POLICY_* (masters) */
+    size_t flow_high;                /* Virtual backlog that stops reading */
+    size_t flow_low;                 /* Backlog of every virtual that resumes
+                                        reading */
+    int throttled;                   /* Not read, virtuals catching up */
+    long long throttle_ms;           /* When reading was stopped */
+    serialQueue wqueue;              /* Frames waiting for the master (writers) */
+    int weight;                      /* Frames per scheduling turn (writers) */
+    struct serialNode *wturn;        /* Writer being served (masters) */
+    int wcredit;                     /* Frames left in its turn (masters) */
+    size_t woff;                     /* Bytes of its next frame already
+                                        written (masters) */
+    char *tcp_listen;                /* host:port to accept clients on */
+    char *unix_listen;               /* Unix socket to accept clients on */
+    char *multicast;                 /* group:port to send frames to */
+    int multicast_ttl;               /* Multicast TTL (hops) */
+    multicastSender *mcast;          /* Multicast sender, NULL if disabled */
+    char *shm_listen;                /* Unix socket handing out the ring */
+    int shm_listen_mode;             /* Permissions of the shm_listen socket */
+    size_t shm_size;                 /* Size of the ring data area */
+    shmRing *shm;                    /* Shared memory ring, NULL if disabled */
+    char *capture_path;              /* Capture segment path prefix */
+    size_t capture_size;             /* Size of a capture segment */
+    int capture_files;               /* Capture segments to keep */
+    capture *capture;                /* Traffic capture, NULL if disabled */
+    char *replay_path;               /* File replayed instead of a device */
+    double replay_speed;             /* Replay speed factor, 0: unpaced */
+    int replay_loop;                 /* Start the replay over at the end */
+    replay *replay;                  /* Replay source (replay masters) */
+    size_t history_size;             /* Bytes of history to keep */
+    int history_ms;                  /* Age of history to keep, 0: any */
+    history *history;                /* Recent frames, NULL if disabled */
+    char *spill_dir;                 /* Directory to spill overflow to
+                                        (virtuals) */
+    size_t spill_size;               /* Bytes the spill file may hold */
+    spill *spill;                    /* Overflow on disk, NULL if disabled */
+    int prime;                       /* Send the history when opened
+                                        (virtuals) or to new clients
+                                        (masters) */
     serialLink *link;                /* rs232 link with this node */
+    size_t memory;                   /* Bytes of its link, backlog and
+                                        writer queue */
     struct serialNode *next;         /* Pointer to next master in list (if any) */
 } serialNode;
 
 typedef struct serialState {
     struct serialNode *master_head;  /* Pointer to masters */
+    int prime_fd;                    /* inotify watching primed virtuals
+                                        for opens, -1 if none */
+    long long input_us;              /* When the master input being fanned
+                                        out was read */
+    long long work_us;               /* When handling of the event fanning
+                                        it out started */
+    size_t memory;                   /* Bytes of links, backlogs and writer
+                                        queues */
+    size_t memory_fixed;             /* Bytes of histories, rings and
+                                        framers */
+    size_t memory_peak;              /* Largest total */
+    unsigned long long memory_refusals; /* Allocations refused, over
+                                           max-buffer-memory */
+    unsigned char *framed;           /* Records for a framed virtual */
+    size_t framed_size;              /* Allocated size of framed */
 } serialState;
 
 /**
@@ -50,6 +296,14 @@ typedef struct serialState {
  */
 serialNode *serialCreateNode(const char *nodename, uint32_t flags);
 
+/**
+ * @brief Release a serial node, detaching it from its master if it is a
+ *        virtual.
+ *
+ * @param[in] n - Serial node (its link must already be freed)
+ */
+void serialFreeNode(serialNode *n);
+
 /**
  * @brief Add serialNode to list.
  *
@@ -83,9 +337,13 @@ void serialRemoveVirtualNode(serialNode *master, serialNode *virtual);
 /**
  * @brief Given an initialized serialNode, it will attempt to open
  *        and configure the connection. This function will also create file
- *        events for polling file descriptor events.
+ *        events for polling file descriptor events. Devices are opened by
+ *        an opener thread, the link is up once it is done (node->opening
+ *        is cleared), connecting the virtuals of a master then.
  *
  * @param[in] node - serialNode to configure for communication
+ *
+ * @return C_OK if connected or being opened, C_ERR otherwise
  */
 int serialConnectNode(serialNode *node);
 
@@ -109,7 +367,45 @@ serialNode *serialGetNode(const char *nodename);
 serialNode *serialGetVirtualNode(serialNode *master, const char *nodename);
 
 /**
- * @brief Return the virtual writer in the masters virtual set.
+ * @brief Return the virtual node with the given name, of any master.
+ *
+ * @param[in] nodename - Name of the virtual node (device name)
+ *
+ * @return Pointer to node if found or NULL if not found
+ */
+serialNode *serialFindVirtualNode(const char *nodename);
+
+/**
+ * @brief Return the master or virtual node whose link uses a descriptor.
+ *
+ * @param[in] fd - File descriptor
+ *
+ * @return Pointer to node if found or NULL if not found
+ */
+serialNode *serialFindNodeByFd(int fd);
+
+/**
+ * @brief Check the loaded configuration of every master and precompute its
+ *        read path state, such as the message type to virtual bitmaps built
+ *        from the subscription lists of its virtuals.
+ */
+void serialPrepareNodes(void);
+
+/**
+ * @brief Attach an accepted network connection to a master as a client
+ *        virtual. Clients get the same data as the virtuals of the master
+ *        and are freed when they disconnect.
+ *
+ * @param[in] master - Master serial node
+ * @param[in] fd - Non-blocking connected socket
+ * @param[in] name - Client name for logs and statistics
+ *
+ * @return C_OK if successful, C_ERR otherwise (fd is left open)
+ */
+int serialAddClient(serialNode *master, int fd, const char *name);
+
+/**
+ * @brief Return the first virtual writer in the masters virtual set.
  *
  * @param[in] master - Master node
  *
@@ -117,6 +413,49 @@ serialNode *serialGetVirtualNode(serialNode *master, const char *nodename);
  */
 serialNode *serialGetVirtualWriterNode(serialNode *master);
 
+/**
+ * @brief Parse a profile name.
+ *
+ * @param[in] name - latency, throughput or custom
+ *
+ * @return SERIAL_PROFILE_* or -1 if the name is unknown
+ */
+int serialProfileFromName(const char *name);
+
+/**
+ * @brief Parse a flow control name.
+ *
+ * @param[in] name - keep, none, rtscts or xonxoff
+ *
+ * @return SERIAL_FLOW_* or -1 if the name is unknown
+ */
+int serialFlowFromName(const char *name);
+
+/**
+ * @brief Parse a flow policy name.
+ *
+ * @param[in] name - drop or throttle-master
+ *
+ * @return SERIAL_FLOW_POLICY_* or -1 if the name is unknown
+ */
+int serialFlowPolicyFromName(const char *name);
+
+/**
+ * @brief Parse a priority name.
+ *
+ * @param[in] name - critical, normal or bulk
+ *
+ * @return SERIAL_PRIORITY_* or -1 if the name is unknown
+ */
+int serialPriorityFromName(const char *name);
+
+/**
+ * @brief Write statistics of all nodes, one line per node.
+ *
+ * @param[in] fp - Stream to write to
+ */
+void serialWriteStats(FILE *fp);
+
 /**
  * @brief Create a virtual name from a device path and suffix.
  *
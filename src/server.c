@@ -1,6 +1,7 @@
 #include "server.h"
 #include "ae.h"
 #include "config.h"
+#include "opener.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -11,10 +12,19 @@
 #include <stdarg.h>
 #include <syslog.h>
 #include <sys/time.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <time.h>
+#include <linux/limits.h>
 
 #define DATETIME_BUF_SIZE (64)
 
+/* fs.nr_open default, when /proc is not there to tell */
+#define SERVER_DEFAULT_NR_OPEN (1024*1024)
+
+/* Decrement of the open files limit while setrlimit() refuses it */
+#define SERVER_FD_LIMIT_STEP (16)
+
 struct sproxyServer server;
 
 /**
@@ -34,6 +44,61 @@ static void _setupSignalHandlers(void);
  */
 static void _prepareForShutdown();
 
+/**
+ * @brief Read callback for the signal self-pipe.
+ *
+ * @param[in] el - Pointer to event loop
+ * @param[in] fd - Read end of the self-pipe
+ * @param[in] privdata - Unused
+ * @param[in] mask - Event flags
+ */
+static void _signalPipeHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+
+/**
+ * @brief Atomically replace the statistics file with current statistics.
+ */
+static void _writeStatsFile(void);
+
+/**
+ * @brief Write the event loop statistics line.
+ *
+ * @param[in] fp - Statistics file
+ */
+static void _writeLoopStats(FILE *fp);
+
+/**
+ * @brief Log an event callback over slow-callback-us, with the device it
+ *        served. Rate limited, a device stuck on a slow path would flood
+ *        the log.
+ *
+ * @param[in] el - Pointer to event loop
+ * @param[in] fd - Descriptor of the file event, -1 for time events
+ * @param[in] us - Duration of the callback
+ */
+static void _slowCallback(aeEventLoop *el, int fd, long long us);
+
+/**
+ * @brief Return the number of milliseconds until the earliest cron deadline.
+ *
+ * @param[in] now - Current monotonic time in milliseconds
+ */
+static long long _cronNextDelay(long long now);
+
+/**
+ * @brief Raise the soft limit of open files to the hard limit, at most
+ *        fs.nr_open, stepping down while the kernel refuses. The event
+ *        loop grows with the descriptors, the limit is the only ceiling on
+ *        network clients.
+ */
+static void _raiseFdLimit(void);
+
+/**
+ * @brief Return the most open files a process may have (fs.nr_open).
+ *
+ * @return fs.nr_open, or SERVER_DEFAULT_NR_OPEN if it can't be read
+ */
+static rlim_t _nrOpen(void);
+
 static void _sigHandler(int sig)
 {
     switch (sig) {
@@ -52,6 +117,15 @@ static void _sigHandler(int sig)
     }
 
     server.shutdown = 1;
+
+    /* Wake up the event loop, it may be sleeping until a far deadline */
+    if (server.sigpipe[1] != -1) {
+        int saved_errno = errno;
+        if (write(server.sigpipe[1], "x", 1) == -1) {
+            /* Pipe full, a wakeup is already pending */
+        }
+        errno = saved_errno;
+    }
 }
 
 static void _setupSignalHandlers(void)
@@ -73,6 +147,13 @@ static void _setupSignalHandlers(void)
         serverLogErrno(LL_ERROR, "sigaction(SIGINT) failed");
         exit(1);
     }
+
+    /* Write errors to disconnected clients are handled where they occur */
+    act.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &act, NULL) != 0) {
+        serverLogErrno(LL_ERROR, "sigaction(SIGPIPE) failed");
+        exit(1);
+    }
 }
 
 static void _prepareForShutdown()
@@ -85,36 +166,199 @@ static void _prepareForShutdown()
     }
 }
 
-int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData)
+static void _signalPipeHandler(aeEventLoop *el, int fd, void *privdata, int mask)
 {
+    char buf[64];
+
+    AE_NOTUSED(privdata);
+    AE_NOTUSED(mask);
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
     if (server.shutdown) {
         _prepareForShutdown();
-        aeStop(eventLoop);
+        aeStop(el);
+    }
+}
+
+long long ustime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+long long mstime(void)
+{
+    return ustime()/1000;
+}
+
+static long long _cronNextDelay(long long now)
+{
+    long long delay = CONFIG_CRON_IDLE_MS;
+    int j;
+
+    for (j = 0; j < CRON_JOBS; j++) {
+        if (server.cron_deadline[j] == CRON_NEVER) {
+            continue;
+        }
+        if (server.cron_deadline[j] - now < delay) {
+            delay = server.cron_deadline[j] - now;
+        }
+    }
+
+    return delay > 0 ? delay : 0;
+}
+
+void serverScheduleJob(int job, long long ms)
+{
+    long long now = mstime();
+
+    if (server.cron_deadline[job] != CRON_NEVER &&
+        server.cron_deadline[job] <= now + ms) {
+        return;
+    }
+
+    server.cron_deadline[job] = now + ms;
+
+    if (server.cron_event_id != AE_ERR) {
+        aeRescheduleTimeEvent(server.el, server.cron_event_id,
+                              _cronNextDelay(now));
+    }
+}
+
+static void _writeLoopStats(FILE *fp)
+{
+    const aeLoopStats *st = &server.el->stats;
+    int j;
+
+    fprintf(fp, "loop:%s loops:%llu loop_us:%lld busy_us:%lld "
+            "busy_max_us:%lld beforesleep_us:%lld poll_us:%lld file_us:%lld "
+            "time_us:%lld callbacks:%llu callback_max_us:%lld "
+            "slow_callbacks:%llu busy_hist:", aeGetApiName(), st->loops,
+            st->loop_us, st->loop_us - st->poll_us, st->busy_max_us,
+            st->beforesleep_us, st->poll_us, st->file_us, st->time_us,
+            st->callbacks, st->callback_max_us, st->slow_callbacks);
+
+    for (j = 0; j < AE_HIST_BUCKETS; j++) {
+        fprintf(fp, j ? ",%llu" : "%llu", st->busy_hist[j]);
+    }
+
+    fprintf(fp, " callback_hist:");
+    for (j = 0; j < AE_HIST_BUCKETS; j++) {
+        fprintf(fp, j ? ",%llu" : "%llu", st->callback_hist[j]);
+    }
+
+    fprintf(fp, "\n");
+}
+
+static void _slowCallback(aeEventLoop *el, int fd, long long us)
+{
+    long long now = mstime();
+    serialNode *node;
+
+    (void) el;
+
+    if (now - server.slow_log_ms < CONFIG_SLOW_CALLBACK_LOG_MS) {
+        server.slow_unlogged++;
+        return;
+    }
+
+    node = fd == -1 ? NULL : serialFindNodeByFd(fd);
+
+    serverLog(LL_WARN, "Slow event callback: %lld us in %s (%d), %llu more "
+              "since the last report", us, fd == -1 ? "cron" :
+              node ? node->name : "-", fd, server.slow_unlogged);
+
+    server.slow_log_ms = now;
+    server.slow_unlogged = 0;
+}
+
+static void _writeStatsFile(void)
+{
+    char tmpfile[PATH_MAX];
+    FILE *fp;
+
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", server.stats_file);
+
+    fp = fopen(tmpfile, "w");
+    if (!fp) {
+        serverLogErrno(LL_WARN, "Can't open %s", tmpfile);
+        return;
     }
 
-    run_with_period(server.reconnect_interval) {
+    serialWriteStats(fp);
+    _writeLoopStats(fp);
+
+    if (fclose(fp) != 0 || rename(tmpfile, server.stats_file) == -1) {
+        serverLogErrno(LL_WARN, "Can't write %s", server.stats_file);
+        unlink(tmpfile);
+    }
+}
+
+int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData)
+{
+    long long now = mstime();
+
+    if (server.cron_deadline[CRON_RECONNECT] != CRON_NEVER &&
+        server.cron_deadline[CRON_RECONNECT] <= now) {
+        server.cron_deadline[CRON_RECONNECT] = CRON_NEVER;
         serialCron();
     }
 
-    server.cronloops++;
-    return 1000/server.hz;
+    if (server.cron_deadline[CRON_STATS] != CRON_NEVER &&
+        server.cron_deadline[CRON_STATS] <= now) {
+        server.cron_deadline[CRON_STATS] = CRON_NEVER;
+        _writeStatsFile();
+        serverScheduleJob(CRON_STATS, server.stats_interval);
+    }
+
+    if (server.cron_deadline[CRON_CAPTURE] != CRON_NEVER &&
+        server.cron_deadline[CRON_CAPTURE] <= now) {
+        server.cron_deadline[CRON_CAPTURE] = CRON_NEVER;
+        if (serialCaptureCron() > 0) {
+            serverScheduleJob(CRON_CAPTURE, server.capture_sync);
+        }
+    }
+
+    /* Sleep until the earliest deadline, an idle daemon only wakes up for
+     * file events */
+    return _cronNextDelay(mstime());
 }
 
 void serverInitConfig(void)
 {
+    int j;
+
     server.pid = getpid();
     server.logfile = NULL;
     server.configfile = NULL;
     server.pidfile = NULL;
     server.shutdown = 0;
-    server.cronloops = 0;
     server.daemonize = CONFIG_DEFAULT_DAEMONIZE;
     server.verbosity = CONFIG_DEFAULT_VERBOSITY;
     server.syslog = CONFIG_DEFAULT_SYSLOG_ENABLED;
     server.maxclients = CONFIG_DEFAULT_MAX_CLIENTS;
     server.cron_event_id = AE_ERR;
-    server.hz = CONFIG_DEFAULT_HZ;
+    for (j = 0; j < CRON_JOBS; j++) {
+        server.cron_deadline[j] = CRON_NEVER;
+    }
+    server.timer_slack = CONFIG_DEFAULT_TIMER_SLACK_US;
+    server.sigpipe[0] = -1;
+    server.sigpipe[1] = -1;
     server.reconnect_interval = CONFIG_DEFAULT_RECONNECT_INTERVAL_MS;
+    server.hotplug = CONFIG_DEFAULT_HOTPLUG;
+    server.stats_file = NULL;
+    server.stats_interval = CONFIG_DEFAULT_STATS_INTERVAL_MS;
+    server.output_backlog = CONFIG_DEFAULT_OUTPUT_BACKLOG;
+    server.capture_sync = CONFIG_DEFAULT_CAPTURE_SYNC_MS;
+    server.fanout_budget = CONFIG_DEFAULT_FANOUT_BUDGET_US;
+    server.open_threads = CONFIG_DEFAULT_OPEN_THREADS;
+    server.max_buffer_memory = CONFIG_DEFAULT_MAX_BUFFER_MEMORY;
+    server.slow_callback_us = CONFIG_DEFAULT_SLOW_CALLBACK_US;
+    server.slow_log_ms = 0;
+    server.slow_unlogged = 0;
 
     server.el = aeCreateEventLoop(server.maxclients);
     if (!server.el) {
@@ -127,10 +371,84 @@ void serverInitConfig(void)
     }
 }
 
+static rlim_t _nrOpen(void)
+{
+    unsigned long long nr_open;
+    FILE *fp;
+    int ret;
+
+    fp = fopen("/proc/sys/fs/nr_open", "r");
+    if (!fp) {
+        return SERVER_DEFAULT_NR_OPEN;
+    }
+
+    ret = fscanf(fp, "%llu", &nr_open);
+    fclose(fp);
+
+    return ret == 1 && nr_open ? nr_open : SERVER_DEFAULT_NR_OPEN;
+}
+
+static void _raiseFdLimit(void)
+{
+    struct rlimit rl;
+    rlim_t old;
+    rlim_t limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        serverLogErrno(LL_WARN, "getrlimit(RLIMIT_NOFILE)");
+        return;
+    }
+
+    if (rl.rlim_cur == rl.rlim_max) {
+        return;
+    }
+
+    /* setrlimit() refuses a hard limit over fs.nr_open with EPERM, even
+     * unlimited and even unchanged: nothing above it can be reached */
+    old = rl.rlim_cur;
+    limit = rl.rlim_max;
+    if (limit == RLIM_INFINITY || limit > _nrOpen()) {
+        limit = _nrOpen();
+        rl.rlim_max = limit;
+    }
+
+    while (limit > old) {
+        rl.rlim_cur = limit;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == 0) {
+            serverLog(LL_DEBUG, "Open files limit raised to %llu",
+                      (unsigned long long)limit);
+            return;
+        }
+        if (errno != EPERM) {
+            break;
+        }
+        limit = limit > old + SERVER_FD_LIMIT_STEP ?
+                limit - SERVER_FD_LIMIT_STEP : old;
+    }
+
+    serverLogErrno(LL_WARN, "Can't raise the open files limit over %llu",
+                   (unsigned long long)old);
+}
+
 void serverInit(void)
 {
+    _raiseFdLimit();
+
+    if (pipe2(server.sigpipe, O_NONBLOCK | O_CLOEXEC) == -1 ||
+        aeCreateFileEvent(server.el, server.sigpipe[0], AE_READABLE,
+                          _signalPipeHandler, NULL) == AE_ERR) {
+        serverLogErrno(LL_ERROR, "Can't create signal pipe");
+        exit(1);
+    }
+
     _setupSignalHandlers();
 
+    /* Coarser slack lets the kernel batch our wakeups with other timers */
+    if (server.timer_slack > 0 &&
+        prctl(PR_SET_TIMERSLACK, (unsigned long)server.timer_slack*1000) == -1) {
+        serverLogErrno(LL_WARN, "prctl(PR_SET_TIMERSLACK)");
+    }
+
     server.cron_event_id = aeCreateTimeEvent(server.el, 1, serverCron, NULL, NULL);
 
     if (server.cron_event_id == AE_ERR) {
@@ -138,11 +456,23 @@ void serverInit(void)
         exit(1);
     }
 
+    aeSetSlowProc(server.el, server.slow_callback_us, _slowCallback);
+
+    openerInit(server.open_threads);
     serialInit();
+    hotplugInit();
+    listenInit();
+
+    if (server.stats_file) {
+        serverScheduleJob(CRON_STATS, server.stats_interval);
+    }
 }
 
 void serverTerm(void)
 {
+    listenTerm();
+    hotplugTerm();
+    openerTerm();
     serialTerm();
 
     free(server.logfile);
@@ -153,12 +483,20 @@ void serverTerm(void)
     server.configfile = NULL;
     free(server.serial_configfile);
     server.serial_configfile = NULL;
+    free(server.stats_file);
+    server.stats_file = NULL;
 
     if (aeDeleteTimeEvent(server.el, server.cron_event_id) == AE_ERR) {
         serverLog(LL_WARN, "Failed removing event loop timers");
     }
 
     server.cron_event_id = AE_ERR;
+
+    aeDeleteFileEvent(server.el, server.sigpipe[0], AE_READABLE);
+    close(server.sigpipe[0]);
+    close(server.sigpipe[1]);
+    server.sigpipe[0] = -1;
+    server.sigpipe[1] = -1;
 }
 
 void version(void)
@@ -224,11 +562,6 @@ void usage(void)
     exit(1);
 }
 
-void serverBeforeSleep(struct aeEventLoop *eventLoop)
-{
-    serialBeforeSleep();
-}
-
 void serverLogRaw(int level, const char *msg)
 {
     static const int syslogLevelMap[] = {
@@ -241,6 +574,7 @@ void serverLogRaw(int level, const char *msg)
     char datetime_buf[DATETIME_BUF_SIZE] = {0};
     int offset;
     struct timeval tv = {0};
+    struct tm tm;
 
     if (level < server.verbosity) {
         return;
@@ -256,7 +590,7 @@ void serverLogRaw(int level, const char *msg)
     }
 
     strftime(datetime_buf, sizeof(datetime_buf),
-             "%Y-%m-%d %H:%M:%S", localtime(&tv.tv_sec));
+             "%Y-%m-%d %H:%M:%S", localtime_r(&tv.tv_sec, &tm));
 
     fprintf(fp, "%s [%s] %s\n", datetime_buf, serverLogLevel(level), msg);
     fflush(fp);
@@ -364,7 +698,6 @@ int main(int argc, char *argv[])
 
     serverLog(LL_INFO,"Server started, sproxy version " SPROXY_VERSION);
 
-    aeSetBeforeSleepProc(server.el, serverBeforeSleep);
     aeMain(server.el);
     serverTerm();
     aeDeleteEventLoop(server.el);
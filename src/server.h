@@ -23,22 +23,40 @@
 #define LOG_MAX_LEN (1024)
 
 /* Static server configuration */
-#define CONFIG_DEFAULT_HZ                    (10)
-#define CONFIG_MIN_HZ                        (1)
-#define CONFIG_MAX_HZ                        (500)
 #define CONFIG_DEFAULT_PID_FILE              ("/var/run/sproxyd.pid")
 #define CONFIG_DEFAULT_DAEMONIZE             (0)
 #define CONFIG_DEFAULT_SYSLOG_ENABLED        (0)
-#define CONFIG_DEFAULT_MAX_CLIENTS           (1000)
+#define CONFIG_DEFAULT_MAX_CLIENTS           (1024) /* Grown on demand */
 #define CONFIG_DEFAULT_VERBOSITY             (LL_ERROR)
 #define CONFIG_DEFAULT_RECONNECT_INTERVAL_MS (5000)
 #define CONFIG_MIN_RECONNECT_INTERVAL_MS     (1000)
 #define CONFIG_MAX_RECONNECT_INTERVAL_MS     (3600000) /* 24 hours */
 #define CONFIG_DEFAULT_SERIAL_CONFIG_FILE    ("serial.ini")
+#define CONFIG_DEFAULT_HOTPLUG               (1)
+#define CONFIG_DEFAULT_TIMER_SLACK_US        (0) /* Keep kernel default */
+#define CONFIG_MAX_TIMER_SLACK_US            (1000000)
+#define CONFIG_CRON_IDLE_MS                  (3600000)
+#define CONFIG_DEFAULT_STATS_INTERVAL_MS     (10000)
+#define CONFIG_MIN_STATS_INTERVAL_MS         (100)
+#define CONFIG_DEFAULT_OUTPUT_BACKLOG        (65536)
+#define CONFIG_MIN_OUTPUT_BACKLOG            (0)
+#define CONFIG_DEFAULT_CAPTURE_SYNC_MS       (1000)
+#define CONFIG_MIN_CAPTURE_SYNC_MS           (10)
+#define CONFIG_DEFAULT_FANOUT_BUDGET_US      (1000)
+#define CONFIG_DEFAULT_OPEN_THREADS          (64)
+#define CONFIG_DEFAULT_MAX_BUFFER_MEMORY     (0) /* No limit */
+#define CONFIG_DEFAULT_SLOW_CALLBACK_US      (10000)
+#define CONFIG_SLOW_CALLBACK_LOG_MS          (1000) /* At most one line */
+
+/* Periodic jobs run by serverCron, each tracked as an absolute deadline */
+enum {
+    CRON_RECONNECT = 0,         /* Reconnect disconnected serial nodes */
+    CRON_STATS,                 /* Write the statistics file */
+    CRON_CAPTURE,               /* Flush and rotate capture segments */
+    CRON_JOBS
+};
 
-/* Convert milliseconds to cronloops based on server HZ value */
-#define run_with_period(_ms_) if ((_ms_ <= 1000/server.hz) || \
-    !(server.cronloops%((_ms_)/(1000/server.hz))))
+#define CRON_NEVER (-1LL)
 
 #define strlcpy(dst, src, size) \
     (snprintf(dst, size, "%s", src))
@@ -53,14 +71,31 @@ struct sproxyServer {
     int daemonize;              /* True if running as a daemon */
     int verbosity;              /* Logging level */
     int syslog;                 /* Is syslog enabled? */
-    int maxclients;             /* Max concurrent clients */
-    int cronloops;              /* Number of times the cron function run */
+    int maxclients;             /* Initial event loop fd table size */
     int reconnect_interval;     /* Number of milliseconds to wait before
                                    reconnecting serial devices */
     long long cron_event_id;    /* Cron task id */
+    long long cron_deadline[CRON_JOBS]; /* Monotonic ms deadline per job */
+    int timer_slack;            /* Timer slack in microseconds (0: default) */
+    int sigpipe[2];             /* Self-pipe woken by signal handlers */
     aeEventLoop *el;
-    int hz;                     /* Timer event frequency */
     char *serial_configfile;    /* Serial config file */
+    int hotplug;                /* Watch device directories for hotplug */
+    char *stats_file;           /* Statistics file, NULL if disabled */
+    int stats_interval;         /* Milliseconds between statistics writes */
+    int output_backlog;         /* Bytes a slow virtual may have pending */
+    int capture_sync;           /* Milliseconds between capture write backs */
+    int fanout_budget;          /* Microseconds a master read may take before
+                                   lower priority virtuals are deferred,
+                                   0: never */
+    int open_threads;           /* Max threads opening devices, 0: open
+                                   them on the event loop */
+    long long max_buffer_memory; /* Bytes all buffers may take, 0: no
+                                    limit */
+    int slow_callback_us;       /* Event callbacks taking longer are logged,
+                                   0: never */
+    long long slow_log_ms;      /* When the last slow callback was logged */
+    unsigned long long slow_unlogged; /* Slow callbacks not logged since */
     struct serialState serial;  /* State of serial devices */
 };
 
@@ -102,6 +137,25 @@ void serverLogErrno(int level, const char *fmt, ...);
  */
 const char *serverLogLevel(int level);
 
+/**
+ * @brief Return the monotonic clock in microseconds.
+ */
+long long ustime(void);
+
+/**
+ * @brief Return the monotonic clock in milliseconds.
+ */
+long long mstime(void);
+
+/**
+ * @brief Make sure a cron job runs within the given number of milliseconds.
+ *        An earlier pending deadline is kept.
+ *
+ * @param[in] job - Cron job (CRON_*)
+ * @param[in] ms - Milliseconds from now
+ */
+void serverScheduleJob(int job, long long ms);
+
 /**
  * @brief Load server configuration from given file.
  *
@@ -120,16 +174,60 @@ void serialInit(void);
 void serialTerm(void);
 
 /**
- * @brief Called before every event loop iteration. Reset all serialNode
- *        receive buffers.
+ * @brief Called when the reconnect deadline expires, will attempt to
+ *        reconnect all serialNode that are disconnected and re-arm the
+ *        deadline if some are still missing.
  */
-void serialBeforeSleep(void);
+void serialCron(void);
 
 /**
- * @brief Called at a specified interval, will attempt to reconnect all
- *        serialNode that are disconnected.
+ * @brief Called when the capture deadline expires, starts write back of
+ *        the captures and prepares their next segments.
+ *
+ * @return Number of masters with a capture
  */
-void serialCron(void);
+int serialCaptureCron(void);
+
+/**
+ * @brief Connect a master (and its virtuals) whose device path just
+ *        appeared.
+ *
+ * @param[in] node - Master serial node
+ */
+void serialHotplugAdd(serialNode *node);
+
+/**
+ * @brief Tear down a master whose device path was just removed.
+ *
+ * @param[in] node - Master serial node
+ */
+void serialHotplugRemove(serialNode *node);
+
+/**
+ * @brief Start watching the directories of all configured masters so
+ *        devices are connected as soon as they appear.
+ */
+void hotplugInit(void);
+
+/**
+ * @brief Stop watching for hotplug events.
+ */
+void hotplugTerm(void);
+
+/**
+ * @brief Open the TCP and Unix socket listeners of all configured masters.
+ */
+void listenInit(void);
+
+/**
+ * @brief Close all listeners (clients stay connected until serialTerm).
+ */
+void listenTerm(void);
+
+/**
+ * @brief Accept connections again after running out of file descriptors.
+ */
+void listenResume(void);
 
 /**
  * @brief Load serial configuration from given file.
@@ -0,0 +1,197 @@
+#include "server.h"
+#include "shmring.h"
+
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* Linux 5.1, not in older C libraries */
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+/**
+ * @brief Create a memfd of a fixed size, map it and seal it.
+ *
+ * @param[in] name - memfd name
+ * @param[in] size - Size of the file
+ * @param[in] seals - F_SEAL_* added once mapped, on top of the size ones
+ * @param[out] map - Read/write mapping of the whole file
+ *
+ * @return memfd, or -1 on error
+ */
+static int _shmRingMemfd(const char *name, size_t size, int seals,
+                         void **map);
+
+/**
+ * @brief Append one record at the producer position, wrapping first if the
+ *        record does not fit before the end of the data area.
+ *
+ * @param[in] r - Ring
+ * @param[in] frame - Frame
+ * @param[in] len - Length of frame
+ * @param[in] flags - RING_FLAG_*
+ */
+static void _shmRingAppend(shmRing *r, const void *frame, size_t len,
+                           uint32_t flags);
+
+static int _shmRingMemfd(const char *name, size_t size, int seals,
+                         void **map)
+{
+    int fd;
+
+    fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        serverLogErrno(LL_ERROR, "memfd_create");
+        return -1;
+    }
+
+    /* Consumers map the whole file, it must not change size under them */
+    if (ftruncate(fd, size) == -1) {
+        serverLogErrno(LL_ERROR, "Can't size %s", name);
+        close(fd);
+        return -1;
+    }
+
+    *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*map == MAP_FAILED) {
+        serverLogErrno(LL_ERROR, "mmap");
+        close(fd);
+        return -1;
+    }
+
+    /* A write seal keeps the mapping above writable, later ones are not */
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL |
+              seals) == -1) {
+        serverLogErrno(LL_ERROR, "Can't seal %s", name);
+        munmap(*map, size);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void _shmRingAppend(shmRing *r, const void *frame, size_t len,
+                           uint32_t flags)
+{
+    uint64_t recsize = RING_RECORD_SIZE(len);
+    uint64_t off = r->head & (r->size - 1);
+    uint64_t skip = off + recsize > r->size ? r->size - off : 0;
+    ringRecord *rec;
+
+    /* Consumers reading what is about to be overwritten must notice */
+    __atomic_store_n(&r->hdr->reserve, r->head + skip + recsize,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (skip) {
+        rec = (ringRecord*)(r->data + off);
+        rec->len = RING_WRAP;
+        rec->flags = 0;
+        r->head += skip;
+        off = 0;
+    }
+
+    rec = (ringRecord*)(r->data + off);
+    rec->len = len;
+    rec->flags = flags;
+    memcpy(rec + 1, frame, len);
+
+    r->head += recsize;
+    r->records++;
+}
+
+shmRing *shmRingCreate(size_t size)
+{
+    shmRing *r;
+    size_t total;
+    void *map;
+
+    r = calloc(1, sizeof(*r));
+    if (!r) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+    r->fd = -1;
+    r->wait_fd = -1;
+
+    r->size = RING_MIN_SIZE;
+    while (r->size < size && r->size < RING_MAX_SIZE) {
+        r->size *= 2;
+    }
+    total = RING_HEADER_SIZE + r->size;
+
+    r->fd = _shmRingMemfd("sproxy-ring", total, F_SEAL_FUTURE_WRITE, &map);
+    if (r->fd == -1) {
+        goto err;
+    }
+
+    r->hdr = map;
+    r->data = (unsigned char*)map + RING_HEADER_SIZE;
+    r->hdr->magic = RING_MAGIC;
+    r->hdr->version = RING_VERSION;
+    r->hdr->size = r->size;
+
+    r->wait_fd = _shmRingMemfd("sproxy-ring-wait", RING_WAIT_SIZE, 0, &map);
+    if (r->wait_fd == -1) {
+        goto err;
+    }
+    r->wait = map;
+
+    return r;
+
+err:
+    shmRingFree(r);
+    return NULL;
+}
+
+void shmRingFree(shmRing *r)
+{
+    if (!r) {
+        return;
+    }
+
+    if (r->hdr) {
+        munmap(r->hdr, RING_HEADER_SIZE + r->size);
+    }
+    if (r->fd != -1) {
+        close(r->fd);
+    }
+    if (r->wait) {
+        munmap(r->wait, RING_WAIT_SIZE);
+    }
+    if (r->wait_fd != -1) {
+        close(r->wait_fd);
+    }
+    free(r);
+}
+
+void shmRingWrite(shmRing *r, const struct iovec *iov,
+                  const unsigned char *flags, int iovcnt)
+{
+    int j;
+
+    for (j = 0; j < iovcnt; j++) {
+        if (RING_RECORD_SIZE(iov[j].iov_len) > r->size) {
+            r->drops++;
+            continue;
+        }
+        _shmRingAppend(r, iov[j].iov_base, iov[j].iov_len,
+                       flags ? flags[j] : 0);
+    }
+
+    __atomic_store_n(&r->hdr->head, r->head, __ATOMIC_RELEASE);
+
+    /* Pairs with the consumer registering in waiters before it rechecks
+     * head, only pay for a syscall when somebody sleeps */
+    __atomic_add_fetch(&r->wait->futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->wait->waiters, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &r->wait->futex, FUTEX_WAKE, INT_MAX,
+                NULL, NULL, 0);
+        r->wakeups++;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include "ring.h"
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+typedef struct shmRing {
+    int fd;                            /* memfd handed out to consumers,
+                                          sealed against writes */
+    int wait_fd;                       /* memfd of wait, writable by them */
+    ringHeader *hdr;                   /* Shared mapping */
+    ringWait *wait;                    /* Shared mapping of wait_fd */
+    unsigned char *data;               /* Data area */
+    uint64_t size;                     /* Size of the data area */
+    uint64_t head;                     /* Producer position */
+    unsigned long long records;        /* Records published */
+    unsigned long long drops;          /* Frames larger than the ring */
+    unsigned long long wakeups;        /* futex wakeups issued */
+} shmRing;
+
+/**
+ * @brief Create a ring in a sealed memfd, and its futex in another one.
+ *
+ * @param[in] size - Size of the data area, rounded up to a power of two
+ *
+ * @return Pointer to a newly allocated ring, or NULL on error
+ */
+shmRing *shmRingCreate(size_t size);
+
+/**
+ * @brief Unmap and close a ring. Consumers keep their own mapping.
+ *
+ * @param[in] r - Ring
+ */
+void shmRingFree(shmRing *r);
+
+/**
+ * @brief Publish frames, one record each, then wake sleeping consumers
+ *        once for the whole batch.
+ *
+ * @param[in] r - Ring
+ * @param[in] iov - Frames
+ * @param[in] flags - RING_FLAG_* of each frame, or NULL
+ * @param[in] iovcnt - Number of frames
+ */
+void shmRingWrite(shmRing *r, const struct iovec *iov,
+                  const unsigned char *flags, int iovcnt);
+
+#endif
@@ -0,0 +1,228 @@
+#include "server.h"
+#include "spill.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define SPILL_CHUNK_MASK ((uint64_t)SPILL_CHUNK - 1)
+
+typedef void spillRangeProc(spill *s, size_t off, size_t len);
+
+/**
+ * @brief Call a function on the parts of the file holding a range of
+ *        positions, split where the ring wraps.
+ *
+ * @param[in] s - Spill
+ * @param[in] from - First position
+ * @param[in] to - Position past the last one
+ * @param[in] proc - Called with a file offset and a length
+ */
+static void _spillRange(spill *s, uint64_t from, uint64_t to,
+                        spillRangeProc *proc);
+
+/**
+ * @brief Start write back of a part of the file and drop it from memory.
+ */
+static void _spillWriteBack(spill *s, size_t off, size_t len);
+
+/**
+ * @brief Drop a part of the file from memory.
+ */
+static void _spillRelease(spill *s, size_t off, size_t len);
+
+/**
+ * @brief Start reading a part of the file from the disk.
+ */
+static void _spillReadAhead(spill *s, size_t off, size_t len);
+
+static void _spillRange(spill *s, uint64_t from, uint64_t to,
+                        spillRangeProc *proc)
+{
+    size_t off;
+    size_t len;
+
+    while (from < to) {
+        off = from % s->size;
+        len = to - from;
+        if (len > s->size - off) {
+            len = s->size - off;
+        }
+
+        proc(s, off, len);
+        from += len;
+    }
+}
+
+static void _spillWriteBack(spill *s, size_t off, size_t len)
+{
+    /* Dirty pages stay in the page cache when unmapped, nothing is lost */
+    if (sync_file_range(s->fd, off, len, SYNC_FILE_RANGE_WRITE) == -1) {
+        serverLogErrno(LL_WARN, "sync_file_range %s", s->path);
+    }
+    madvise(s->map + off, len, MADV_DONTNEED);
+}
+
+static void _spillRelease(spill *s, size_t off, size_t len)
+{
+    madvise(s->map + off, len, MADV_DONTNEED);
+}
+
+static void _spillReadAhead(spill *s, size_t off, size_t len)
+{
+    madvise(s->map + off, len, MADV_WILLNEED);
+}
+
+spill *spillCreate(const char *dir, const char *name, size_t size)
+{
+    const char *base = strrchr(name, '/');
+    spill *s;
+    int ret;
+
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+
+    s->fd = -1;
+    s->size = (size + SPILL_CHUNK - 1) & ~(size_t)SPILL_CHUNK_MASK;
+
+    ret = snprintf(s->path, sizeof(s->path), "%s/%s.spill", dir,
+                   base ? base + 1 : name);
+    if (ret < 0 || (size_t)ret >= sizeof(s->path)) {
+        serverLog(LL_ERROR, "Spill path too long in %s", dir);
+        free(s);
+        return NULL;
+    }
+
+    s->fd = open(s->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (s->fd == -1) {
+        serverLogErrno(LL_ERROR, "Can't create spill %s", s->path);
+        free(s);
+        return NULL;
+    }
+
+    /* Blocks are reserved now, a full disk would otherwise be a SIGBUS */
+    ret = posix_fallocate(s->fd, 0, s->size);
+    if (ret != 0) {
+        errno = ret;
+        serverLogErrno(LL_ERROR, "Can't allocate spill %s", s->path);
+        goto err;
+    }
+
+    s->map = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        s->map = NULL;
+        serverLogErrno(LL_ERROR, "Can't map spill %s", s->path);
+        goto err;
+    }
+
+    madvise(s->map, s->size, MADV_SEQUENTIAL);
+
+    return s;
+
+err:
+    spillFree(s);
+    return NULL;
+}
+
+void spillFree(spill *s)
+{
+    if (!s) {
+        return;
+    }
+
+    if (s->map) {
+        munmap(s->map, s->size);
+    }
+
+    if (s->fd != -1) {
+        close(s->fd);
+        unlink(s->path);
+    }
+
+    free(s);
+}
+
+int spillAppend(spill *s, const void *data, size_t len)
+{
+    size_t off = s->head % s->size;
+    size_t part = s->size - off < len ? s->size - off : len;
+    uint64_t end;
+
+    if (len > s->size - spillPending(s)) {
+        s->drops += len;
+        return C_ERR;
+    }
+
+    memcpy(s->map + off, data, part);
+    memcpy(s->map, (const char*)data + part, len - part);
+
+    s->head += len;
+    s->bytes += len;
+    if (spillPending(s) > s->peak) {
+        s->peak = spillPending(s);
+    }
+
+    /* Complete chunks go to the disk and leave the mapping. The chunk being
+     * appended to is left alone: writing to a page under write back waits
+     * for the disk */
+    end = s->head & ~SPILL_CHUNK_MASK;
+    if (end > s->synced) {
+        _spillRange(s, s->synced, end, _spillWriteBack);
+        s->synced = end;
+    }
+
+    return C_OK;
+}
+
+ssize_t spillDrain(spill *s, int fd)
+{
+    size_t off = s->tail % s->size;
+    size_t len = spillPending(s);
+    uint64_t end;
+    ssize_t nwrite;
+
+    if (len > s->size - off) {
+        len = s->size - off;
+    }
+
+    /* Keep the next chunk on its way from the disk, the event loop should
+     * not wait for it. Chunks not written back yet are still mapped */
+    end = (s->tail & ~SPILL_CHUNK_MASK) + 2 * SPILL_CHUNK;
+    if (end > s->synced) {
+        end = s->synced;
+    }
+    if (s->ahead < s->tail) {
+        s->ahead = s->tail & ~SPILL_CHUNK_MASK;
+    }
+    if (end > s->ahead) {
+        _spillRange(s, s->ahead, end, _spillReadAhead);
+        s->ahead = end;
+    }
+
+    nwrite = write(fd, s->map + off, len);
+    if (nwrite <= 0) {
+        return nwrite;
+    }
+
+    s->tail += nwrite;
+
+    end = s->tail & ~SPILL_CHUNK_MASK;
+    if (end > s->released) {
+        _spillRange(s, s->released, end, _spillRelease);
+        s->released = end;
+    }
+
+    return nwrite;
+}
+
+void spillClear(spill *s)
+{
+    s->tail = s->head;
+    s->released = s->tail & ~SPILL_CHUNK_MASK;
+    s->ahead = s->released;
+
+    madvise(s->map, s->size, MADV_DONTNEED);
+}
@@ -0,0 +1,82 @@
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <linux/limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Overflow of a virtual on disk. The file is pre-allocated, mapped whole and
+ * used as a ring: bytes are appended at head and written to the consumer
+ * from tail, in order. Pages are dropped from the mapping once they are
+ * handed to write back or consumed, so the daemon does not grow with what
+ * is spilled. */
+
+#define SPILL_DEFAULT_SIZE     (64*1024*1024)
+#define SPILL_MIN_SIZE         (1024*1024)
+#define SPILL_CHUNK            (256*1024)  /* Write back and read ahead unit */
+
+typedef struct spill {
+    char path[PATH_MAX];               /* Spill file */
+    int fd;
+    unsigned char *map;                /* Whole file mapping */
+    size_t size;                       /* Ring size, a multiple of pages */
+    uint64_t head;                     /* Position of the next byte stored */
+    uint64_t tail;                     /* Position of the next byte drained */
+    uint64_t synced;                   /* Stored bytes handed to write back */
+    uint64_t released;                 /* Drained bytes dropped from memory */
+    uint64_t ahead;                    /* Bytes asked to be read ahead */
+    unsigned long long bytes;          /* Bytes stored */
+    unsigned long long drops;          /* Bytes that did not fit */
+    size_t peak;                       /* Largest number of pending bytes */
+} spill;
+
+#define spillPending(s) ((size_t)((s)->head - (s)->tail))
+
+/**
+ * @brief Create and map a spill file.
+ *
+ * @param[in] dir - Directory to create it in
+ * @param[in] name - Virtual device path, its base name names the file
+ * @param[in] size - Bytes the spill may hold
+ *
+ * @return Pointer to a newly allocated spill, or NULL on error
+ */
+spill *spillCreate(const char *dir, const char *name, size_t size);
+
+/**
+ * @brief Unmap and remove the spill file and free the spill.
+ *
+ * @param[in] s - Spill
+ */
+void spillFree(spill *s);
+
+/**
+ * @brief Store bytes after the pending ones, whole or not at all.
+ *
+ * @param[in] s - Spill
+ * @param[in] data - Bytes to store
+ * @param[in] len - Number of bytes
+ *
+ * @return C_OK if stored, C_ERR if there is no room (counted in drops)
+ */
+int spillAppend(spill *s, const void *data, size_t len);
+
+/**
+ * @brief Write pending bytes to a descriptor, as much as one write() takes.
+ *
+ * @param[in] s - Spill
+ * @param[in] fd - Descriptor to write to
+ *
+ * @return Result of write()
+ */
+ssize_t spillDrain(spill *s, int fd);
+
+/**
+ * @brief Forget the pending bytes.
+ *
+ * @param[in] s - Spill
+ */
+void spillClear(spill *s);
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef SPROXY_H
+#define SPROXY_H
+
+/* libsproxy - read the frames of a sproxyd master from its shared memory
+ * ring, without a read() per frame. Configure the master with
+ * `shm-listen = <path>` and open that path.
+ *
+ *     sproxy_ring *r = sproxy_open("/run/sproxy/ttyS5.ring");
+ *     const void *frame;
+ *     size_t len;
+ *
+ *     for (;;) {
+ *         while (sproxy_next(r, &frame, &len, NULL) == 1) {
+ *             use(frame, len);
+ *             if (sproxy_done(r) != 0) {
+ *                 discard what use() did, the frame was overwritten
+ *             }
+ *         }
+ *         sproxy_wait(r, -1);
+ *     }
+ *
+ * Frames are returned in place (zero copy). The producer never waits for
+ * consumers, a consumer that falls more than the ring size behind loses
+ * frames and resumes at the newest one. */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sproxy_ring sproxy_ring;
+
+/* Flags returned by sproxy_next() */
+#define SPROXY_FLAG_CORRUPT (1)    /* Frame failed checksum validation */
+
+/**
+ * @brief Connect to a ring socket and map the ring. Reading starts with
+ *        the next published frame.
+ *
+ * @param[in] path - Unix socket configured with shm-listen
+ *
+ * @return Ring handle, or NULL with errno set
+ */
+sproxy_ring *sproxy_open(const char *path);
+
+/**
+ * @brief Unmap the ring and release the handle.
+ *
+ * @param[in] r - Ring handle
+ */
+void sproxy_close(sproxy_ring *r);
+
+/**
+ * @brief Return the next frame.
+ *
+ * @param[in] r - Ring handle
+ * @param[out] frame - Start of frame, inside the ring
+ * @param[out] len - Length of frame
+ * @param[out] flags - SPROXY_FLAG_* or NULL
+ *
+ * @return 1 if a frame was returned, 0 if none is pending, -1 if frames
+ *         were lost (reading resumes at the newest frame)
+ */
+int sproxy_next(sproxy_ring *r, const void **frame, size_t *len,
+                unsigned *flags);
+
+/**
+ * @brief Check that the frame returned by the last sproxy_next() was not
+ *        overwritten while it was used.
+ *
+ * @param[in] r - Ring handle
+ *
+ * @return 0 if the frame was intact, -1 if it must be discarded
+ */
+int sproxy_done(sproxy_ring *r);
+
+/**
+ * @brief Sleep until a frame is published.
+ *
+ * @param[in] r - Ring handle
+ * @param[in] timeout_ms - Timeout in milliseconds, -1 to wait forever
+ *
+ * @return 1 if frames are pending, 0 on timeout or signal
+ */
+int sproxy_wait(sproxy_ring *r, int timeout_ms);
+
+/**
+ * @brief Return the number of times frames were lost by falling behind.
+ *
+ * @param[in] r - Ring handle
+ */
+unsigned long long sproxy_overruns(const sproxy_ring *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "config.h"
+
+/* Static tracepoints of the sproxyd provider, for bpftrace, perf or
+ * SystemTap. Built with <sys/sdt.h>, each is a nop with an ELF note saying
+ * where its arguments live, and nothing runs until a tracer attaches. The
+ * arguments are still computed, keep them to values already at hand.
+ * Without <sys/sdt.h> the macros expand to nothing. Scripts using them are
+ * in tools/bpftrace. */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define TRACE1(name, a) DTRACE_PROBE1(sproxyd, name, a)
+#define TRACE2(name, a, b) DTRACE_PROBE2(sproxyd, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(sproxyd, name, a, b, c)
+#define TRACE4(name, a, b, c, d) DTRACE_PROBE4(sproxyd, name, a, b, c, d)
+#define TRACE5(name, a, b, c, d, e) \
+    DTRACE_PROBE5(sproxyd, name, a, b, c, d, e)
+
+#else
+
+#define TRACE1(name, a) do { } while (0)
+#define TRACE2(name, a, b) do { } while (0)
+#define TRACE3(name, a, b, c) do { } while (0)
+#define TRACE4(name, a, b, c, d) do { } while (0)
+#define TRACE5(name, a, b, c, d, e) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,722 @@
+#include "server.h"
+#include "transform.h"
+
+#include <stdint.h>
+
+#define SLIP_END      (0xC0)
+#define SLIP_ESC      (0xDB)
+#define SLIP_ESC_END  (0xDC)
+#define SLIP_ESC_ESC  (0xDD)
+
+/* 16 byte vectors through the GCC vector extensions, SSE2 on x86-64 and
+ * NEON on arm64. Kernels test a block at a time and copy it whole when
+ * there is nothing to change in it, the common case. */
+typedef unsigned char transformVec __attribute__((vector_size(16)));
+
+#define TRANSFORM_VEC ((size_t)sizeof(transformVec))
+
+typedef void transformProc(transformChain *c, transformStage *st,
+                           const unsigned char *in, size_t len,
+                           transformBuf *out);
+
+static const char *stage_names[] = {
+    "crlf",
+    "lf",
+    "strip-nonprint",
+    "hex",
+    "base64",
+    "slip",
+    "cobs",
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const char base64_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/**
+ * @brief Load a block, unaligned.
+ */
+static inline transformVec _transformLoad(const unsigned char *p);
+
+/**
+ * @brief Return non-zero if any byte of a comparison result is set.
+ */
+static inline int _transformAny(transformVec m);
+
+/**
+ * @brief Make room for len more bytes in a buffer.
+ */
+static void _transformReserve(transformBuf *b, size_t len);
+
+/**
+ * @brief End the current packet of a buffer at its current length.
+ */
+static void _transformEnd(transformBuf *b);
+
+/**
+ * @brief Append a packet to a buffer.
+ */
+static void _transformPacket(transformBuf *b, const unsigned char *data,
+                             size_t len);
+
+/**
+ * @brief Rewrite the line endings of bytes, to CRLF or LF.
+ *
+ * @param[in] st - Stage, keeps whether the last byte was a CR
+ * @param[in] in - Bytes
+ * @param[in] len - Number of bytes
+ * @param[out] o - Where to write, room for 2 * len bytes
+ * @param[in] crlf - 1 for CRLF, 0 for LF
+ *
+ * @return End of the written bytes
+ */
+static unsigned char *_transformLineBytes(transformStage *st,
+                                          const unsigned char *in, size_t len,
+                                          unsigned char *o, int crlf);
+
+/**
+ * @brief Rewrite the line endings of a packet, a block at a time.
+ */
+static void _transformLines(transformStage *st, const unsigned char *in,
+                            size_t len, transformBuf *out, int crlf);
+
+/**
+ * @brief Copy the bytes to keep, printable ASCII, tab, CR and LF.
+ *
+ * @return End of the written bytes
+ */
+static unsigned char *_transformStripBytes(const unsigned char *in, size_t len,
+                                           unsigned char *o);
+
+/**
+ * @brief Add a byte to the packet being decoded, or mark it too large.
+ */
+static inline void _transformPush(transformStage *st, unsigned char c);
+
+/**
+ * @brief Emit the packet being decoded, if valid, and start the next one.
+ */
+static void _transformSlipPacket(transformChain *c, transformStage *st,
+                                 transformBuf *out);
+
+/**
+ * @brief Decode the COBS packet being gathered, emit it if valid and start
+ *        the next one.
+ */
+static void _transformCobsPacket(transformChain *c, transformStage *st,
+                                 transformBuf *out);
+
+/* Stages, each writes the packets it makes out of one packet of input */
+static void _transformCrlf(transformChain *c, transformStage *st,
+                           const unsigned char *in, size_t len,
+                           transformBuf *out);
+static void _transformLf(transformChain *c, transformStage *st,
+                         const unsigned char *in, size_t len,
+                         transformBuf *out);
+static void _transformStrip(transformChain *c, transformStage *st,
+                            const unsigned char *in, size_t len,
+                            transformBuf *out);
+static void _transformHex(transformChain *c, transformStage *st,
+                          const unsigned char *in, size_t len,
+                          transformBuf *out);
+static void _transformBase64(transformChain *c, transformStage *st,
+                             const unsigned char *in, size_t len,
+                             transformBuf *out);
+static void _transformSlip(transformChain *c, transformStage *st,
+                           const unsigned char *in, size_t len,
+                           transformBuf *out);
+static void _transformCobs(transformChain *c, transformStage *st,
+                           const unsigned char *in, size_t len,
+                           transformBuf *out);
+
+static transformProc *stage_procs[] = {
+    _transformCrlf,
+    _transformLf,
+    _transformStrip,
+    _transformHex,
+    _transformBase64,
+    _transformSlip,
+    _transformCobs,
+};
+
+/**
+ * @brief Run one input buffer through every stage, the result is appended
+ *        to c->out.
+ *
+ * @param[in] c - Chain
+ * @param[in] data - Input buffer
+ * @param[in] len - Length of input buffer
+ */
+static void _transformRun(transformChain *c, const unsigned char *data,
+                          size_t len);
+
+static inline transformVec _transformLoad(const unsigned char *p)
+{
+    transformVec v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline int _transformAny(transformVec m)
+{
+    uint64_t w[2];
+
+    memcpy(w, &m, sizeof(w));
+    return (w[0] | w[1]) != 0;
+}
+
+static void _transformReserve(transformBuf *b, size_t len)
+{
+    size_t size = b->size ? b->size : BUFSIZ;
+    unsigned char *data;
+
+    if (b->data && b->len + len <= b->size) {
+        return;
+    }
+
+    while (size < b->len + len) {
+        size *= 2;
+    }
+
+    data = realloc(b->data, size);
+    if (!data) {
+        serverLog(LL_ERROR, "realloc failed");
+        exit(1);
+    }
+
+    b->data = data;
+    b->size = size;
+}
+
+static void _transformEnd(transformBuf *b)
+{
+    size_t *ends;
+    int size;
+
+    if (b->nends == b->endsize) {
+        size = b->endsize ? b->endsize * 2 : 16;
+        ends = realloc(b->ends, size * sizeof(*ends));
+        if (!ends) {
+            serverLog(LL_ERROR, "realloc failed");
+            exit(1);
+        }
+        b->ends = ends;
+        b->endsize = size;
+    }
+
+    b->ends[b->nends++] = b->len;
+}
+
+static void _transformPacket(transformBuf *b, const unsigned char *data,
+                             size_t len)
+{
+    _transformReserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    _transformEnd(b);
+}
+
+static unsigned char *_transformLineBytes(transformStage *st,
+                                          const unsigned char *in, size_t len,
+                                          unsigned char *o, int crlf)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (in[i] == '\r') {
+            if (crlf) {
+                *o++ = '\r';
+            }
+            *o++ = '\n';
+            st->cr = 1;
+        } else if (in[i] == '\n') {
+            /* The second half of a CRLF, already written */
+            if (!st->cr) {
+                if (crlf) {
+                    *o++ = '\r';
+                }
+                *o++ = '\n';
+            }
+            st->cr = 0;
+        } else {
+            *o++ = in[i];
+            st->cr = 0;
+        }
+    }
+
+    return o;
+}
+
+static void _transformLines(transformStage *st, const unsigned char *in,
+                            size_t len, transformBuf *out, int crlf)
+{
+    unsigned char *o;
+    transformVec v;
+    size_t i;
+
+    _transformReserve(out, 2 * len);
+    o = out->data + out->len;
+
+    for (i = 0; i + TRANSFORM_VEC <= len; i += TRANSFORM_VEC) {
+        v = _transformLoad(in + i);
+        if (!_transformAny((transformVec)((v == '\r') | (v == '\n')))) {
+            memcpy(o, in + i, TRANSFORM_VEC);
+            o += TRANSFORM_VEC;
+            st->cr = 0;
+            continue;
+        }
+        o = _transformLineBytes(st, in + i, TRANSFORM_VEC, o, crlf);
+    }
+
+    o = _transformLineBytes(st, in + i, len - i, o, crlf);
+
+    out->len = o - out->data;
+    _transformEnd(out);
+}
+
+static void _transformCrlf(transformChain *c, transformStage *st,
+                           const unsigned char *in, size_t len,
+                           transformBuf *out)
+{
+    (void) c;
+
+    _transformLines(st, in, len, out, 1);
+}
+
+static void _transformLf(transformChain *c, transformStage *st,
+                         const unsigned char *in, size_t len,
+                         transformBuf *out)
+{
+    (void) c;
+
+    _transformLines(st, in, len, out, 0);
+}
+
+static unsigned char *_transformStripBytes(const unsigned char *in, size_t len,
+                                           unsigned char *o)
+{
+    size_t i;
+
+    /* Branchless, binary input keeps a byte out of two at random */
+    for (i = 0; i < len; i++) {
+        *o = in[i];
+        o += (in[i] >= 0x20 && in[i] < 0x7f) ||
+             in[i] == '\t' || in[i] == '\r' || in[i] == '\n';
+    }
+
+    return o;
+}
+
+static void _transformStrip(transformChain *c, transformStage *st,
+                            const unsigned char *in, size_t len,
+                            transformBuf *out)
+{
+    unsigned char *o;
+    transformVec v;
+    transformVec keep;
+    size_t i;
+
+    (void) c;
+    (void) st;
+
+    _transformReserve(out, len);
+    o = out->data + out->len;
+
+    for (i = 0; i + TRANSFORM_VEC <= len; i += TRANSFORM_VEC) {
+        v = _transformLoad(in + i);
+        keep = (transformVec)(((v >= 0x20) & (v < 0x7f)) | (v == '\t') |
+                              (v == '\r') | (v == '\n'));
+        if (!_transformAny(~keep)) {
+            memcpy(o, in + i, TRANSFORM_VEC);
+            o += TRANSFORM_VEC;
+            continue;
+        }
+        o = _transformStripBytes(in + i, TRANSFORM_VEC, o);
+    }
+
+    o = _transformStripBytes(in + i, len - i, o);
+
+    out->len = o - out->data;
+    _transformEnd(out);
+}
+
+static void _transformHex(transformChain *c, transformStage *st,
+                          const unsigned char *in, size_t len,
+                          transformBuf *out)
+{
+    unsigned char *o;
+    size_t i;
+
+    (void) c;
+    (void) st;
+
+    _transformReserve(out, 2 * len + 1);
+    o = out->data + out->len;
+
+    for (i = 0; i < len; i++) {
+        *o++ = hex_digits[in[i] >> 4];
+        *o++ = hex_digits[in[i] & 0x0f];
+    }
+    *o++ = '\n';
+
+    out->len = o - out->data;
+    _transformEnd(out);
+}
+
+static void _transformBase64(transformChain *c, transformStage *st,
+                             const unsigned char *in, size_t len,
+                             transformBuf *out)
+{
+    unsigned char *o;
+    uint32_t w;
+    size_t i;
+
+    (void) c;
+    (void) st;
+
+    _transformReserve(out, (len + 2) / 3 * 4 + 1);
+    o = out->data + out->len;
+
+    for (i = 0; i + 3 <= len; i += 3) {
+        w = (uint32_t)in[i] << 16 | (uint32_t)in[i + 1] << 8 | in[i + 2];
+        o[0] = base64_digits[w >> 18];
+        o[1] = base64_digits[(w >> 12) & 0x3f];
+        o[2] = base64_digits[(w >> 6) & 0x3f];
+        o[3] = base64_digits[w & 0x3f];
+        o += 4;
+    }
+
+    if (i < len) {
+        w = (uint32_t)in[i] << 16;
+        if (i + 1 < len) {
+            w |= (uint32_t)in[i + 1] << 8;
+        }
+        o[0] = base64_digits[w >> 18];
+        o[1] = base64_digits[(w >> 12) & 0x3f];
+        o[2] = i + 1 < len ? base64_digits[(w >> 6) & 0x3f] : '=';
+        o[3] = '=';
+        o += 4;
+    }
+    *o++ = '\n';
+
+    out->len = o - out->data;
+    _transformEnd(out);
+}
+
+static inline void _transformPush(transformStage *st, unsigned char c)
+{
+    if (st->pktlen == TRANSFORM_MAX_PACKET) {
+        st->overflow = 1;
+        return;
+    }
+
+    st->pkt[st->pktlen++] = c;
+}
+
+static void _transformSlipPacket(transformChain *c, transformStage *st,
+                                 transformBuf *out)
+{
+    if (st->overflow) {
+        c->packet_drops++;
+    } else if (st->pktlen) {
+        _transformPacket(out, st->pkt, st->pktlen);
+    }
+
+    st->pktlen = 0;
+    st->overflow = 0;
+    st->esc = 0;
+}
+
+static void _transformSlip(transformChain *c, transformStage *st,
+                           const unsigned char *in, size_t len,
+                           transformBuf *out)
+{
+    transformVec v;
+    size_t i = 0;
+
+    while (i < len) {
+        /* Nothing special in the block, it is all payload */
+        if (!st->esc && i + TRANSFORM_VEC <= len &&
+            st->pktlen + TRANSFORM_VEC <= TRANSFORM_MAX_PACKET) {
+            v = _transformLoad(in + i);
+            if (!_transformAny((transformVec)((v == SLIP_END) |
+                                              (v == SLIP_ESC)))) {
+                memcpy(st->pkt + st->pktlen, in + i, TRANSFORM_VEC);
+                st->pktlen += TRANSFORM_VEC;
+                i += TRANSFORM_VEC;
+                continue;
+            }
+        }
+
+        if (st->esc) {
+            st->esc = 0;
+            _transformPush(st, in[i] == SLIP_ESC_END ? SLIP_END :
+                               in[i] == SLIP_ESC_ESC ? SLIP_ESC : in[i]);
+        } else if (in[i] == SLIP_END) {
+            _transformSlipPacket(c, st, out);
+        } else if (in[i] == SLIP_ESC) {
+            st->esc = 1;
+        } else {
+            _transformPush(st, in[i]);
+        }
+        i++;
+    }
+}
+
+static void _transformCobsPacket(transformChain *c, transformStage *st,
+                                 transformBuf *out)
+{
+    const unsigned char *p = st->pkt;
+    size_t n = st->pktlen;
+    unsigned char *o;
+    size_t i = 0;
+    size_t code;
+
+    st->pktlen = 0;
+
+    if (st->overflow) {
+        st->overflow = 0;
+        c->packet_drops++;
+        return;
+    }
+
+    if (!n) {
+        return;
+    }
+
+    /* Decoding never grows a packet */
+    _transformReserve(out, n);
+    o = out->data + out->len;
+
+    while (i < n) {
+        code = p[i++];
+        if (i + code - 1 > n) {
+            c->packet_drops++;
+            return;
+        }
+
+        memcpy(o, p + i, code - 1);
+        o += code - 1;
+        i += code - 1;
+
+        if (code != 0xff && i < n) {
+            *o++ = 0;
+        }
+    }
+
+    out->len = o - out->data;
+    _transformEnd(out);
+}
+
+static void _transformCobs(transformChain *c, transformStage *st,
+                           const unsigned char *in, size_t len,
+                           transformBuf *out)
+{
+    const unsigned char *zero;
+    size_t i = 0;
+    size_t n;
+
+    /* memchr() is vectorized already */
+    while (i < len) {
+        zero = memchr(in + i, 0, len - i);
+        n = zero ? (size_t)(zero - in) - i : len - i;
+
+        if (st->pktlen + n > TRANSFORM_MAX_PACKET) {
+            st->overflow = 1;
+        } else {
+            memcpy(st->pkt + st->pktlen, in + i, n);
+            st->pktlen += n;
+        }
+        i += n;
+
+        if (zero) {
+            _transformCobsPacket(c, st, out);
+            i++;
+        }
+    }
+}
+
+transformChain *transformCreate(const char *spec)
+{
+    transformChain *c;
+    transformStage *st;
+    char *str;
+    char *token;
+    char *save;
+    size_t used = 0;
+    int type;
+
+    c = calloc(1, sizeof(*c));
+    if (!c) {
+        serverLog(LL_ERROR, "calloc failed");
+        exit(1);
+    }
+
+    str = strdup(spec);
+    if (!str) {
+        serverLog(LL_ERROR, "strdup failed");
+        exit(1);
+    }
+
+    for (token = strtok_r(str, " ,", &save); token;
+         token = strtok_r(NULL, " ,", &save)) {
+        for (type = 0;
+             type < (int)(sizeof(stage_names)/sizeof(stage_names[0]));
+             type++) {
+            if (!strcasecmp(token, stage_names[type])) {
+                break;
+            }
+        }
+
+        if (type == (int)(sizeof(stage_names)/sizeof(stage_names[0]))) {
+            serverLog(LL_ERROR, "Unknown transform: %s", token);
+            goto err;
+        }
+
+        if (c->nstages == TRANSFORM_MAX_STAGES) {
+            serverLog(LL_ERROR, "More than %d transforms: %s",
+                      TRANSFORM_MAX_STAGES, spec);
+            goto err;
+        }
+
+        st = &c->stages[c->nstages++];
+        st->type = type;
+
+        if (type == TRANSFORM_SLIP || type == TRANSFORM_COBS) {
+            st->pkt = malloc(TRANSFORM_MAX_PACKET);
+            if (!st->pkt) {
+                serverLog(LL_ERROR, "malloc failed");
+                exit(1);
+            }
+        }
+
+        used += snprintf(c->spec + used, sizeof(c->spec) - used, "%s%s",
+                         used ? "," : "", stage_names[type]);
+    }
+
+    free(str);
+
+    if (!c->nstages) {
+        serverLog(LL_ERROR, "Empty transform list");
+        transformFree(c);
+        return NULL;
+    }
+
+    return c;
+
+err:
+    free(str);
+    transformFree(c);
+    return NULL;
+}
+
+void transformFree(transformChain *c)
+{
+    int j;
+
+    if (!c) {
+        return;
+    }
+
+    for (j = 0; j < c->nstages; j++) {
+        free(c->stages[j].pkt);
+    }
+
+    for (j = 0; j < 2; j++) {
+        free(c->buf[j].data);
+        free(c->buf[j].ends);
+    }
+
+    free(c->out.data);
+    free(c->out.ends);
+    free(c->iov);
+    free(c->src);
+    free(c);
+}
+
+static void _transformRun(transformChain *c, const unsigned char *data,
+                          size_t len)
+{
+    transformStage *st;
+    transformBuf *src = NULL;
+    transformBuf *dst;
+    size_t start;
+    int k;
+    int j;
+
+    for (k = 0; k < c->nstages; k++) {
+        st = &c->stages[k];
+
+        /* The last stage writes the output */
+        if (k == c->nstages - 1) {
+            dst = &c->out;
+        } else {
+            dst = &c->buf[k & 1];
+            dst->len = 0;
+            dst->nends = 0;
+        }
+
+        if (!src) {
+            stage_procs[st->type](c, st, data, len, dst);
+        } else {
+            for (j = 0, start = 0; j < src->nends; j++) {
+                stage_procs[st->type](c, st, src->data + start,
+                                      src->ends[j] - start, dst);
+                start = src->ends[j];
+            }
+        }
+
+        src = dst;
+    }
+}
+
+const struct iovec *transformApply(transformChain *c, const struct iovec *iov,
+                                   int iovcnt)
+{
+    struct iovec *tmp;
+    int *src;
+    size_t start;
+    int size;
+    int k;
+    int j;
+
+    c->out.len = 0;
+    c->out.nends = 0;
+
+    for (j = 0, k = 0; j < iovcnt; j++) {
+        _transformRun(c, iov[j].iov_base, iov[j].iov_len);
+        c->in_bytes += iov[j].iov_len;
+
+        if (c->out.nends > c->iovsize) {
+            size = c->out.endsize;
+            tmp = realloc(c->iov, size * sizeof(*tmp));
+            src = realloc(c->src, size * sizeof(*src));
+            if (!tmp || !src) {
+                serverLog(LL_ERROR, "realloc failed");
+                exit(1);
+            }
+            c->iov = tmp;
+            c->src = src;
+            c->iovsize = size;
+        }
+
+        for (; k < c->out.nends; k++) {
+            c->src[k] = j;
+        }
+    }
+
+    /* out may have moved while growing, point at it once it is complete */
+    for (k = 0, start = 0; k < c->out.nends; k++) {
+        c->iov[k].iov_base = c->out.data + start;
+        c->iov[k].iov_len = c->out.ends[k] - start;
+        start = c->out.ends[k];
+    }
+
+    c->iovcnt = c->out.nends;
+    c->len = c->out.len;
+    c->out_bytes += c->out.len;
+
+    return c->iov;
+}
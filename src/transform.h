@@ -0,0 +1,102 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/* A chain of byte transformations applied to what a master sends to a
+ * virtual, ie. "crlf,strip-nonprint" or "slip,base64". Each buffer given to
+ * the chain (a frame, or a read chunk on raw masters) goes through every
+ * stage in turn and comes out as the packets of the last stage: one,
+ * possibly empty, unless a decoder (slip, cobs) turns the stream into
+ * none or several. Stages see the packets of the previous one, encoders
+ * (hex, base64) put each packet on a line of its own. Stages keep their
+ * state from one buffer to the next, a chain must see the whole stream. */
+
+#define TRANSFORM_MAX_STAGES  (8)
+#define TRANSFORM_MAX_PACKET  (65536)  /* Larger decoded packets are dropped */
+
+/* Stages */
+enum {
+    TRANSFORM_CRLF = 0,        /* CR, LF or CRLF line endings to CRLF */
+    TRANSFORM_LF,              /* CR, LF or CRLF line endings to LF */
+    TRANSFORM_STRIP_NONPRINT,  /* Drop all but printable ASCII, tab, CR, LF */
+    TRANSFORM_HEX,             /* Lowercase hex, a line per packet */
+    TRANSFORM_BASE64,          /* Base64 with padding, a line per packet */
+    TRANSFORM_SLIP,            /* SLIP decode (RFC 1055), a packet per END */
+    TRANSFORM_COBS,            /* COBS decode, a packet per 0x00 */
+};
+
+/* Bytes with the end offset of each packet in them */
+typedef struct transformBuf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    size_t *ends;
+    int nends;
+    int endsize;
+} transformBuf;
+
+typedef struct transformStage {
+    int type;                  /* TRANSFORM_* */
+    int cr;                    /* Last byte was a CR (crlf, lf) */
+    int esc;                   /* Last byte was ESC (slip) */
+    int overflow;              /* Packet too large, skip to its end */
+    unsigned char *pkt;        /* Packet being decoded (slip, cobs),
+                                  TRANSFORM_MAX_PACKET bytes */
+    size_t pktlen;
+} transformStage;
+
+typedef struct transformChain {
+    char spec[128];            /* Normalized stage list, ie. crlf,hex */
+    int nstages;
+    transformStage stages[TRANSFORM_MAX_STAGES];
+    transformBuf buf[2];       /* Between two stages */
+    transformBuf out;          /* Output of the last transformApply() */
+    struct iovec *iov;         /* Output packets, pointing into out */
+    int *src;                  /* Input buffer each output packet comes from */
+    int iovcnt;
+    int iovsize;
+    size_t len;                /* Total number of bytes in iov */
+    int ready;                 /* iov holds the current input, set by users
+                                  sharing the chain */
+    unsigned long long in_bytes;
+    unsigned long long out_bytes;
+    unsigned long long packet_drops; /* Decoded packets dropped, invalid or
+                                        too large */
+    struct transformChain *next;
+} transformChain;
+
+/**
+ * @brief Create a chain from a list of stage names.
+ *
+ * @param[in] spec - Stage names separated by commas or spaces: crlf, lf,
+ *                   strip-nonprint, hex, base64, slip, cobs
+ *
+ * @return Pointer to a newly allocated chain, or NULL if a name is unknown
+ *         or there are too many stages
+ */
+transformChain *transformCreate(const char *spec);
+
+/**
+ * @brief Free a chain.
+ *
+ * @param[in] c - Chain
+ */
+void transformFree(transformChain *c);
+
+/**
+ * @brief Run buffers through the chain, one output buffer per packet. The
+ *        packets of input buffer j come in order with c->src set to j,
+ *        the output stays valid until the next call.
+ *
+ * @param[in] c - Chain
+ * @param[in] iov - Input buffers
+ * @param[in] iovcnt - Number of buffers
+ *
+ * @return c->iov, c->iovcnt buffers long
+ */
+const struct iovec *transformApply(transformChain *c, const struct iovec *iov,
+                                   int iovcnt);
+
+#endif
@@ -0,0 +1,89 @@
+import argparse
+import os
+import select
+import struct
+import time
+import tty
+
+HEADER = struct.Struct('!2sBBIIIQ')
+FLAG_CORRUPT = 1
+FLAG_HISTORY = 2
+
+
+def monotonic_us():
+    return int(time.clock_gettime(time.CLOCK_MONOTONIC) * 1000000)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(
+        description='Framed output reader, prints latency and losses')
+    parser.add_argument('device', type=str)
+    parser.add_argument('--interval', type=float, default=1.0)
+    parser.add_argument('--dump', action='store_true',
+                        help='print every record')
+    args = parser.parse_args()
+
+    fd = os.open(args.device, os.O_RDONLY | os.O_NOCTTY)
+    tty.setraw(fd)
+
+    buf = b''
+    expected = None
+    drops = None
+    records = gaps = lost = corrupt = history = 0
+    lat_sum = lat_max = 0
+    last = time.time()
+
+    try:
+        while True:
+            ready, _, _ = select.select([fd], [], [], args.interval)
+            if ready:
+                data = os.read(fd, 65536)
+                if not data:
+                    break
+                buf += data
+
+            while len(buf) >= HEADER.size:
+                magic, version, flags, length, seq, rdrops, us = \
+                    HEADER.unpack_from(buf)
+                if magic != b'SF' or version != 1:
+                    raise SystemExit('Not a framed stream, or out of sync')
+                if len(buf) < HEADER.size + length:
+                    break
+                payload = buf[HEADER.size:HEADER.size + length]
+                buf = buf[HEADER.size + length:]
+
+                if flags & FLAG_HISTORY:
+                    history += 1
+                    continue
+
+                records += 1
+                latency = monotonic_us() - us
+                lat_sum += latency
+                lat_max = max(lat_max, latency)
+                if flags & FLAG_CORRUPT:
+                    corrupt += 1
+                # Packets decoded from one frame share its sequence
+                if expected is not None and seq != expected and \
+                        seq != (expected - 1) & 0xffffffff:
+                    gaps += 1
+                if drops is not None and rdrops != drops:
+                    lost += (rdrops - drops) & 0xffffffff
+                expected = (seq + 1) & 0xffffffff
+                drops = rdrops
+
+                if args.dump:
+                    print('%10u %6u us %s%s %r' % (
+                        seq, latency, 'C' if flags & FLAG_CORRUPT else '-',
+                        'H' if flags & FLAG_HISTORY else '-', payload))
+
+            now = time.time()
+            if now - last >= args.interval:
+                print('records=%d latency_avg_us=%d latency_max_us=%d '
+                      'seq_gaps=%d lost=%d corrupt=%d history=%d' % (
+                          records, lat_sum // records if records else 0,
+                          lat_max, gaps, lost, corrupt, history))
+                records = gaps = lost = corrupt = history = 0
+                lat_sum = lat_max = 0
+                last = now
+    except KeyboardInterrupt:
+        pass
@@ -0,0 +1,56 @@
+import argparse
+import socket
+import struct
+import time
+
+HEADER = struct.Struct('!2sBBI')
+FLAG_CORRUPT = 1
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Multicast gap counter')
+    parser.add_argument('group', type=str, nargs='?', default='239.1.2.3')
+    parser.add_argument('port', type=int, nargs='?', default=5000)
+    parser.add_argument('--interface', type=str, default='0.0.0.0')
+    parser.add_argument('--interval', type=float, default=1.0)
+    args = parser.parse_args()
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(('', args.port))
+    mreq = struct.pack('4s4s', socket.inet_aton(args.group),
+                       socket.inet_aton(args.interface))
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+
+    expected = None
+    received = lost = reordered = corrupt = 0
+    last = time.time()
+
+    try:
+        while True:
+            data = sock.recv(65535)
+            if len(data) < HEADER.size:
+                continue
+
+            magic, version, flags, seq = HEADER.unpack_from(data)
+            if magic != b'SP' or version != 1:
+                continue
+
+            received += 1
+            if flags & FLAG_CORRUPT:
+                corrupt += 1
+
+            if expected is not None:
+                gap = (seq - expected) & 0xffffffff
+                if gap >= 0x80000000:
+                    reordered += 1
+                    continue
+                lost += gap
+            expected = (seq + 1) & 0xffffffff
+
+            if time.time() - last >= args.interval:
+                print('received=%d lost=%d reordered=%d corrupt=%d' %
+                      (received, lost, reordered, corrupt))
+                last = time.time()
+    except KeyboardInterrupt:
+        print('received=%d lost=%d reordered=%d corrupt=%d' %
+              (received, lost, reordered, corrupt))